@@ -0,0 +1,106 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdalign.h>
+
+#include "arena.h"
+
+arena_t line_arena = {NULL, 0};
+
+#define ARENA_ALIGN alignof(max_align_t)
+
+// Round n up to a multiple of ARENA_ALIGN
+static size_t align_up(size_t n)
+{
+    return (n + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+}
+
+// Header size, rounded so the data after it is aligned
+static size_t block_header(void)
+{
+    return align_up(sizeof(arena_block_t));
+}
+
+/* Put a new block of at least size usable bytes at the head.
+ * Return: 0 on success, -1 if out of memory
+ */
+static int add_block(arena_t *arena, size_t size)
+{
+    if (size < ARENA_BLOCK_SIZE)
+        size = ARENA_BLOCK_SIZE;
+
+    arena_block_t *block = malloc(block_header() + size);
+    if (block == NULL)
+        return -1;
+
+    block->next = arena->head;
+    block->size = size;
+    block->used = 0;
+    arena->head = block;
+    arena->total += size;
+    return 0;
+}
+
+void *arena_alloc(arena_t *arena, size_t size)
+{
+    size = align_up(size ? size : 1);
+
+    arena_block_t *block = arena->head;
+    if (block == NULL || block->size - block->used < size)
+    {
+        // Grow geometrically so a long line needs few blocks
+        size_t want = arena->total > size ? arena->total : size;
+        if (add_block(arena, want) == -1)
+            return NULL;
+        block = arena->head;
+    }
+
+    void *ptr = (char *)block + block_header() + block->used;
+    block->used += size;
+    return ptr;
+}
+
+char *arena_strndup(arena_t *arena, const char *str, size_t len)
+{
+    char *copy = arena_alloc(arena, len + 1);
+    if (copy == NULL)
+        return NULL;
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+char *arena_strdup(arena_t *arena, const char *str)
+{
+    return arena_strndup(arena, str, strlen(str));
+}
+
+void arena_reset(arena_t *arena)
+{
+    if (arena->head == NULL)
+        return;
+
+    // One block that fit everything: just rewind it
+    if (arena->head->next == NULL)
+    {
+        arena->head->used = 0;
+        return;
+    }
+
+    // Several blocks: merge them into one so the next line fits in it
+    size_t total = arena->total;
+    arena_free(arena);
+    add_block(arena, total);
+}
+
+void arena_free(arena_t *arena)
+{
+    arena_block_t *block = arena->head;
+    while (block != NULL)
+    {
+        arena_block_t *next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->head = NULL;
+    arena->total = 0;
+}
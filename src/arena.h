@@ -0,0 +1,50 @@
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <stddef.h>
+
+
+#define ARENA_BLOCK_SIZE 4096  // Smallest block an arena asks malloc for
+
+
+/* Bump-pointer allocator. Memory is handed out from large blocks and is
+ * never freed piece by piece; arena_reset releases everything at once.
+ */
+typedef struct arena_block {
+    struct arena_block *next;
+    size_t size;           // Usable bytes after the header
+    size_t used;
+} arena_block_t;
+
+typedef struct arena {
+    arena_block_t *head;   // Block currently allocated from
+    size_t total;          // Usable bytes over all blocks
+} arena_t;
+
+
+/* Scratch memory for the line being run. Expanded tokens, variable keys
+ * and job strings live here until the prompt comes back.
+ */
+extern arena_t line_arena;
+
+
+/* Return: size bytes aligned for any type, or NULL if out of memory
+ */
+void *arena_alloc(arena_t *arena, size_t size);
+
+/* Return: a NULL terminated copy of the first len bytes of str (or of
+ * all of str), or NULL if out of memory
+ */
+char *arena_strndup(arena_t *arena, const char *str, size_t len);
+char *arena_strdup(arena_t *arena, const char *str);
+
+/* Release every allocation at once. The memory is kept for reuse, as a
+ * single block big enough for everything the arena held before.
+ */
+void arena_reset(arena_t *arena);
+
+/* Give all memory back to malloc.
+ */
+void arena_free(arena_t *arena);
+
+#endif
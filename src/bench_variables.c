@@ -0,0 +1,62 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "variables.h"
+
+/* Lookup cost of the variable store as the number of variables grows.
+ * Build with `make bench` and run ./bench_variables; the ns/lookup
+ * column should stay roughly flat from 10 to 100000 variables.
+ */
+
+#define LOOKUPS 1000000
+
+static long elapsed_ns(const struct timespec *start, const struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) * 1000000000L + (end->tv_nsec - start->tv_nsec);
+}
+
+int main(void)
+{
+    static const int sizes[] = {10, 100, 1000, 10000, 100000};
+    char key[32];
+
+    printf("%10s %12s\n", "variables", "ns/lookup");
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    {
+        int count = sizes[s];
+        free_variables();
+        for (int i = 0; i < count; i++)
+        {
+            snprintf(key, sizeof(key), "var_%d", i);
+            if (set_variable(key, "value") == -1)
+            {
+                fprintf(stderr, "set_variable failed\n");
+                return 1;
+            }
+        }
+
+        // Spread lookups over all keys so the whole table is touched
+        unsigned int seed = 12345;
+        size_t found = 0;
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < LOOKUPS; i++)
+        {
+            seed = seed * 1103515245 + 12345;
+            snprintf(key, sizeof(key), "var_%u", seed % count);
+            found += get_variable(key) != NULL;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        if (found != LOOKUPS)
+        {
+            fprintf(stderr, "lookup missed a variable\n");
+            return 1;
+        }
+        printf("%10d %12.1f\n", count, (double)elapsed_ns(&start, &end) / LOOKUPS);
+    }
+
+    free_variables();
+    return 0;
+}
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE // splice, copy_file_range
+
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -6,30 +8,139 @@
 #include <limits.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <sys/sendfile.h>
 
 #include "builtins.h"
 #include "io_helpers.h"
 #include "variables.h"
+#include "commands.h"
+#include "network.h"
+#include "plan.h"
+#include "resolve.h"
+
+// ====== Command registry =====
 
-// ====== Command execution =====
+#define ENTRY(name, fn, flags) {name, sizeof(name) - 1, fn, flags}
 
-/* Return: index of builtin or -1 if cmd doesn't match a builtin
+/* Every command the shell runs itself. Builtins that only print or read
+ * streams can also be pipeline stages and background jobs, and run on
+ * threads when they are stages of a foreground pipeline; shell commands
+ * act on the shell's own state, so they always run in the foreground of
+ * the shell process.
  */
-bn_ptr check_builtin(const char *cmd) {
-    ssize_t cmd_num = 0;
-    while (cmd_num < BUILTINS_COUNT &&
-           strncmp(BUILTINS[cmd_num], cmd, MAX_STR_LEN) != 0) {
-        cmd_num += 1;
+static const builtin_entry_t BUILTIN_TABLE[] = {
+    ENTRY("echo", bn_echo, BN_PIPELINE | BN_BACKGROUND | BN_THREAD),
+    ENTRY("ls", bn_ls, BN_PIPELINE | BN_BACKGROUND | BN_THREAD),
+    ENTRY("cd", bn_cd, BN_PIPELINE | BN_BACKGROUND),
+    ENTRY("cat", bn_cat, BN_PIPELINE | BN_BACKGROUND | BN_THREAD),
+    ENTRY("wc", bn_wc, BN_PIPELINE | BN_BACKGROUND | BN_THREAD),
+    ENTRY("exit", NULL, BN_EXIT),
+    ENTRY("kill", cmd_kill, 0),
+    ENTRY("ps", cmd_ps, 0),
+    ENTRY("parallel", cmd_parallel, BN_PIPELINE | BN_BACKGROUND),
+    ENTRY("cache-stats", cmd_cache_stats, 0),
+    ENTRY("export", cmd_export, BN_PIPELINE),
+    ENTRY("unset", cmd_unset, 0),
+    ENTRY("hash", cmd_hash, 0),
+    ENTRY("start-server", cmd_start_server, 0),
+    ENTRY("close-server", cmd_close_server, 0),
+    ENTRY("send", cmd_send, 0),
+    ENTRY("start-client", cmd_start_client, 0),
+};
+#define BUILTIN_COUNT (sizeof(BUILTIN_TABLE) / sizeof(BUILTIN_TABLE[0]))
+
+#define BUILTIN_SLOTS 64        // Index size (power of 2, > BUILTIN_COUNT)
+#define BUILTIN_NAME_MAX 16     // No registered name is longer
+
+/* Open-addressed index into BUILTIN_TABLE (entry number + 1, 0 = empty),
+ * filled from the table on first use. A lookup hashes the length and
+ * the first and last characters, so it is one probe and one memcmp.
+ */
+static unsigned char builtin_index[BUILTIN_SLOTS];
+static int builtin_index_ready = 0;
+
+static size_t builtin_slot(const char *name, size_t len) {
+    return (len * 31 + (unsigned char)name[0] * 7 +
+            (unsigned char)name[len - 1]) & (BUILTIN_SLOTS - 1);
+}
+
+static void build_builtin_index(void) {
+    for (size_t i = 0; i < BUILTIN_COUNT; i++) {
+        size_t slot = builtin_slot(BUILTIN_TABLE[i].name, BUILTIN_TABLE[i].len);
+        while (builtin_index[slot] != 0) {
+            slot = (slot + 1) & (BUILTIN_SLOTS - 1);
+        }
+        builtin_index[slot] = i + 1;
     }
-    if (cmd_num >= BUILTINS_COUNT) {
+    builtin_index_ready = 1;
+}
+
+/* Return: registry entry for cmd, or NULL if it isn't a shell command
+ */
+const builtin_entry_t *find_builtin(const char *cmd) {
+    size_t len = strnlen(cmd, BUILTIN_NAME_MAX + 1);
+    if (len == 0 || len > BUILTIN_NAME_MAX) {
         return NULL;
     }
-    return BUILTINS_FN[cmd_num];
+    if (!builtin_index_ready) {
+        build_builtin_index();
+    }
+
+    size_t slot = builtin_slot(cmd, len);
+    while (builtin_index[slot] != 0) {
+        const builtin_entry_t *entry = &BUILTIN_TABLE[builtin_index[slot] - 1];
+        if (entry->len == len && memcmp(entry->name, cmd, len) == 0) {
+            return entry;
+        }
+        slot = (slot + 1) & (BUILTIN_SLOTS - 1);
+    }
+    return NULL;
+}
+
+/* Return: function of cmd if it is a builtin that can run as a pipeline
+ * stage, NULL otherwise
+ */
+bn_ptr check_builtin(const char *cmd) {
+    const builtin_entry_t *entry = find_builtin(cmd);
+    if (entry == NULL || !(entry->flags & BN_PIPELINE)) {
+        return NULL;
+    }
+    return entry->fn;
 }
 
 
 // ===== Builtins =====
 
+/* Print the entries of dir that contain substring (all if NULL), one per
+ * line. Names go straight into the output buffer, so there is no limit
+ * on their number or length.
+ */
+static void print_entries(DIR *dir, const char *substring) {
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        // If substring filter is active, check if name contains it
+        if (substring != NULL && strstr(entry->d_name, substring) == NULL) {
+            continue;
+        }
+        output_write(entry->d_name, strlen(entry->d_name));
+        output_write("\n", 1);
+    }
+}
+
+/* Return: 1 if entry (found at full_path) is a directory to recurse into.
+ * d_type answers without a stat() unless the filesystem doesn't report
+ * it. Symlinks are not followed, so links like /usr/bin/X11 -> . don't
+ * send the listing round in circles.
+ */
+static int is_directory(const struct dirent *entry, const char *full_path) {
+    if (entry->d_type != DT_UNKNOWN) {
+        return entry->d_type == DT_DIR;
+    }
+    struct stat st;
+    return lstat(full_path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
 /* Prereq: tokens is a NULL terminated sequence of strings.
  * Return 0 on success and -1 on error ... but there are no errors on echo. 
  */
@@ -41,19 +152,19 @@ bn_ptr check_builtin(const char *cmd) {
     
     // If no arguments, just print a newline
     if (tokens[1] == NULL) {
-        write(STDOUT_FILENO, "\n", 1);
+        output_write("\n", 1);
         return 0;
     }
     
     while (tokens[index] != NULL) {
         if (!first) {
-            write(STDOUT_FILENO, " ", 1);
+            output_write(" ", 1);
         }
-        write(STDOUT_FILENO, tokens[index], strlen(tokens[index]));
+        output_write(tokens[index], strlen(tokens[index]));
         first = 0;
         index += 1;
     }
-    write(STDOUT_FILENO, "\n", 1);
+    output_write("\n", 1);
     
     return 0;
 }
@@ -69,29 +180,7 @@ ssize_t list_directory_recursive(const char *path, int depth, const char *substr
     }
     
     struct dirent *entry;
-    char entries[MAX_STR_LEN][MAX_STR_LEN]; // To store entries for sorting
-    int entry_count = 0;
-    
-    // First, collect all entries
-    while ((entry = readdir(dir)) != NULL) {
-        // If substring filter is active, check if name contains it
-        if (substring != NULL && strstr(entry->d_name, substring) == NULL) {
-            continue;
-        }
-        
-        // Add to our collection
-        if (entry_count < MAX_STR_LEN) {
-            strncpy(entries[entry_count], entry->d_name, MAX_STR_LEN - 1);
-            entries[entry_count][MAX_STR_LEN - 1] = '\0';
-            entry_count++;
-        }
-    }
-    
-    // Display the entries
-    for (int i = 0; i < entry_count; i++) {
-        display_message(entries[i]);
-        display_message("\n");
-    }
+    print_entries(dir, substring);
     
     // If we should recurse into subdirectories and depth allows
     if (depth > 1 || depth == -1) {
@@ -108,12 +197,7 @@ ssize_t list_directory_recursive(const char *path, int depth, const char *substr
             snprintf(full_path, PATH_MAX, "%s/%s", path, entry->d_name);
             
             // Check if it's a directory
-            struct stat st;
-            if (stat(full_path, &st) != 0) {
-                // Skip this entry if we can't stat it
-                continue;
-            }
-            if (S_ISDIR(st.st_mode)) {
+            if (is_directory(entry, full_path)) {
                 // Only recurse if we have depth remaining
                 int new_depth = (depth == -1) ? -1 : depth - 1;
                 
@@ -189,31 +273,7 @@ ssize_t bn_ls(char **tokens) {
     
     // For non-recursive listing
     if (!recursive) {
-        struct dirent *entry;
-        char entries[MAX_STR_LEN][MAX_STR_LEN]; // To store entries for sorting
-        int entry_count = 0;
-        
-        // First, collect all entries
-        while ((entry = readdir(dir)) != NULL) {
-            // If substring filter is active, check if name contains it
-            if (substring != NULL && strstr(entry->d_name, substring) == NULL) {
-                continue;
-            }
-            
-            // Add to our collection
-            if (entry_count < MAX_STR_LEN) {
-                strncpy(entries[entry_count], entry->d_name, MAX_STR_LEN - 1);
-                entries[entry_count][MAX_STR_LEN - 1] = '\0';
-                entry_count++;
-            }
-        }
-        
-        // Display the entries
-        for (int i = 0; i < entry_count; i++) {
-            display_message(entries[i]);
-            display_message("\n");
-        }
-        
+        print_entries(dir, substring);
         closedir(dir);
         return 0;
     }
@@ -262,43 +322,159 @@ ssize_t bn_cd(char **tokens) {
 }
 
 
+// ====== cat =====
+
+#define CAT_BUF_SIZE (128 * 1024)   // Fallback copy buffer
+#define CAT_BUF_ALIGN 4096          // Page aligned for the kernel's copies
+#define CAT_CHUNK (1 << 30)         // Most bytes asked of one kernel copy
+
+// Ways to move a file's bytes to the output without passing through cat
+enum { CAT_READ, CAT_COPY_RANGE, CAT_SENDFILE, CAT_SPLICE };
+
+/* Pick the cheapest kernel path from in_fd to out_fd. Files are only
+ * copied in the kernel when stat gives them a size: /proc and /sys files
+ * report 0 and the kernel copies nothing out of them.
+ */
+static int cat_method(int in_fd, int out_fd) {
+    struct stat in_st, out_st;
+    if (in_fd == -1 || out_fd == -1 ||
+        fstat(in_fd, &in_st) == -1 || fstat(out_fd, &out_st) == -1) {
+        return CAT_READ;
+    }
+
+    int in_file = S_ISREG(in_st.st_mode) && in_st.st_size > 0;
+    if (S_ISFIFO(in_st.st_mode) || S_ISFIFO(out_st.st_mode)) {
+        return in_file || S_ISFIFO(in_st.st_mode) ? CAT_SPLICE : CAT_READ;
+    }
+    if (in_file && S_ISREG(out_st.st_mode)) return CAT_COPY_RANGE;
+    if (in_file && S_ISSOCK(out_st.st_mode)) return CAT_SENDFILE;
+    return CAT_READ;
+}
+
+/* Move everything left in in_fd to out_fd in the kernel.
+ * Return: 0 once in_fd is drained, 1 if the kernel can't do it for these
+ * two (the caller copies the rest itself) and -1 on error
+ */
+static int cat_kernel_copy(int in_fd, int out_fd, int method) {
+    for (;;) {
+        ssize_t n;
+        if (method == CAT_COPY_RANGE) {
+            n = copy_file_range(in_fd, NULL, out_fd, NULL, CAT_CHUNK, 0);
+        } else if (method == CAT_SENDFILE) {
+            n = sendfile(out_fd, in_fd, NULL, CAT_CHUNK);
+        } else {
+            n = splice(in_fd, NULL, out_fd, NULL, CAT_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE);
+        }
+
+        if (n > 0) continue;
+        if (n == 0) return 0;
+        if (errno == EINTR) continue;
+        // Unsupported for these files (other file systems, O_APPEND, ...)
+        if (errno == EINVAL || errno == EXDEV || errno == ENOSYS ||
+            errno == EOPNOTSUPP || errno == EBADF) {
+            return 1;
+        }
+        return -1;
+    }
+}
+
+// write() until all of buf is out
+static int write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Copy in_fd (-1 for the command's input) to the output, in the kernel
+ * when both ends allow it, else through buf.
+ * Return: 0 on success, -1 on a read error
+ */
+static int cat_stream(int in_fd, char *buf) {
+    int src = in_fd == -1 ? raw_input_fd() : in_fd;
+    int out_fd = raw_output_fd();
+
+    int method = cat_method(src, out_fd);
+    if (method != CAT_READ) {
+        int copied = cat_kernel_copy(src, out_fd, method);
+        // A reader that went away ends the copy, as it does for output_write
+        if (copied == -1 && errno == EPIPE) return 0;
+        if (copied == -1) return -1;
+        // What is left (usually nothing) is read below; that read is also
+        // the end of file check for a kernel copy that moved nothing
+    }
+
+    ssize_t bytes_read;
+    for (;;) {
+        if (in_fd == -1) {
+            bytes_read = read_input(buf, CAT_BUF_SIZE);
+        } else {
+            do {
+                bytes_read = read(in_fd, buf, CAT_BUF_SIZE);
+            } while (bytes_read == -1 && errno == EINTR);
+        }
+        if (bytes_read <= 0) break;
+
+        // Stdin may be a terminal; pass each chunk on as it arrives
+        if (out_fd == -1) {
+            output_write(buf, bytes_read);
+            flush_output();
+        } else if (write_all(out_fd, buf, bytes_read) == -1) {
+            break;
+        }
+    }
+    return bytes_read < 0 ? -1 : 0;
+}
+
 /* Prereq: tokens is a NULL terminated sequence of strings.
+ * Concatenates the files named in tokens, or copies stdin without any.
  * Return 0 on success and -1 on error.
  */
 ssize_t bn_cat(char **tokens) {
+    char *buffer = aligned_alloc(CAT_BUF_ALIGN, CAT_BUF_SIZE);
+    if (buffer == NULL) {
+        display_error("ERROR: Out of memory", "");
+        return -1;
+    }
+
     // Handle stdin case (from pipe or redirection)
     if (tokens[1] == NULL) {
-        char buffer[MAX_STR_LEN];
-        ssize_t bytes_read;
-        
-        while ((bytes_read = read(STDIN_FILENO, buffer, MAX_STR_LEN)) > 0) {
-            write(STDOUT_FILENO, buffer, bytes_read);
-        }
-        
-        if (bytes_read < 0) {
+        int result = cat_stream(-1, buffer);
+        free(buffer);
+        if (result == -1) {
             display_error("ERROR: Failed to read from stdin", "");
             return -1;
         }
         return 0;
     }
 
-    // Normal file handling
-    FILE *file = fopen(tokens[1], "r");
-    if (file == NULL) {
-        display_error("ERROR: Cannot open file", "");
-        display_error("ERROR: Builtin failed: cat", "");
-        return -1;
+    // Every file is copied even if one of them fails
+    ssize_t result = 0;
+    for (int i = 1; tokens[i] != NULL; i++) {
+        int fd = open(tokens[i], O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            display_error("ERROR: Cannot open file", "");
+            result = -1;
+            continue;
+        }
+        if (cat_stream(fd, buffer) == -1) {
+            display_error("ERROR: Failed to read file: ", tokens[i]);
+            result = -1;
+        }
+        close(fd);
     }
+    free(buffer);
 
-    char buffer[MAX_STR_LEN];
-    size_t bytes_read;
-    
-    while ((bytes_read = fread(buffer, 1, MAX_STR_LEN, file)) > 0) {
-        write(STDOUT_FILENO, buffer, bytes_read);
+    if (result == -1) {
+        display_error("ERROR: Builtin failed: cat", "");
     }
-
-    fclose(file);
-    return 0;
+    return result;
 }
 
 /* Prereq: tokens is a NULL terminated sequence of strings.
@@ -306,43 +482,52 @@ ssize_t bn_cat(char **tokens) {
  */
 ssize_t bn_wc(char **tokens) {
     int word_count = 0, char_count = 0, newline_count = 0, in_word = 0;
-    FILE *input = NULL;
-    
-    if (tokens[1] == NULL) {
-        input = stdin;
-    } else {
-        input = fopen(tokens[1], "r");
-        if (input == NULL) {
+    int fd = -1;
+
+    if (tokens[1] != NULL) {
+        fd = open(tokens[1], O_RDONLY);
+        if (fd == -1) {
             display_error("ERROR: Cannot open file", "");
             return -1;
         }
     }
 
-    int c;
-    while ((c = fgetc(input)) != EOF) {
-        char_count++;
-        
-        if (c == '\n') newline_count++;
-        
-        if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
-            in_word = 0;
-        } else if (!in_word) {
-            in_word = 1;
-            word_count++;
+    // Count a block at a time; stdin may be a pipe or a channel
+    char buffer[4096];
+    ssize_t bytes_read;
+    for (;;) {
+        if (fd == -1) {
+            bytes_read = read_input(buffer, sizeof(buffer));
+        } else {
+            bytes_read = read(fd, buffer, sizeof(buffer));
+        }
+        if (bytes_read <= 0) break;
+
+        char_count += bytes_read;
+        for (ssize_t i = 0; i < bytes_read; i++) {
+            char c = buffer[i];
+            if (c == '\n') newline_count++;
+
+            if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+                in_word = 0;
+            } else if (!in_word) {
+                in_word = 1;
+                word_count++;
+            }
         }
     }
 
-    if (input != stdin) fclose(input);
+    if (fd != -1) close(fd);
 
     char result[MAX_STR_LEN];
     snprintf(result, MAX_STR_LEN, "word count %d\n", word_count);
-    write(STDOUT_FILENO, result, strlen(result));
+    output_write(result, strlen(result));
     
     snprintf(result, MAX_STR_LEN, "character count %d\n", char_count);
-    write(STDOUT_FILENO, result, strlen(result));
+    output_write(result, strlen(result));
     
     snprintf(result, MAX_STR_LEN, "newline count %d\n", newline_count);
-    write(STDOUT_FILENO, result, strlen(result));
+    output_write(result, strlen(result));
     
     return 0;
 }
\ No newline at end of file
@@ -16,15 +16,34 @@ ssize_t bn_cat(char **tokens);
 ssize_t bn_wc(char **tokens);
 
 
-/* Return: index of builtin or -1 if cmd doesn't match a builtin
+/* Flags describing where a registered command may run
  */
-bn_ptr check_builtin(const char *cmd);
+#define BN_PIPELINE   0x1   // Can run as a pipeline stage (in a child)
+#define BN_BACKGROUND 0x2   // Can be started as a background job with '&'
+#define BN_EXIT       0x4   // Ends the shell; handled by main() itself
+#define BN_THREAD     0x8   // Only touches its streams, so a pipeline stage
+                            // can run on a thread of the shell, no fork
+
+/* One entry of the command registry. Every command the shell handles
+ * itself (builtins proper and shell commands like kill or send) has an
+ * entry in BUILTIN_TABLE in builtins.c; adding a command means adding a
+ * line there.
+ */
+typedef struct builtin_entry {
+    const char *name;
+    size_t len;         // strlen(name)
+    bn_ptr fn;          // NULL for commands main() handles (exit)
+    int flags;
+} builtin_entry_t;
 
 
-/* BUILTINS and BUILTINS_FN are parallel arrays of length BUILTINS_COUNT
+/* Return: registry entry for cmd, or NULL if it isn't a shell command
  */
-static const char * const BUILTINS[] = {"echo", "ls", "cd", "cat", "wc"};
-static const bn_ptr BUILTINS_FN[] = {bn_echo, bn_ls, bn_cd, bn_cat, bn_wc, NULL};    // Extra null element for 'non-builtin'
-static const ssize_t BUILTINS_COUNT = sizeof(BUILTINS) / sizeof(char *);
+const builtin_entry_t *find_builtin(const char *cmd);
+
+/* Return: function of cmd if it is a builtin that can run as a pipeline
+ * stage, NULL otherwise (external commands are then looked up on PATH)
+ */
+bn_ptr check_builtin(const char *cmd);
 
 #endif
\ No newline at end of file
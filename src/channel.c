@@ -0,0 +1,110 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "channel.h"
+
+struct channel {
+    pthread_mutex_t lock;
+    pthread_cond_t readable;   // Signalled when data arrives or the writer is done
+    pthread_cond_t writable;   // Signalled when room frees up or the reader is done
+    size_t head;               // Offset of the oldest unread byte
+    size_t count;              // Unread bytes
+    int writer_done;
+    int reader_done;
+    char data[CHANNEL_SIZE];
+};
+
+channel_t *channel_create(void)
+{
+    channel_t *ch = malloc(sizeof(channel_t));
+    if (ch == NULL)
+        return NULL;
+
+    pthread_mutex_init(&ch->lock, NULL);
+    pthread_cond_init(&ch->readable, NULL);
+    pthread_cond_init(&ch->writable, NULL);
+    ch->head = 0;
+    ch->count = 0;
+    ch->writer_done = 0;
+    ch->reader_done = 0;
+    return ch;
+}
+
+ssize_t channel_write(channel_t *ch, const void *buf, size_t len)
+{
+    const char *src = buf;
+    size_t left = len;
+
+    pthread_mutex_lock(&ch->lock);
+    while (left > 0)
+    {
+        while (ch->count == CHANNEL_SIZE && !ch->reader_done)
+            pthread_cond_wait(&ch->writable, &ch->lock);
+        if (ch->reader_done)
+        {
+            pthread_mutex_unlock(&ch->lock);
+            return -1;
+        }
+
+        // Copy into the free space, which may wrap around the end once
+        size_t tail = (ch->head + ch->count) % CHANNEL_SIZE;
+        size_t room = CHANNEL_SIZE - ch->count;
+        size_t n = left < room ? left : room;
+        size_t first = n < CHANNEL_SIZE - tail ? n : CHANNEL_SIZE - tail;
+        memcpy(ch->data + tail, src, first);
+        memcpy(ch->data, src + first, n - first);
+
+        ch->count += n;
+        src += n;
+        left -= n;
+        pthread_cond_signal(&ch->readable);
+    }
+    pthread_mutex_unlock(&ch->lock);
+    return len;
+}
+
+ssize_t channel_read(channel_t *ch, void *buf, size_t len)
+{
+    pthread_mutex_lock(&ch->lock);
+    while (ch->count == 0 && !ch->writer_done)
+        pthread_cond_wait(&ch->readable, &ch->lock);
+
+    size_t n = len < ch->count ? len : ch->count;
+    size_t first = n < CHANNEL_SIZE - ch->head ? n : CHANNEL_SIZE - ch->head;
+    memcpy(buf, ch->data + ch->head, first);
+    memcpy((char *)buf + first, ch->data, n - first);
+
+    ch->head = (ch->head + n) % CHANNEL_SIZE;
+    ch->count -= n;
+    if (n > 0)
+        pthread_cond_signal(&ch->writable);
+    pthread_mutex_unlock(&ch->lock);
+    return n;
+}
+
+void channel_close_write(channel_t *ch)
+{
+    pthread_mutex_lock(&ch->lock);
+    ch->writer_done = 1;
+    pthread_cond_signal(&ch->readable);
+    pthread_mutex_unlock(&ch->lock);
+}
+
+void channel_close_read(channel_t *ch)
+{
+    pthread_mutex_lock(&ch->lock);
+    ch->reader_done = 1;
+    pthread_cond_signal(&ch->writable);
+    pthread_mutex_unlock(&ch->lock);
+}
+
+void channel_free(channel_t *ch)
+{
+    if (ch == NULL)
+        return;
+    pthread_cond_destroy(&ch->readable);
+    pthread_cond_destroy(&ch->writable);
+    pthread_mutex_destroy(&ch->lock);
+    free(ch);
+}
@@ -0,0 +1,43 @@
+#ifndef __CHANNEL_H__
+#define __CHANNEL_H__
+
+#include <sys/types.h>
+
+
+#define CHANNEL_SIZE 65536     // Bytes a channel holds, like a kernel pipe
+
+
+/* In-memory pipe between two pipeline stages running on threads of the
+ * shell: a ring buffer with one writer and one reader. Writes block while
+ * it is full and reads while it is empty, so stages run in lock step the
+ * way they would across a kernel pipe.
+ */
+typedef struct channel channel_t;
+
+
+/* Return: a new empty channel, or NULL if out of memory
+ */
+channel_t *channel_create(void);
+
+/* Copy all len bytes of buf into ch, waiting for room as needed.
+ * Return: len, or -1 if the reader has gone away (the data is dropped,
+ * as a write to a pipe without readers would fail with EPIPE)
+ */
+ssize_t channel_write(channel_t *ch, const void *buf, size_t len);
+
+/* Read up to len bytes, waiting until some are available.
+ * Return: number of bytes read, 0 once the writer is done and ch is empty
+ */
+ssize_t channel_read(channel_t *ch, void *buf, size_t len);
+
+/* Each side says when it is done: the reader then sees end of file, or
+ * the writer has its writes dropped.
+ */
+void channel_close_write(channel_t *ch);
+void channel_close_read(channel_t *ch);
+
+/* Prereq: both sides are done with ch
+ */
+void channel_free(channel_t *ch);
+
+#endif
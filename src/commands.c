@@ -1,3 +1,5 @@
+#define _GNU_SOURCE // pipe2, close_range
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,15 +10,47 @@
 #include <signal.h>
 #include <fcntl.h>
 #include <stdarg.h>
+#include <spawn.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/ioctl.h>
+#include <sys/pidfd.h>
 
 #include "commands.h"
 #include "builtins.h"
 #include "io_helpers.h"
 #include "variables.h"
-
-// Global variables for background process tracking
-static bg_process_t *bg_process_list = NULL;
-static int next_job_id = 1;
+#include "arena.h"
+#include "resolve.h"
+#include "channel.h"
+#include "events.h"
+#include "timing.h"
+
+#define JOB_TABLE_INITIAL 16    // Job slots on first use
+#define JOB_INDEX_INITIAL 32    // Pid index slots on first use (power of 2)
+#define PARALLEL_READ_SIZE 4096 // Bytes of argument lines read at a time
+#define PARALLEL_RETRY_MS 10    // Exit check interval for jobs without a pidfd
+
+/* Background jobs. Job n lives in job_slots[n - 1], so ids are dense,
+ * ps lists jobs in id order, and a finished job's slot goes on a free
+ * list for the next job to reuse. job_index maps the pid of every live
+ * member of every job to its slot (open addressing, at most half full).
+ */
+typedef struct job_index_entry {
+    pid_t pid;
+    unsigned int slot;                // 0 = empty, else slot + 1
+} job_index_entry_t;
+
+static bg_process_t *job_slots = NULL;
+static size_t job_slot_count = 0;     // Slots ever handed out (high water)
+static size_t job_slot_capacity = 0;
+static size_t live_jobs = 0;
+static int free_job_slot = -1;        // Head of the free list, or -1
+static job_index_entry_t *job_index = NULL;
+static size_t job_index_capacity = 0;
+static size_t indexed_pids = 0;
 
 #define DEBUG_MODE 0 // Set to 1 to enable debug logs
 
@@ -35,8 +69,10 @@ void debug_log(const char *format, ...)
     va_end(args);
 }
 
-// Global message queue for background process completion
+// Global message queue for background process completion; the tail
+// pointer makes appending O(1)
 static bg_message_t *bg_message_queue = NULL;
+static bg_message_t *bg_message_tail = NULL;
 
 // Helper function to safely close a file descriptor if it's valid
 void safe_close(int fd)
@@ -47,130 +83,284 @@ void safe_close(int fd)
     }
 }
 
+/* Block SIGCHLD while a child is started and waited for, so the reaper
+ * cannot collect a foreground child before we read its status (or a
+ * background child before its job is recorded). With the event loop
+ * running it is blocked already; this covers the handler fallback.
+ */
+static void block_sigchld(sigset_t *old_mask)
+{
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, old_mask);
+}
+
+// Translate a wait status into the shell's $? convention
+int exit_status_of(int status)
+{
+    if (WIFEXITED(status))
+        return WEXITSTATUS(status);
+    if (WIFSIGNALED(status))
+        return 128 + WTERMSIG(status);
+    return 1;
+}
+
+// Slot in job_index for pid, or the empty slot where it would go
+static size_t job_index_find(pid_t pid)
+{
+    size_t mask = job_index_capacity - 1;
+    size_t i = ((size_t)pid * 2654435761u) & mask;
+    while (job_index[i].slot != 0 && job_index[i].pid != pid)
+    {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+/* Make room in job_index for count more pids.
+ * Return: 0 on success, -1 if out of memory
+ */
+static int job_index_reserve(size_t count)
+{
+    if ((indexed_pids + count) * 2 <= job_index_capacity)
+        return 0;
+
+    size_t new_capacity = job_index_capacity ? job_index_capacity : JOB_INDEX_INITIAL;
+    while ((indexed_pids + count) * 2 > new_capacity)
+    {
+        new_capacity *= 2;
+    }
+    job_index_entry_t *new_index = calloc(new_capacity, sizeof(job_index_entry_t));
+    if (new_index == NULL)
+        return -1;
+
+    job_index_entry_t *old_index = job_index;
+    size_t old_capacity = job_index_capacity;
+    job_index = new_index;
+    job_index_capacity = new_capacity;
+    for (size_t i = 0; i < old_capacity; i++)
+    {
+        if (old_index[i].slot != 0)
+            job_index[job_index_find(old_index[i].pid)] = old_index[i];
+    }
+    free(old_index);
+    return 0;
+}
+
+// Remove the pid index entry at i, shifting back the entries after it
+static void job_index_delete(size_t i)
+{
+    size_t mask = job_index_capacity - 1;
+    size_t j = i;
+    for (;;)
+    {
+        j = (j + 1) & mask;
+        if (job_index[j].slot == 0)
+            break;
+        size_t home = ((size_t)job_index[j].pid * 2654435761u) & mask;
+        // Move j into the hole unless its home lies cyclically in (i, j]
+        if ((i <= j) ? (home <= i || home > j) : (home <= i && home > j))
+        {
+            job_index[i] = job_index[j];
+            i = j;
+        }
+    }
+    job_index[i].slot = 0;
+    indexed_pids--;
+}
+
+/* Take a slot for a new job: a freed one if any, else the next one.
+ * Return: slot number, or -1 if out of memory
+ */
+static int take_job_slot(void)
+{
+    if (free_job_slot != -1)
+    {
+        int slot = free_job_slot;
+        free_job_slot = job_slots[slot].next_free;
+        return slot;
+    }
+
+    if (job_slot_count == job_slot_capacity)
+    {
+        size_t new_capacity = job_slot_capacity ? job_slot_capacity * 2 : JOB_TABLE_INITIAL;
+        bg_process_t *new_slots = realloc(job_slots, new_capacity * sizeof(bg_process_t));
+        if (new_slots == NULL)
+            return -1;
+        job_slots = new_slots;
+        job_slot_capacity = new_capacity;
+    }
+    return job_slot_count++;
+}
+
+// Put a job's slot back on the free list; its members are unindexed already
+static void release_job_slot(int slot)
+{
+    bg_process_t *job = &job_slots[slot];
+    for (int m = 0; m < job->member_count; m++)
+    {
+        unwatch_job(job->members[m].pidfd);
+    }
+    free(job->members);
+    free(job->command);
+    job->pid = 0;
+    job->members = NULL;
+    job->command = NULL;
+    job->next_free = free_job_slot;
+    free_job_slot = slot;
+    live_jobs--;
+
+    // Job ids start again from 1 once every job is done
+    if (live_jobs == 0)
+    {
+        job_slot_count = 0;
+        free_job_slot = -1;
+    }
+}
+
 // Initialize background process tracking
 void init_bg_processes()
 {
-    bg_process_list = NULL;
-    next_job_id = 1;
+    job_slot_count = 0;
+    live_jobs = 0;
+    indexed_pids = 0;
+    free_job_slot = -1;
 }
 
 // Add a background process
 int add_bg_process(pid_t pid, const char *command)
 {
-    debug_log("Adding background process: pid=%d, command=%s", pid, command);
+    return add_bg_job(&pid, 1, 0, command);
+}
+
+// Add a background job of one or more processes
+int add_bg_job(const pid_t *pids, int count, pid_t pgid, const char *command)
+{
+    debug_log("Adding background job: %d processes, pgid=%d, command=%s", count, pgid, command);
 
-    bg_process_t *new_process = malloc(sizeof(bg_process_t));
-    if (new_process == NULL)
+    int started = 0;
+    pid_t shown = -1;
+    for (int i = 0; i < count; i++)
     {
-        debug_log("Failed to allocate memory for background process");
-        return -1;
+        if (pids[i] > 0)
+        {
+            started++;
+            shown = pids[i];
+        }
     }
+    if (started == 0)
+        return -1;
 
-    new_process->pid = pid;
-    new_process->job_id = next_job_id++;
-    new_process->command = strdup(command);
-    if (new_process->command == NULL)
+    char *command_copy = strdup(command);
+    job_member_t *members = malloc(started * sizeof(job_member_t));
+    int slot = -1;
+    if (command_copy == NULL || members == NULL || job_index_reserve(started) == -1 ||
+        (slot = take_job_slot()) == -1)
     {
-        debug_log("Failed to duplicate command string");
-        free(new_process);
+        debug_log("Failed to allocate memory for background process");
+        free(command_copy);
+        free(members);
         return -1;
     }
 
-    new_process->next = bg_process_list;
-    bg_process_list = new_process;
+    bg_process_t *new_process = &job_slots[slot];
+    new_process->pid = shown;
+    new_process->pgid = pgid;
+    new_process->job_id = slot + 1;
+    new_process->command = command_copy;
+    new_process->members = members;
+    new_process->member_count = 0;
+    new_process->next_free = -1;
+    for (int i = 0; i < count; i++)
+    {
+        if (pids[i] <= 0)
+            continue;
+
+        job_member_t *member = &members[new_process->member_count++];
+        member->pid = pids[i];
+        member->pidfd = watch_job(pids[i]);
+        size_t entry = job_index_find(pids[i]);
+        job_index[entry].pid = pids[i];
+        job_index[entry].slot = slot + 1;
+        indexed_pids++;
+    }
+    new_process->running = new_process->member_count;
+    live_jobs++;
 
     // Display job information with exact format required by tests
     char buffer[MAX_STR_LEN];
-    snprintf(buffer, MAX_STR_LEN, "[%d] %d", new_process->job_id, pid);
+    snprintf(buffer, MAX_STR_LEN, "[%d] %d", new_process->job_id, shown);
     display_message(buffer);
     display_message("\n");
 
-    debug_log("Added background process: job_id=%d, pid=%d", new_process->job_id, pid);
+    debug_log("Added background process: job_id=%d, pid=%d", new_process->job_id, shown);
     return new_process->job_id;
 }
 
-// Remove a background process
+// Remove the job pid belongs to, with all of its members
 void remove_bg_process(pid_t pid)
 {
-    bg_process_t *current = bg_process_list;
-    bg_process_t *prev = NULL;
+    bg_process_t *job = find_bg_process_by_pid(pid);
+    if (job == NULL)
+        return;
 
-    while (current != NULL)
+    for (int m = 0; m < job->member_count; m++)
     {
-        if (current->pid == pid)
-        {
-            if (prev == NULL)
-            {
-                bg_process_list = current->next;
-            }
-            else
-            {
-                prev->next = current->next;
-            }
-
-            free(current->command);
-            free(current);
-
-            // FIX: Reset job ID counter when all processes are done
-            if (bg_process_list == NULL)
-            {
-                next_job_id = 1;
-            }
-
-            return;
-        }
-
-        prev = current;
-        current = current->next;
+        if (job->members[m].pid != 0)
+            job_index_delete(job_index_find(job->members[m].pid));
     }
+    release_job_slot(job - job_slots);
 }
 
-// Find a background process by pid
+// Find the job pid belongs to
 bg_process_t *find_bg_process_by_pid(pid_t pid)
 {
-    bg_process_t *current = bg_process_list;
-
-    while (current != NULL)
-    {
-        if (current->pid == pid)
-        {
-            return current;
-        }
-        current = current->next;
-    }
+    if (job_index == NULL || pid <= 0)
+        return NULL;
 
-    return NULL;
+    size_t i = job_index_find(pid);
+    return job_index[i].slot != 0 ? &job_slots[job_index[i].slot - 1] : NULL;
 }
 
-// List all background processes
+// List all background processes, in job id order
 void list_bg_processes()
 {
-    bg_process_t *current = bg_process_list;
-
-    while (current != NULL)
+    for (size_t slot = 0; slot < job_slot_count; slot++)
     {
+        bg_process_t *current = &job_slots[slot];
+        if (current->pid == 0)
+            continue;
+
         char buffer[MAX_STR_LEN];
-        snprintf(buffer, MAX_STR_LEN, "%s %d\n", current->command, current->pid);
+        snprintf(buffer, MAX_STR_LEN, " %d\n", current->pid);
+        display_message(current->command);
         display_message(buffer);
-        current = current->next;
     }
 }
 
 // Free all background process resources
 void free_bg_processes()
 {
-    bg_process_t *current = bg_process_list;
-    bg_process_t *next;
-
-    while (current != NULL)
+    for (size_t slot = 0; slot < job_slot_count; slot++)
     {
-        next = current->next;
-        free(current->command);
-        free(current);
-        current = next;
-    }
+        bg_process_t *job = &job_slots[slot];
+        if (job->pid == 0)
+            continue;
 
-    bg_process_list = NULL;
+        for (int m = 0; m < job->member_count; m++)
+        {
+            unwatch_job(job->members[m].pidfd);
+        }
+        free(job->members);
+        free(job->command);
+    }
+    free(job_slots);
+    free(job_index);
+    job_slots = NULL;
+    job_index = NULL;
+    job_slot_capacity = job_index_capacity = 0;
+    init_bg_processes();
 }
 
 // Background message queue functions
@@ -200,13 +390,9 @@ void add_bg_message(const char *message)
     }
     else
     {
-        bg_message_t *current = bg_message_queue;
-        while (current->next != NULL)
-        {
-            current = current->next;
-        }
-        current->next = new_message;
+        bg_message_tail->next = new_message;
     }
+    bg_message_tail = new_message;
 }
 
 char *get_next_bg_message()
@@ -219,6 +405,10 @@ char *get_next_bg_message()
     bg_message_t *message = bg_message_queue;
     char *msg_text = message->message;
     bg_message_queue = message->next;
+    if (bg_message_queue == NULL)
+    {
+        bg_message_tail = NULL;
+    }
     free(message); // Free the message struct but not the text
 
     return msg_text; // Caller is responsible for freeing this
@@ -229,6 +419,17 @@ int has_bg_messages()
     return bg_message_queue != NULL;
 }
 
+void print_bg_messages(void)
+{
+    char *message;
+    while ((message = get_next_bg_message()) != NULL)
+    {
+        display_message(message);
+        display_message("\n");
+        free(message);
+    }
+}
+
 void free_bg_messages()
 {
     bg_message_t *current = bg_message_queue;
@@ -243,24 +444,52 @@ void free_bg_messages()
     }
 
     bg_message_queue = NULL;
+    bg_message_tail = NULL;
 }
 
-// Mark a process as completed and queue a message
+// Mark a process as completed, and its job once no member is left
 void mark_process_completed(pid_t pid)
 {
-    bg_process_t *process = find_bg_process_by_pid(pid);
-    if (process != NULL)
+    if (job_index == NULL || pid <= 0)
+        return;
+
+    size_t i = job_index_find(pid);
+    if (job_index[i].slot == 0)
+        return;
+
+    int slot = job_index[i].slot - 1;
+    bg_process_t *process = &job_slots[slot];
+    job_index_delete(i);
+    for (int m = 0; m < process->member_count; m++)
     {
-        char buffer[MAX_STR_LEN];
-        // Format must match test expectations EXACTLY: [job_id]+  Done command
-        // Note the TWO spaces between + and Done
-        snprintf(buffer, MAX_STR_LEN, "[%d]+  Done %s", process->job_id, process->command);
-        add_bg_message(buffer);
+        if (process->members[m].pid == pid)
+        {
+            unwatch_job(process->members[m].pidfd);
+            process->members[m].pid = 0;
+            process->members[m].pidfd = -1;
+            break;
+        }
+    }
+    if (--process->running > 0)
+    {
+        debug_log("Job %d: %d exited, %d still running", process->job_id, pid, process->running);
+        return;
+    }
 
-        // Remove process from the list
-        remove_bg_process(pid);
+    // Format must match test expectations EXACTLY: [job_id]+  Done command
+    // Note the TWO spaces between + and Done. Sized for the whole command,
+    // which can be as long as any input line
+    int len = snprintf(NULL, 0, "[%d]+  Done %s", process->job_id, process->command);
+    char *buffer = len >= 0 ? malloc(len + 1) : NULL;
+    if (buffer != NULL)
+    {
+        snprintf(buffer, len + 1, "[%d]+  Done %s", process->job_id, process->command);
+        add_bg_message(buffer);
+        free(buffer);
     }
+    release_job_slot(slot);
 }
+
 // Handle the kill command
 ssize_t cmd_kill(char **tokens)
 {
@@ -280,8 +509,10 @@ ssize_t cmd_kill(char **tokens)
         signum = atoi(tokens[2]);
     }
 
-    // Send the signal
-    if (kill(pid, signum) != 0)
+    // Send the signal, to every stage if pid is part of a pipeline job
+    bg_process_t *job = find_bg_process_by_pid(pid);
+    pid_t target = job != NULL && job->pgid > 0 ? -job->pgid : pid;
+    if (kill(target, signum) != 0)
     {
         if (errno == ESRCH)
         {
@@ -310,209 +541,680 @@ ssize_t cmd_ps(char **tokens __attribute__((unused)))
     return 0;
 }
 
-// Check if a command exists in PATH
-int command_exists(const char *cmd)
+// Execute a command with pipe support
+int execute_system_command(char **tokens, int input_fd, int output_fd, int in_background)
 {
-    // Check for null command
-    if (cmd == NULL || cmd[0] == '\0')
-        return 0;
+    if (tokens == NULL || tokens[0] == NULL)
+    {
+        return -1;
+    }
 
-    // Check absolute path
-    if (cmd[0] == '/')
+    // Resolve the command through the cache; the child execs this path directly
+    phase_begin(PHASE_RESOLVE);
+    const char *path = resolve_command(tokens[0]);
+    phase_end();
+    if (path == NULL)
     {
-        if (access(cmd, X_OK) == 0)
-        {
-            return 1;
-        }
-        return 0;
+        display_error("ERROR: Unknown command: ", tokens[0]);
+        return -1;
     }
 
-    // Check in common directories
-    char path[MAX_STR_LEN];
+    return spawn_system_command(tokens, path, input_fd, output_fd, in_background);
+}
 
-    // Check in /bin
-    snprintf(path, MAX_STR_LEN, "/bin/%s", cmd);
-    if (access(path, X_OK) == 0)
+/* Start an external command without copying the shell: posix_spawn
+ * runs it through vfork/CLONE_VM, so the cost doesn't grow with the
+ * shell's (sanitizer-inflated) address space. stdin/stdout come from
+ * input_fd/output_fd when they aren't the standard ones, the close_count
+ * descriptors in close_fds are closed, and the child starts with
+ * child_mask as its signal mask. A pgroup of 0 or more puts the child in
+ * that process group (0: a new one it leads); -1 leaves it in the shell's.
+ * Return: pid of the child, or -1 with errno set
+ */
+static pid_t spawn_external(const char *path, char **argv, int input_fd, int output_fd,
+                            const int *close_fds, size_t close_count, const sigset_t *child_mask,
+                            pid_t pgroup)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    int err = posix_spawn_file_actions_init(&actions);
+    if (err != 0)
     {
-        return 1;
+        errno = err;
+        return -1;
     }
-
-    // Check in /usr/bin
-    snprintf(path, MAX_STR_LEN, "/usr/bin/%s", cmd);
-    if (access(path, X_OK) == 0)
+    err = posix_spawnattr_init(&attr);
+    if (err != 0)
     {
-        return 1;
+        posix_spawn_file_actions_destroy(&actions);
+        errno = err;
+        return -1;
     }
 
-    // Check using PATH environment variable
-    const char *path_env = getenv("PATH");
-
-    if (path_env)
+    if (input_fd != STDIN_FILENO)
+        err = err ? err : posix_spawn_file_actions_adddup2(&actions, input_fd, STDIN_FILENO);
+    if (output_fd != STDOUT_FILENO)
+        err = err ? err : posix_spawn_file_actions_adddup2(&actions, output_fd, STDOUT_FILENO);
+    for (size_t i = 0; i < close_count; i++)
     {
-        char *path_copy = strdup(path_env);
-        if (path_copy == NULL)
-        {
-            return 0;
-        }
-
-        char *dir = strtok(path_copy, ":");
-
-        while (dir != NULL)
-        {
-            snprintf(path, MAX_STR_LEN, "%s/%s", dir, cmd);
-
-            if (access(path, X_OK) == 0)
-            {
-                free(path_copy);
-                return 1;
-            }
+        if (close_fds[i] > STDERR_FILENO)
+            err = err ? err : posix_spawn_file_actions_addclose(&actions, close_fds[i]);
+    }
+    short flags = POSIX_SPAWN_SETSIGMASK;
+    err = err ? err : posix_spawnattr_setsigmask(&attr, child_mask);
+    if (pgroup >= 0)
+    {
+        flags |= POSIX_SPAWN_SETPGROUP;
+        err = err ? err : posix_spawnattr_setpgroup(&attr, pgroup);
+    }
+    err = err ? err : posix_spawnattr_setflags(&attr, flags);
 
-            dir = strtok(NULL, ":");
-        }
+    pid_t pid = -1;
+    if (err == 0)
+        err = posix_spawn(&pid, path, &actions, &attr, argv, variable_envp());
 
-        free(path_copy);
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    if (err != 0)
+    {
+        errno = err;
+        return -1;
     }
-
-    // If we've reached here, the command doesn't exist
-    return 0;
+    return pid;
 }
 
-// Execute a command with pipe support
-int execute_system_command(char **tokens, int input_fd, int output_fd, int in_background)
+// Execute an already resolved command with pipe support
+int spawn_system_command(char **tokens, const char *path, int input_fd, int output_fd, int in_background)
 {
-    if (tokens == NULL || tokens[0] == NULL)
+    // Start the command; SIGCHLD stays blocked until it is recorded or reaped
+    sigset_t old_mask;
+    flush_output();
+    block_sigchld(&old_mask);
+
+    int redirected[] = {input_fd, output_fd};
+    phase_begin(PHASE_SPAWN);
+    pid_t pid = spawn_external(path, tokens, input_fd, output_fd, redirected, 2,
+                               child_signal_mask(), -1);
+    phase_end();
+
+    // Close pipe ends in parent
+    if (input_fd != STDIN_FILENO)
     {
-        return -1;
+        close(input_fd);
     }
-
-    // Verify the command exists before attempting to execute it
-    if (!command_exists(tokens[0]))
+    if (output_fd != STDOUT_FILENO)
     {
-        display_error("ERROR: Unknown command: ", tokens[0]);
-        return -1;
+        close(output_fd);
     }
 
-    // Create a child process to execute the command
-    pid_t pid = fork();
-
     if (pid == -1)
     {
-        display_error("ERROR: Failed to fork", "");
-        if (input_fd != STDIN_FILENO)
-        {
-            close(input_fd);
-        }
-        if (output_fd != STDOUT_FILENO)
-        {
-            close(output_fd);
-        }
-        return -1;
+        sigprocmask(SIG_SETMASK, &old_mask, NULL);
+        display_error("ERROR: Failed to execute command: ", tokens[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (in_background)
+    {
+        // Background process, don't wait
+        char *command_str = combine_tokens(tokens, 0);
+        add_bg_process(pid, command_str != NULL ? command_str : tokens[0]);
+        sigprocmask(SIG_SETMASK, &old_mask, NULL);
+        return 0;
     }
-    else if (pid == 0)
+
+    // Foreground process, wait for completion
+    int status;
+    struct rusage usage;
+    pid_t waited;
+    phase_begin(PHASE_WAIT);
+    do
     {
-        // Child process
+        waited = wait4(pid, &status, 0, &usage);
+    } while (waited == -1 && errno == EINTR);
+    phase_end();
+    if (waited == pid)
+        timing_add_child(&usage);
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+    return waited == -1 ? -1 : exit_status_of(status);
+}
 
-        // Redirect input if needed
-        if (input_fd != STDIN_FILENO)
+// Where parallel takes its arguments from: the words after :::, or the
+// lines of its input
+typedef struct parallel_args {
+    char **list;          // Next ::: argument, or NULL to read lines
+    char *buf;            // Lines read so far; [pos, len) is unconsumed
+    size_t pos, len, cap;
+    int eof;
+} parallel_args_t;
+
+// One running job of parallel. It is done once its process is reaped
+// (pid 0) and, with -k, its output read to EOF (out_fd -1)
+typedef struct parallel_job {
+    pid_t pid;            // 0 once reaped
+    int pidfd;            // -1 if pidfd_open isn't available
+    int out_fd;           // -k: read end of its output until EOF, else -1
+    size_t index;         // Position of its argument, or PARALLEL_SLOT_FREE
+    char *out;            // -k: output collected so far
+    size_t out_len, out_cap;
+} parallel_job_t;
+#define PARALLEL_SLOT_FREE ((size_t)-1)
+
+/* Return: the next argument (valid until the next call), NULL once there
+ * are no more. Empty lines are skipped.
+ */
+static char *next_parallel_arg(parallel_args_t *args)
+{
+    if (args->list != NULL)
+        return *args->list != NULL ? *args->list++ : NULL;
+
+    for (;;)
+    {
+        char *start = args->buf + args->pos;
+        char *newline = args->pos < args->len ? memchr(start, '\n', args->len - args->pos) : NULL;
+        if (newline != NULL || (args->eof && args->pos < args->len))
         {
-            if (dup2(input_fd, STDIN_FILENO) == -1)
-            {
-                perror("dup2 stdin");
-                exit(EXIT_FAILURE);
-            }
-            close(input_fd);
+            char *end = newline != NULL ? newline : args->buf + args->len;
+            *end = '\0';
+            args->pos = end - args->buf + (newline != NULL);
+            if (end == start)
+                continue;
+            return start;
         }
-
-        // Redirect output if needed
-        if (output_fd != STDOUT_FILENO)
+        if (args->eof)
+            return NULL;
+
+        // Keep the partial line and read more after it (one spare byte
+        // terminates a last line without a newline)
+        if (args->pos < args->len)
+            memmove(args->buf, start, args->len - args->pos);
+        args->len -= args->pos;
+        args->pos = 0;
+        if (args->cap - args->len < PARALLEL_READ_SIZE + 1)
         {
-            if (dup2(output_fd, STDOUT_FILENO) == -1)
-            {
-                perror("dup2 stdout");
-                exit(EXIT_FAILURE);
-            }
-            close(output_fd);
+            size_t new_cap = args->cap ? args->cap * 2 : 2 * PARALLEL_READ_SIZE;
+            char *new_buf = realloc(args->buf, new_cap);
+            if (new_buf == NULL)
+                return NULL;
+            args->buf = new_buf;
+            args->cap = new_cap;
         }
-
-        // Execute the command
-        execvp(tokens[0], tokens);
-        
-        // If execvp returns, there was an error
-        display_error("ERROR: Failed to execute command: ", tokens[0]);
-        exit(EXIT_FAILURE);
+        ssize_t n = read_input(args->buf + args->len, PARALLEL_READ_SIZE);
+        if (n <= 0)
+            args->eof = 1;
+        else
+            args->len += n;
     }
-    else
+}
+
+// Free an argv from parallel_argv
+static void free_parallel_argv(char **argv, char **template, int count)
+{
+    for (int i = 0; i < count; i++)
     {
-        // Parent process
+        if (argv[i] != template[i])
+            free(argv[i]);
+    }
+    free(argv);
+}
 
-        // Close pipe ends in parent
-        if (input_fd != STDIN_FILENO)
+/* Build the command line of one job: every {} in the template replaced
+ * by arg, or arg added at the end if the template has no {}.
+ * Return: malloc'ed NULL terminated argv whose strings are either the
+ * template's, arg or malloc'ed ones (see free_parallel_argv), NULL if
+ * out of memory
+ */
+static char **parallel_argv(char **template, int count, const char *arg)
+{
+    char **argv = calloc(count + 2, sizeof(char *));
+    if (argv == NULL)
+        return NULL;
+
+    size_t arg_len = strlen(arg);
+    int replaced = 0;
+    for (int i = 0; i < count; i++)
+    {
+        const char *tok = template[i];
+        const char *hole = strstr(tok, "{}");
+        if (hole == NULL)
         {
-            close(input_fd);
+            argv[i] = template[i];
+            continue;
         }
-        if (output_fd != STDOUT_FILENO)
+
+        size_t holes = 0;
+        for (const char *p = hole; p != NULL; p = strstr(p + 2, "{}"))
         {
-            close(output_fd);
+            holes++;
         }
-
-        if (in_background)
+        char *word = malloc(strlen(tok) - 2 * holes + arg_len * holes + 1);
+        if (word == NULL)
         {
-            // Background process, don't wait
-            char command_str[MAX_STR_LEN] = "";
-            for (int i = 0; tokens[i] != NULL; i++)
-            {
-                if (i > 0)
-                {
-                    strcat(command_str, " ");
-                }
-                strcat(command_str, tokens[i]);
-            }
-            add_bg_process(pid, command_str);
-            return 0;
+            argv[i] = template[i];
+            free_parallel_argv(argv, template, count);
+            return NULL;
         }
-        else
+        char *out = word;
+        for (; hole != NULL; tok = hole + 2, hole = strstr(tok, "{}"))
         {
-            // Foreground process, wait for completion
-            int status;
-            waitpid(pid, &status, 0);
-            return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+            memcpy(out, tok, hole - tok);
+            out += hole - tok;
+            memcpy(out, arg, arg_len);
+            out += arg_len;
         }
+        strcpy(out, tok);
+        argv[i] = word;
+        replaced = 1;
     }
+    if (!replaced)
+        argv[count] = (char *)arg;
+    return argv;
 }
 
-
-int execute_command(char **tokens, int input_fd, int output_fd, int in_background)
+/* Start the job for arg in slot job. With keep_order its stdout is a
+ * pipe read by parallel; otherwise it writes to parallel's own stdout.
+ * Return: 0 on success, -1 if it could not be started
+ */
+static int start_parallel_job(parallel_job_t *job, char **template, int count, const char *arg,
+                              size_t index, int input_fd, int keep_order)
 {
-    if (tokens == NULL || tokens[0] == NULL)
+    char **argv = parallel_argv(template, count, arg);
+    if (argv == NULL)
+    {
+        display_error("ERROR: Out of memory", "");
+        return -1;
+    }
+    const char *path = resolve_command(argv[0]);
+    if (path == NULL)
     {
+        display_error("ERROR: Unknown command: ", argv[0]);
+        free_parallel_argv(argv, template, count);
         return -1;
     }
 
-    // Check if this is a builtin command
-    bn_ptr builtin_fn = check_builtin(tokens[0]);
-    if (builtin_fn != NULL)
+    int out[2] = {-1, STDOUT_FILENO};
+    if (keep_order && pipe2(out, O_CLOEXEC) == -1)
     {
-        // Handle redirecting stdin/stdout for builtins
-        int old_stdin = -1, old_stdout = -1;
+        display_error("ERROR: Failed to create pipe", "");
+        free_parallel_argv(argv, template, count);
+        return -1;
+    }
 
-        // Redirect input if needed
-        if (input_fd != STDIN_FILENO)
-        {
-            old_stdin = dup(STDIN_FILENO);
-            if (old_stdin == -1)
-            {
-                perror("dup stdin");
-                safe_close(input_fd);
-                if (output_fd != STDOUT_FILENO)
-                {
-                    safe_close(output_fd);
-                }
-                return -1;
-            }
+    // The descriptors of the other jobs are close-on-exec
+    phase_begin(PHASE_SPAWN);
+    pid_t pid = spawn_external(path, argv, input_fd, out[1], NULL, 0, child_signal_mask(), -1);
+    phase_end();
+    if (keep_order)
+        close(out[1]);
+    if (pid == -1)
+    {
+        display_error("ERROR: Failed to execute command: ", argv[0]);
+        safe_close(out[0]);
+        free_parallel_argv(argv, template, count);
+        return -1;
+    }
+    debug_log("parallel: job %zu is pid %d", index, pid);
+    free_parallel_argv(argv, template, count);
+
+    job->pid = pid;
+    job->pidfd = pidfd_open(pid, 0);
+    job->out_fd = out[0];
+    job->index = index;
+    job->out = NULL;
+    job->out_len = job->out_cap = 0;
+    return 0;
+}
 
-            if (dup2(input_fd, STDIN_FILENO) == -1)
-            {
-                perror("dup2 stdin");
+/* Read what a -k job has written.
+ * Return: 0 while its output is open, 1 at EOF
+ */
+static int collect_parallel_output(parallel_job_t *job)
+{
+    if (job->out_cap - job->out_len < PARALLEL_READ_SIZE)
+    {
+        size_t new_cap = job->out_cap ? job->out_cap * 2 : PARALLEL_READ_SIZE;
+        char *new_out = realloc(job->out, new_cap);
+        if (new_out == NULL)
+        {
+            // Drop the output rather than stall the job
+            char discard[PARALLEL_READ_SIZE];
+            ssize_t n = read(job->out_fd, discard, sizeof(discard));
+            return n == 0 || (n == -1 && errno != EINTR);
+        }
+        job->out = new_out;
+        job->out_cap = new_cap;
+    }
+    ssize_t n = read(job->out_fd, job->out + job->out_len, job->out_cap - job->out_len);
+    if (n > 0)
+        job->out_len += n;
+    return n == 0 || (n == -1 && errno != EINTR);
+}
+
+/* Reap a job's process if it has exited (wait set: block until it has).
+ * Return: 1 if it was reaped and failed, 0 otherwise
+ */
+static int reap_parallel_job(parallel_job_t *job, int wait)
+{
+    int status;
+    struct rusage usage;
+    pid_t waited;
+    do
+    {
+        waited = wait4(job->pid, &status, wait ? 0 : WNOHANG, &usage);
+    } while (waited == -1 && errno == EINTR);
+    if (waited == 0)
+        return 0;
+
+    unwatch_job(job->pidfd);
+    job->pid = 0;
+    job->pidfd = -1;
+    if (waited != -1)
+        timing_add_child(&usage);
+    return waited == -1 || exit_status_of(status) != 0;
+}
+
+/* Keep a finished -k job's output until its turn to be printed (a job
+ * that failed to start is held too, with no output). If there is no
+ * memory to hold it, it is printed now, out of order, rather than lost.
+ */
+static void hold_parallel_output(parallel_job_t **held, size_t *held_count, size_t *held_cap,
+                                 const parallel_job_t *job)
+{
+    if (*held_count == *held_cap)
+    {
+        size_t new_cap = *held_cap ? *held_cap * 2 : 16;
+        parallel_job_t *new_held = realloc(*held, new_cap * sizeof(parallel_job_t));
+        if (new_held == NULL)
+        {
+            if (job->out_len > 0)
+                output_write(job->out, job->out_len);
+            free(job->out);
+            return;
+        }
+        *held = new_held;
+        *held_cap = new_cap;
+    }
+    (*held)[(*held_count)++] = *job;
+}
+
+/* Shell command: parallel [-j N] [-k] command [arg...] [::: arg...]
+ * Runs command once per argument (the words after :::, or else the
+ * lines of its input), with {} in its words replaced by the argument or
+ * the argument added at the end. Exactly N jobs (default: one per CPU)
+ * run at a time, the next starting as soon as one exits; -k prints each
+ * job's output whole and in argument order. Jobs are children of the
+ * command, not shell jobs, so they never show up in ps.
+ */
+ssize_t cmd_parallel(char **tokens)
+{
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    int keep_order = 0;
+    int t = 1;
+    for (; tokens[t] != NULL && tokens[t][0] == '-' && tokens[t][1] != '\0'; t++)
+    {
+        if (strcmp(tokens[t], "-k") == 0)
+        {
+            keep_order = 1;
+            continue;
+        }
+        const char *value = NULL;
+        if (strcmp(tokens[t], "-j") == 0)
+            value = tokens[++t];
+        else if (strncmp(tokens[t], "-j", 2) == 0)
+            value = tokens[t] + 2;
+        else
+            break;
+
+        char *end;
+        jobs = value != NULL ? strtol(value, &end, 10) : 0;
+        if (value == NULL || end == value || *end != '\0' || jobs <= 0)
+        {
+            display_error("ERROR: Invalid job count for parallel", "");
+            return -1;
+        }
+    }
+    if (jobs <= 0)
+        jobs = 1;
+
+    char **template = &tokens[t];
+    int count = 0;
+    while (template[count] != NULL && strcmp(template[count], ":::") != 0)
+    {
+        count++;
+    }
+    if (count == 0)
+    {
+        display_error("ERROR: No command given to parallel", "");
+        return -1;
+    }
+
+    parallel_args_t args = {0};
+    int input_fd = STDIN_FILENO;
+    if (template[count] != NULL)
+    {
+        args.list = &template[count + 1];
+    }
+    else
+    {
+        // The lines are for parallel; the jobs get no input
+        input_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        if (input_fd == -1)
+            input_fd = STDIN_FILENO;
+    }
+
+    parallel_job_t *running = calloc(jobs, sizeof(parallel_job_t));
+    struct pollfd *fds = malloc(2 * jobs * sizeof(struct pollfd));
+    int *fd_job = malloc(2 * jobs * sizeof(int));
+    if (running == NULL || fds == NULL || fd_job == NULL)
+    {
+        display_error("ERROR: Out of memory", "");
+        free(running);
+        free(fds);
+        free(fd_job);
+        if (input_fd != STDIN_FILENO)
+            close(input_fd);
+        return -1;
+    }
+    for (long j = 0; j < jobs; j++)
+    {
+        running[j].out_fd = -1;
+        running[j].pidfd = -1;
+        running[j].index = PARALLEL_SLOT_FREE;
+    }
+
+    // -k: finished jobs whose output waits for an earlier one
+    parallel_job_t *held = NULL;
+    size_t held_count = 0, held_cap = 0;
+    size_t next_index = 0, next_print = 0;
+    long active = 0;
+    int failed = 0, out_of_args = 0;
+
+    // Our own children are reaped here; SIGCHLD stays blocked so the
+    // fallback handler can't collect them first
+    sigset_t old_mask;
+    flush_output();
+    block_sigchld(&old_mask);
+
+    for (;;)
+    {
+        // Keep every slot busy while there are arguments
+        for (long j = 0; j < jobs && !out_of_args; j++)
+        {
+            parallel_job_t *job = &running[j];
+            while (job->index == PARALLEL_SLOT_FREE)
+            {
+                char *arg = next_parallel_arg(&args);
+                if (arg == NULL)
+                {
+                    out_of_args = 1;
+                    break;
+                }
+                size_t index = next_index++;
+                if (start_parallel_job(job, template, count, arg, index, input_fd,
+                                       keep_order) == 0)
+                {
+                    active++;
+                    continue;
+                }
+                failed = 1;
+                if (keep_order)
+                {
+                    parallel_job_t none = {.index = index};
+                    hold_parallel_output(&held, &held_count, &held_cap, &none);
+                }
+            }
+        }
+        if (active == 0)
+            break;
+
+        int nfds = 0, retry = 0;
+        for (long j = 0; j < jobs; j++)
+        {
+            if (running[j].pid != 0 && running[j].pidfd != -1)
+            {
+                fds[nfds] = (struct pollfd){.fd = running[j].pidfd, .events = POLLIN};
+                fd_job[nfds++] = j;
+            }
+            else if (running[j].pid != 0)
+            {
+                retry = 1;
+            }
+            if (running[j].out_fd != -1)
+            {
+                fds[nfds] = (struct pollfd){.fd = running[j].out_fd, .events = POLLIN};
+                fd_job[nfds++] = j;
+            }
+        }
+        phase_begin(PHASE_WAIT);
+        int ready = poll(fds, nfds, retry ? PARALLEL_RETRY_MS : -1);
+        phase_end();
+        if (ready == -1 && errno != EINTR)
+        {
+            // Can't wait for events any more: finish what runs, in order
+            for (long j = 0; j < jobs; j++)
+            {
+                while (running[j].out_fd != -1)
+                {
+                    if (collect_parallel_output(&running[j]))
+                    {
+                        close(running[j].out_fd);
+                        running[j].out_fd = -1;
+                    }
+                }
+                if (running[j].pid != 0)
+                    failed |= reap_parallel_job(&running[j], 1);
+            }
+        }
+
+        for (int k = 0; k < nfds; k++)
+        {
+            parallel_job_t *job = &running[fd_job[k]];
+            if (fds[k].revents == 0)
+                continue;
+            if (fds[k].fd == job->out_fd)
+            {
+                if (collect_parallel_output(job))
+                {
+                    close(job->out_fd);
+                    job->out_fd = -1;
+                }
+            }
+            else if (job->pid != 0)
+            {
+                failed |= reap_parallel_job(job, 0);
+            }
+        }
+        if (retry)
+        {
+            for (long j = 0; j < jobs; j++)
+            {
+                if (running[j].pid != 0 && running[j].pidfd == -1)
+                    failed |= reap_parallel_job(&running[j], 0);
+            }
+        }
+
+        // Jobs that are done give up their slot; -k output is printed
+        // once everything before it has been
+        for (long j = 0; j < jobs; j++)
+        {
+            parallel_job_t *job = &running[j];
+            if (job->pid != 0 || job->out_fd != -1 || job->index == PARALLEL_SLOT_FREE)
+                continue;
+            active--;
+            if (keep_order)
+                hold_parallel_output(&held, &held_count, &held_cap, job);
+            job->index = PARALLEL_SLOT_FREE;
+        }
+        for (size_t h = 0; h < held_count;)
+        {
+            if (held[h].index != next_print)
+            {
+                h++;
+                continue;
+            }
+            if (held[h].out_len > 0)
+                output_write(held[h].out, held[h].out_len);
+            free(held[h].out);
+            held[h] = held[--held_count];
+            next_print++;
+            h = 0;
+        }
+        flush_output();
+    }
+
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+
+    // Whatever is still held follows jobs that failed to start
+    for (size_t h = 0; h < held_count; h++)
+    {
+        if (held[h].out_len > 0)
+            output_write(held[h].out, held[h].out_len);
+        free(held[h].out);
+    }
+    flush_output();
+    free(held);
+    free(running);
+    free(fds);
+    free(fd_job);
+    free(args.buf);
+    if (input_fd != STDIN_FILENO)
+        close(input_fd);
+    return failed ? -1 : 0;
+}
+
+
+int execute_command(char **tokens, int input_fd, int output_fd, int in_background)
+{
+    if (tokens == NULL || tokens[0] == NULL)
+    {
+        return -1;
+    }
+
+    // Check if this is a builtin command
+    bn_ptr builtin_fn = check_builtin(tokens[0]);
+    if (builtin_fn != NULL)
+    {
+        // Handle redirecting stdin/stdout for builtins
+        int old_stdin = -1, old_stdout = -1;
+
+        // Redirect input if needed
+        if (input_fd != STDIN_FILENO)
+        {
+            old_stdin = dup(STDIN_FILENO);
+            if (old_stdin == -1)
+            {
+                perror("dup stdin");
+                safe_close(input_fd);
+                if (output_fd != STDOUT_FILENO)
+                {
+                    safe_close(output_fd);
+                }
+                return -1;
+            }
+
+            if (dup2(input_fd, STDIN_FILENO) == -1)
+            {
+                perror("dup2 stdin");
                 safe_close(old_stdin);
                 safe_close(input_fd);
                 if (output_fd != STDOUT_FILENO)
@@ -567,6 +1269,7 @@ int execute_command(char **tokens, int input_fd, int output_fd, int in_backgroun
 
         // Execute the builtin
         ssize_t result = builtin_fn(tokens);
+        flush_output();
 
         // Restore stdin/stdout if needed
         if (old_stdin != -1)
@@ -597,7 +1300,7 @@ int handle_pipeline(char **tokens)
     int cmd_count = 1;
     for (int i = 0; tokens[i] != NULL; i++)
     {
-        if (strcmp(tokens[i], "|") == 0)
+        if (is_pipe_token(tokens[i]))
         {
             cmd_count++;
         }
@@ -616,7 +1319,7 @@ int handle_pipeline(char **tokens)
             last_token++;
         }
 
-        if (tokens[last_token] != NULL && strcmp(tokens[last_token], "&") == 0)
+        if (tokens[last_token] != NULL && is_bg_token(tokens[last_token]))
         {
             in_background = 1;
             tokens[last_token] = NULL; // Remove the & token
@@ -627,267 +1330,823 @@ int handle_pipeline(char **tokens)
     }
 
     // Split into individual commands
-    char **cmds[cmd_count];
+    pipeline_stage_t *stages = calloc(cmd_count, sizeof(pipeline_stage_t));
+    if (stages == NULL)
+    {
+        display_error("ERROR: Out of memory", "");
+        return -1;
+    }
     int cmd_index = 0;
-    cmds[0] = tokens;
+    stages[0].argv = tokens;
 
     debug_log("Splitting pipeline into commands");
     for (int i = 0; tokens[i] != NULL; i++)
     {
-        if (strcmp(tokens[i], "|") == 0)
+        if (is_pipe_token(tokens[i]))
         {
             tokens[i] = NULL; // Replace pipe with NULL to terminate the command
-            cmds[++cmd_index] = &tokens[i + 1];
+            stages[++cmd_index].argv = &tokens[i + 1];
             debug_log("Command %d starts at token index %d", cmd_index, i + 1);
         }
     }
 
-    // Verify all commands
-    for (int i = 0; i < cmd_count; i++)
+    // Verify all commands and resolve them once for the children
+    int result = 0;
+    phase_begin(PHASE_RESOLVE);
+    for (int i = 0; i < cmd_count && result == 0; i++)
     {
-        if (cmds[i][0] == NULL)
+        char **argv = i == 0 ? skip_pipeline_options(stages[0].argv) : stages[i].argv;
+        if (argv[0] == NULL)
         {
             display_error("ERROR: Empty command in pipeline", "");
-            return -1;
+            result = -1;
+            break;
         }
 
-        debug_log("Verifying command %d: %s", i, cmds[i][0]);
+        debug_log("Verifying command %d: %s", i, argv[0]);
 
         // Check if it's a variable assignment first - this is a valid command
-        if (is_variable_assignment(cmds[i][0]))
+        if (is_variable_assignment(argv[0]))
         {
             continue; // Skip further validation, variable assignments are valid
         }
 
         // Only check builtin/system command if not a variable assignment
-        if (check_builtin(cmds[i][0]) == NULL && !command_exists(cmds[i][0]))
+        const builtin_entry_t *entry = find_builtin(argv[0]);
+        if (entry != NULL && (entry->flags & BN_PIPELINE))
         {
-            display_error("ERROR: Unknown command: ", cmds[i][0]);
-            return -1;
+            stages[i].builtin = entry->fn;
+            stages[i].flags = entry->flags;
+        }
+        else
+        {
+            stages[i].path = find_command_path(argv[0]);
+            if (stages[i].path == NULL)
+            {
+                display_error("ERROR: Unknown command: ", argv[0]);
+                result = -1;
+            }
         }
     }
 
-    // Check for background
-    int in_background = 0;
-    int last_cmd = cmd_count - 1;
-    int last_token = 0;
+    phase_end();
 
-    while (cmds[last_cmd][last_token + 1] != NULL)
+    if (result == 0)
     {
-        last_token++;
+        // Check for background
+        int in_background = 0;
+        char **last_argv = stages[cmd_count - 1].argv;
+        int last_token = 0;
+
+        while (last_argv[last_token + 1] != NULL)
+        {
+            last_token++;
+        }
+
+        if (is_bg_token(last_argv[last_token]))
+        {
+            in_background = 1;
+            last_argv[last_token] = NULL; // Remove the & token
+            debug_log("Pipeline will run in background");
+        }
+
+        result = run_pipeline(stages, cmd_count, in_background);
     }
 
-    if (cmds[last_cmd][last_token] != NULL &&
-        strcmp(cmds[last_cmd][last_token], "&") == 0)
+    for (int i = 0; i < cmd_count; i++)
+    {
+        free(stages[i].path);
+    }
+    free(stages);
+    return result;
+}
+
+// Return: 1 if a pipeline stage sets variables of its own
+static int stage_has_assignment(char **argv)
+{
+    for (int j = 0; argv[j] != NULL; j++)
+    {
+        if (is_variable_assignment(argv[j]))
+            return 1;
+    }
+    return 0;
+}
+
+// A builtin pipeline stage running on a thread of the shell
+typedef struct stage_thread {
+    pthread_t thread;
+    bn_ptr builtin;
+    char **argv;
+    stage_stream_t in;
+    stage_stream_t out;
+    ssize_t result;
+} stage_thread_t;
+
+// Release a thread stage's ends: the next stage sees end of file and the
+// previous one has its writes dropped, as with a closed pipe
+static void close_stage_streams(stage_thread_t *stage)
+{
+    if (stage->out.channel != NULL)
+        channel_close_write(stage->out.channel);
+    else if (stage->out.fd != STDOUT_FILENO)
+        safe_close(stage->out.fd);
+
+    if (stage->in.channel != NULL)
+        channel_close_read(stage->in.channel);
+    else if (stage->in.fd != STDIN_FILENO)
+        safe_close(stage->in.fd);
+}
+
+static void *run_stage_thread(void *arg)
+{
+    stage_thread_t *stage = arg;
+    if (bind_stage_streams(stage->in, stage->out) == 0)
     {
-        in_background = 1;
-        cmds[last_cmd][last_token] = NULL; // Remove the & token
-        debug_log("Pipeline will run in background");
+        stage->result = stage->builtin(stage->argv);
+        unbind_stage_streams();
     }
+    else
+    {
+        display_error("ERROR: Out of memory", "");
+        stage->result = -1;
+    }
+    close_stage_streams(stage);
+    return NULL;
+}
 
-    // Create pipes
-    int pipes[cmd_count - 1][2];
-    debug_log("Creating %d pipes for command pipeline", cmd_count - 1);
+// Value of token if it is the assignment NAME=value of option name
+static const char *option_value(const char *token, const char *name)
+{
+    size_t name_len = strlen(name);
+    if (strncmp(token, name, name_len) == 0 && token[name_len] == '=')
+        return token + name_len + 1;
+    return NULL;
+}
 
-    for (int i = 0; i < cmd_count - 1; i++)
+// Return: 1 if token is one of the pipeline options
+static int is_pipeline_option(const char *token)
+{
+    return option_value(token, PIPE_TIMEOUT_VAR) != NULL ||
+           option_value(token, PIPE_SIZE_VAR) != NULL;
+}
+
+char **skip_pipeline_options(char **argv)
+{
+    while (argv[0] != NULL && is_pipeline_option(argv[0]))
+    {
+        argv++;
+    }
+    return argv;
+}
+
+/* Value of pipeline option name: the last one given on the first stage,
+ * else the shell variable, else NULL.
+ */
+static const char *pipeline_option(char **first_stage, const char *name)
+{
+    const char *value = NULL;
+    for (int j = 0; first_stage[j] != NULL && is_pipeline_option(first_stage[j]); j++)
     {
-        if (pipe(pipes[i]) == -1)
+        const char *option = option_value(first_stage[j], name);
+        if (option != NULL)
+            value = option;
+    }
+    return value != NULL ? value : get_variable(name);
+}
+
+/* Timeout for a foreground pipeline in milliseconds, or -1 for none.
+ * An option on the first stage wins over the shell variable.
+ */
+static long pipeline_timeout_ms(char **first_stage)
+{
+    const char *value = pipeline_option(first_stage, PIPE_TIMEOUT_VAR);
+    if (value == NULL)
+        return -1;
+
+    char *end;
+    long ms = strtol(value, &end, 10);
+    return end != value && *end == '\0' && ms > 0 ? ms : -1;
+}
+
+#define PIPE_SIZE_ADAPTIVE -1   // pipeline_pipe_size: grow pipes found full
+
+// Largest capacity an unprivileged process may give a pipe
+static long pipe_max_size(void)
+{
+    static long max_size = 0;
+    if (max_size > 0)
+        return max_size;
+
+    max_size = 1024 * 1024;     // The kernel's default limit
+    FILE *file = fopen("/proc/sys/fs/pipe-max-size", "r");
+    if (file != NULL)
+    {
+        long value;
+        if (fscanf(file, "%ld", &value) == 1 && value > 0)
+            max_size = value;
+        fclose(file);
+    }
+    return max_size;
+}
+
+/* Pipe capacity asked for by PIPESIZE: bytes (capped at pipe_max_size),
+ * PIPE_SIZE_ADAPTIVE for auto, or 0 to keep the kernel's default.
+ */
+static long pipeline_pipe_size(char **first_stage)
+{
+    const char *value = pipeline_option(first_stage, PIPE_SIZE_VAR);
+    if (value == NULL)
+        return 0;
+    if (strcmp(value, "auto") == 0)
+        return PIPE_SIZE_ADAPTIVE;
+
+    char *end;
+    long size = strtol(value, &end, 10);
+    if (end == value || size <= 0)
+        return 0;
+    long unit = 1;
+    if (*end == 'k' || *end == 'K')
+        unit = 1024;
+    else if (*end == 'm' || *end == 'M')
+        unit = 1024 * 1024;
+    if (end[unit > 1] != '\0')
+        return 0;
+    return size < pipe_max_size() / unit ? size * unit : pipe_max_size();
+}
+
+/* PIPESIZE=auto: double every pipe of the pipeline that is full, so its
+ * writer is blocked, up to pipe_max_size. The shell closed its own ends
+ * after setup, so a pipe is reached through a process at one of its
+ * ends (briefly opened as a reader, which keeps nothing blocked).
+ * Return: 1 while some pipe could still grow
+ */
+static int grow_full_pipes(const pid_t *pids, int count)
+{
+    long max_size = pipe_max_size();
+    int can_grow = 0;
+    for (int i = 0; i < count - 1; i++)
+    {
+        char path[64];
+        if (pids[i] > 0)
+            snprintf(path, sizeof(path), "/proc/%d/fd/%d", pids[i], STDOUT_FILENO);
+        else if (pids[i + 1] > 0)
+            snprintf(path, sizeof(path), "/proc/%d/fd/%d", pids[i + 1], STDIN_FILENO);
+        else
+            continue;   // A channel, or both ends gone
+
+        int fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        if (fd == -1)
+            continue;
+        int size = fcntl(fd, F_GETPIPE_SZ);
+        int queued;
+        if (size > 0 && size < max_size)
         {
-            display_error("ERROR: Failed to create pipe", "");
-            for (int j = 0; j < i; j++)
+            can_grow = 1;
+            if (ioctl(fd, FIONREAD, &queued) == 0 && queued > size - PIPE_BUF)
             {
-                safe_close(pipes[j][0]);
-                safe_close(pipes[j][1]);
+                long wanted = 2L * size < max_size ? 2L * size : max_size;
+                int grown = fcntl(fd, F_SETPIPE_SZ, wanted);
+                debug_log("Pipe %d full at %d bytes, now %d bytes", i, size, grown);
             }
-            return -1;
         }
-        debug_log("Created pipe %d: read_fd=%d, write_fd=%d", i, pipes[i][0], pipes[i][1]);
+        close(fd);
     }
+    return can_grow;
+}
 
-    // Duplicate parent's variable environment for child processes
-    // FIX: Make sure each process gets variables from parent
-    variable_t *parent_vars = duplicate_variables();
+// Reap pid, which has exited, and record the pipeline status if it was
+// the last stage
+static void reap_stage(pid_t pid, int is_last, int *status)
+{
+    int cmd_status;
+    struct rusage usage;
+    pid_t waited;
+    do
+    {
+        waited = wait4(pid, &cmd_status, 0, &usage);
+    } while (waited == -1 && errno == EINTR);
 
-    // Execute commands
-    pid_t pids[cmd_count];
-    int status = 0;
+    if (waited == pid)
+    {
+        timing_add_child(&usage);
+        if (is_last)
+            *status = exit_status_of(cmd_status);
+    }
+}
 
-    for (int i = 0; i < cmd_count; i++)
+/* Wait for every started stage (pids[i] > 0), reaping each the moment it
+ * exits: one pidfd per stage in a poll set, so there is no polling
+ * interval and nothing is killed unless timeout_ms (-1 for none) runs
+ * out. With adapt_pipes set the pipes are checked for growth every
+ * PIPE_ADAPT_INTERVAL_MS meanwhile.
+ * Prereq: SIGCHLD is blocked, so the handler can't reap them first.
+ * Return: 1 if the timeout ran out and stages were stopped, 0 otherwise
+ */
+static int wait_for_stages(const pid_t *pids, int count, long timeout_ms, int adapt_pipes,
+                           int *status)
+{
+    struct pollfd *fds = malloc(count * sizeof(struct pollfd));
+    int *stage_of = malloc(count * sizeof(int));
+    int nfds = 0;
+    if (fds == NULL || stage_of == NULL)
+    {
+        // Out of memory: blocking waits are still exact
+        free(fds);
+        free(stage_of);
+        for (int i = 0; i < count; i++)
+        {
+            if (pids[i] > 0)
+                reap_stage(pids[i], i == count - 1, status);
+        }
+        return 0;
+    }
+
+    for (int i = 0; i < count; i++)
     {
-        debug_log("Forking for command %d: %s", i, cmds[i][0]);
-        pids[i] = fork();
+        if (pids[i] <= 0)
+            continue;
 
-        if (pids[i] == -1)
+        int fd = pidfd_open(pids[i], 0);
+        if (fd == -1)
         {
-            display_error("ERROR: Failed to fork", "");
+            // No pidfds (older kernel): a blocking wait is still exact
+            debug_log("[Parent] pidfd_open failed for %d, waiting directly", pids[i]);
+            reap_stage(pids[i], i == count - 1, status);
+            continue;
+        }
+        fds[nfds].fd = fd;
+        fds[nfds].events = POLLIN;
+        stage_of[nfds] = i;
+        nfds++;
+    }
 
-            // Clean up pipes and processes
-            for (int j = 0; j < cmd_count - 1; j++)
-            {
-                safe_close(pipes[j][0]);
-                safe_close(pipes[j][1]);
-            }
-            for (int j = 0; j < i; j++)
-            {
-                kill(pids[j], SIGTERM);
-            }
-            return -1;
+    int timed_out = 0;
+    struct timespec deadline;
+    if (timeout_ms > 0)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
         }
-        else if (pids[i] == 0)
+    }
+
+    while (nfds > 0)
+    {
+        int wait_ms = -1;
+        if (timeout_ms > 0)
         {
-            // Child process
-            debug_log("[Child %d] Setting up redirections for command: %s", getpid(), cmds[i][0]);
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            long left = (deadline.tv_sec - now.tv_sec) * 1000L +
+                        (deadline.tv_nsec - now.tv_nsec) / 1000000L;
+            wait_ms = left > 0 ? (int)left : 0;
+        }
+        int adapt_tick = adapt_pipes && (wait_ms == -1 || wait_ms > PIPE_ADAPT_INTERVAL_MS);
+        if (adapt_tick)
+            wait_ms = PIPE_ADAPT_INTERVAL_MS;
 
-            // Create a fresh copy of parent's variables for EACH child
-            variable_t *child_vars = duplicate_variables();
-            if (child_vars != NULL)
+        int ready = poll(fds, nfds, wait_ms);
+        if (ready == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (ready == 0 && adapt_tick)
+        {
+            adapt_pipes = grow_full_pipes(pids, count);
+            continue;
+        }
+        if (ready == 0)
+        {
+            // Timed out: stop what is left, then wait for it without limit
+            display_error("ERROR: Pipeline timed out", "");
+            for (int j = 0; j < nfds; j++)
             {
-                set_variable_list(child_vars);
-
-                // Process any variable assignments only in this isolated child environment
-                for (int j = 0; cmds[i][j] != NULL; j++)
-                {
-                    if (is_variable_assignment(cmds[i][j]))
-                    {
-                        debug_log("[Child %d] Processing local variable: %s", getpid(), cmds[i][j]);
-                        handle_variable_assignment(cmds[i][j]);
-                    }
-                }
+                kill(pids[stage_of[j]], SIGTERM);
             }
+            timed_out = 1;
+            timeout_ms = -1;
+            continue;
+        }
 
-            // Set up redirections
-            if (i > 0)
+        for (int j = 0; j < nfds;)
+        {
+            if (fds[j].revents == 0)
             {
-                // Not the first command, redirect stdin from previous pipe
-                debug_log("[Child %d] Redirecting stdin from pipe %d (fd %d)",
-                          getpid(), i - 1, pipes[i - 1][0]);
-                if (dup2(pipes[i - 1][0], STDIN_FILENO) == -1)
-                {
-                    perror("dup2 stdin");
-                    exit(EXIT_FAILURE);
-                }
+                j++;
+                continue;
             }
+            int i = stage_of[j];
+            debug_log("[Parent] Command %d (pid %d) exited", i, pids[i]);
+            reap_stage(pids[i], i == count - 1, status);
+            close(fds[j].fd);
+
+            // Keep the set dense by moving the last entry into this one
+            nfds--;
+            fds[j] = fds[nfds];
+            stage_of[j] = stage_of[nfds];
+        }
+    }
 
-            if (i < cmd_count - 1)
-            {
-                // Not the last command, redirect stdout to next pipe
-                debug_log("[Child %d] Redirecting stdout to pipe %d (fd %d)",
-                          getpid(), i, pipes[i][1]);
-                if (dup2(pipes[i][1], STDOUT_FILENO) == -1)
-                {
-                    perror("dup2 stdout");
-                    exit(EXIT_FAILURE);
-                }
-            }
+    // Anything left after a poll error is waited for directly
+    for (int j = 0; j < nfds; j++)
+    {
+        reap_stage(pids[stage_of[j]], stage_of[j] == count - 1, status);
+        close(fds[j].fd);
+    }
+    free(fds);
+    free(stage_of);
+    return timed_out;
+}
 
-            // Close all pipe fds
-            debug_log("[Child %d] Closing all pipe fds", getpid());
-            for (int j = 0; j < cmd_count - 1; j++)
-            {
-                safe_close(pipes[j][0]);
-                safe_close(pipes[j][1]);
-            }
+// A pipeline stage while it is being started
+typedef struct stage_run {
+    char **argv;
+    int threaded;             // 1 on a thread, -1 if its thread failed to start
+    stage_thread_t thread;    // in/out: the stage's ends until handed over
+} stage_run_t;
+
+/* Create the link from a stage to the next one: a channel between two
+ * thread stages, else a close-on-exec pipe, so no other child inherits
+ * it past exec, of pipe_size bytes if that is > 0.
+ * Return: 0 on success, -1 on failure
+ */
+static int open_stage_link(int use_channel, long pipe_size, stage_stream_t *out,
+                           stage_stream_t *next_in)
+{
+    if (use_channel)
+    {
+        channel_t *channel = channel_create();
+        if (channel == NULL)
+            return -1;
+        *out = (stage_stream_t){.fd = -1, .channel = channel};
+        *next_in = (stage_stream_t){.fd = -1, .channel = channel};
+        debug_log("Created channel");
+        return 0;
+    }
 
-            // Check if this command is ONLY a variable assignment
-            if (is_variable_assignment(cmds[i][0]))
-            {
-                // Just exit successfully without trying to execute
-                debug_log("[Child %d] Command is variable assignment, exiting successfully", getpid());
-                exit(EXIT_SUCCESS);
-            }
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) == -1)
+        return -1;
+    *out = (stage_stream_t){.fd = fds[1], .channel = NULL};
+    *next_in = (stage_stream_t){.fd = fds[0], .channel = NULL};
+
+    // A size the kernel refuses just leaves the default
+    if (pipe_size > 0)
+        fcntl(fds[1], F_SETPIPE_SZ, (int)pipe_size);
+    if (DEBUG_MODE)
+        debug_log("Created pipe: read_fd=%d, write_fd=%d, %d bytes", fds[0], fds[1],
+                  fcntl(fds[1], F_GETPIPE_SZ));
+    return 0;
+}
 
-            // Execute command as before
-            bn_ptr builtin_fn = check_builtin(cmds[i][0]);
-            if (builtin_fn != NULL)
-            {
-                debug_log("[Child %d] Executing builtin: %s", getpid(), cmds[i][0]);
-                exit(builtin_fn(cmds[i]) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
-            }
-            else
-            {
-                debug_log("[Child %d] Executing external command: %s", getpid(), cmds[i][0]);
-                execvp(cmds[i][0], cmds[i]);
-                perror("execvp");
-                exit(EXIT_FAILURE);
-            }
+// Close the pipe ends of a stream (channels are freed once joined)
+static void close_stage_fd(stage_stream_t stream)
+{
+    if (stream.channel == NULL && stream.fd > STDERR_FILENO)
+        close(stream.fd);
+}
+
+/* In a forked stage, once its ends are on stdin/stdout: close every other
+ * descriptor. The other stages' pipe ends would otherwise hold their
+ * pipes open for as long as this stage runs. Without close_range the
+ * ends the shell holds (this stage's, next_in and those of the thread
+ * stages before it) are closed one by one.
+ */
+static void close_other_ends(const stage_run_t *run, int stage, int next_in)
+{
+    if (close_range(STDERR_FILENO + 1, ~0U, 0) == 0)
+        return;
+
+    close_stage_fd(run[stage].thread.in);
+    close_stage_fd(run[stage].thread.out);
+    safe_close(next_in);
+    for (int j = 0; j < stage; j++)
+    {
+        if (run[j].threaded)
+        {
+            close_stage_fd(run[j].thread.in);
+            close_stage_fd(run[j].thread.out);
         }
     }
+}
 
-    // Parent process
-    debug_log("[Parent] Closing all pipe fds");
-    for (int i = 0; i < cmd_count - 1; i++)
+/* Start stage i as a process reading in and writing out: spawned if it
+ * is external, forked if it is a builtin or sets variables of its own.
+ * pgroup is as for spawn_external.
+ * Return: pid, or -1 if it could not be started (reported here)
+ */
+static pid_t start_stage_process(pipeline_stage_t *stage, const stage_run_t *run, int i,
+                                 int next_in, pid_t pgroup)
+{
+    char **argv = run[i].argv;
+    int in = run[i].thread.in.fd;
+    int out = run[i].thread.out.fd;
+
+    if (stage->builtin == NULL && !stage_has_assignment(argv))
     {
-        safe_close(pipes[i][0]);
-        safe_close(pipes[i][1]);
+        debug_log("Spawning command %d: %s", i, stage->path);
+        pid_t pid = spawn_external(stage->path, argv, in, out, NULL, 0, child_signal_mask(),
+                                   pgroup);
+        if (pid == -1)
+        {
+            // Like a failed exec in a child: the rest of the pipeline runs
+            display_error("ERROR: Failed to execute command: ", argv[0]);
+        }
+        return pid;
     }
 
-    // Wait for completion unless background
-    if (!in_background)
+    debug_log("Forking for command %d: %s", i, argv[0]);
+    pid_t pid = fork();
+    if (pid == -1)
     {
-        for (int i = 0; i < cmd_count; i++)
+        display_error("ERROR: Failed to fork", "");
+        return -1;
+    }
+    if (pid > 0)
+    {
+        // Set the group from here too, so a later stage never joins it
+        // before the child has got around to it
+        if (pgroup >= 0)
+            setpgid(pid, pgroup);
+        return pid;
+    }
+
+    // Child process
+    if (pgroup >= 0)
+        setpgid(0, pgroup);
+    sigprocmask(SIG_SETMASK, child_signal_mask(), NULL);
+    debug_log("[Child %d] Setting up redirections for command: %s", getpid(), argv[0]);
+
+    // The child's variables are the parent's pages, shared copy-on-write
+    // by fork(); only the slots a stage-local assignment touches get
+    // copied, and the parent never sees them
+    for (int j = 0; argv[j] != NULL; j++)
+    {
+        if (is_variable_assignment(argv[j]))
         {
-            int cmd_status;
-            int wait_result;
-            int waited_ms = 0;
-            const int max_wait_ms = 500; // 500ms timeout
+            debug_log("[Child %d] Processing local variable: %s", getpid(), argv[j]);
+            handle_variable_assignment(argv[j]);
+        }
+    }
 
-            debug_log("[Parent] Waiting for command %d (pid %d) with timeout", i, pids[i]);
+    // Set up redirections, then drop every other pipe end
+    if (in != STDIN_FILENO && dup2(in, STDIN_FILENO) == -1)
+    {
+        perror("dup2 stdin");
+        exit(EXIT_FAILURE);
+    }
+    if (out != STDOUT_FILENO && dup2(out, STDOUT_FILENO) == -1)
+    {
+        perror("dup2 stdout");
+        exit(EXIT_FAILURE);
+    }
+    close_other_ends(run, i, next_in);
 
-            // Try non-blocking wait first
-            wait_result = waitpid(pids[i], &cmd_status, WNOHANG);
+    // Check if this command is ONLY a variable assignment
+    if (is_variable_assignment(argv[0]))
+    {
+        // Just exit successfully without trying to execute
+        debug_log("[Child %d] Command is variable assignment, exiting successfully", getpid());
+        exit(EXIT_SUCCESS);
+    }
 
-            // If child isn't done yet, wait with timeout
-            while (wait_result == 0 && waited_ms < max_wait_ms)
-            {
-                usleep(10000); // 10ms
-                waited_ms += 10;
-                wait_result = waitpid(pids[i], &cmd_status, WNOHANG);
-            }
+    // Execute the stage as resolved by the caller
+    if (stage->builtin != NULL)
+    {
+        debug_log("[Child %d] Executing builtin: %s", getpid(), argv[0]);
+        exit(stage->builtin(argv) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    debug_log("[Child %d] Executing external command: %s", getpid(), stage->path);
+    execve(stage->path, argv, variable_envp());
+    perror("execve");
+    exit(EXIT_FAILURE);
+}
 
-            // If we timed out, force terminate the child
-            if (wait_result == 0)
-            {
-                debug_log("[Parent] Child %d timed out, sending SIGTERM", pids[i]);
-                kill(pids[i], SIGTERM);
-                waitpid(pids[i], &cmd_status, 0);
-            }
+/* Build "cmd args | cmd args ... &" for a background pipeline's job.
+ * Return: the string in the line arena, or NULL if out of memory
+ */
+static char *pipeline_command_str(const stage_run_t *run, int cmd_count)
+{
+    size_t command_len = 3; // Room for " &" and the terminator
+    for (int i = 0; i < cmd_count; i++)
+    {
+        for (int j = 0; run[i].argv[j] != NULL; j++)
+        {
+            command_len += strlen(run[i].argv[j]) + 1;
         }
+        command_len += 2;
     }
-    else
+
+    char *command_str = arena_alloc(&line_arena, command_len);
+    if (command_str == NULL)
+        return NULL;
+
+    size_t pos = 0;
+    for (int i = 0; i < cmd_count; i++)
     {
-        // Background process handling
-        debug_log("[Parent] Setting up background process for pipeline");
-        char command_str[MAX_STR_LEN] = "";
-        for (int i = 0; i < cmd_count; i++)
+        for (int j = 0; run[i].argv[j] != NULL; j++)
         {
-            for (int j = 0; cmds[i][j] != NULL; j++)
-            {
-                if (command_str[0] != '\0')
-                    strcat(command_str, " ");
-                strcat(command_str, cmds[i][j]);
-            }
+            if (pos > 0)
+                command_str[pos++] = ' ';
+            size_t len = strlen(run[i].argv[j]);
+            memcpy(command_str + pos, run[i].argv[j], len);
+            pos += len;
+        }
+
+        if (i < cmd_count - 1)
+        {
+            memcpy(command_str + pos, " |", 2);
+            pos += 2;
+        }
+    }
+    memcpy(command_str + pos, " &", 3);
+    return command_str;
+}
+
+// Run a split and verified pipeline
+int run_pipeline(pipeline_stage_t *stages, int cmd_count, int in_background)
+{
+    stage_run_t *run = calloc(cmd_count, sizeof(stage_run_t));
+    pid_t *pids = malloc(cmd_count * sizeof(pid_t));
+    if (run == NULL || pids == NULL)
+    {
+        display_error("ERROR: Out of memory", "");
+        free(run);
+        free(pids);
+        return -1;
+    }
 
-            if (i < cmd_count - 1)
+    // Builtins that only use their streams run on threads of the shell
+    // in the foreground; a background job needs a process to track, and
+    // so does a pipeline with a timeout: a thread blocked in a read can't
+    // be stopped, a process can
+    long timeout_ms = pipeline_timeout_ms(stages[0].argv);
+    for (int i = 0; i < cmd_count; i++)
+    {
+        run[i].argv = stages[i].argv;
+        run[i].threaded = !in_background && timeout_ms == -1 && stages[i].builtin != NULL &&
+                          (stages[i].flags & BN_THREAD) && !stage_has_assignment(run[i].argv);
+    }
+    long pipe_size = pipeline_pipe_size(run[0].argv);
+    run[0].argv = skip_pipeline_options(run[0].argv);
+
+    // Execute commands
+    phase_begin(PHASE_SPAWN);
+    int status = 0;
+    sigset_t old_mask;
+    flush_output();
+    block_sigchld(&old_mask);
+
+    /* One pass over the stages: each link is created just before the
+     * stage that writes to it, and a process stage's ends are closed in
+     * the shell as soon as it has started, so only a couple of pipe ends
+     * are open at a time (plus those kept for thread stages). Processes
+     * start before any thread, so nothing is forked while a stage thread
+     * might hold a lock. A background pipeline gets a process group of
+     * its own, led by its first stage, so the job can be signalled as a
+     * whole.
+     */
+    pid_t pgid = 0;
+    stage_stream_t next_in = {.fd = STDIN_FILENO, .channel = NULL};
+    int started = 0;
+    for (; started < cmd_count; started++)
+    {
+        int i = started;
+        run[i].thread.in = next_in;
+        run[i].thread.out = (stage_stream_t){.fd = STDOUT_FILENO, .channel = NULL};
+        next_in = (stage_stream_t){.fd = -1, .channel = NULL};
+        if (i < cmd_count - 1 &&
+            open_stage_link(run[i].threaded && run[i + 1].threaded, pipe_size,
+                            &run[i].thread.out, &next_in) == -1)
+        {
+            display_error("ERROR: Failed to create pipe", "");
+            close_stage_fd(run[i].thread.in);
+            break;
+        }
+
+        if (run[i].threaded)
+        {
+            pids[i] = 0;
+            continue;   // Its ends are kept for the thread
+        }
+
+        pids[i] = start_stage_process(&stages[i], run, i, next_in.fd, in_background ? pgid : -1);
+        close_stage_fd(run[i].thread.in);
+        close_stage_fd(run[i].thread.out);
+        if (pids[i] == -1 && (stages[i].builtin != NULL || stage_has_assignment(run[i].argv)))
+            break;      // fork failed: give up on the whole pipeline
+        if (pids[i] != -1 && in_background && pgid == 0)
+            pgid = pids[i];
+    }
+
+    if (started < cmd_count)
+    {
+        // Setup failed: stop and reap what was started, and drop the
+        // ends no thread will take
+        close_stage_fd(next_in);
+        for (int i = 0; i < cmd_count; i++)
+        {
+            if (i < started && pids[i] > 0)
+                kill(pids[i], SIGTERM);
+            else if (i >= started)
+                pids[i] = -1;
+            if (i < started && run[i].threaded)
             {
-                strcat(command_str, " |");
+                close_stage_fd(run[i].thread.in);
+                close_stage_fd(run[i].thread.out);
             }
         }
+        wait_for_stages(pids, cmd_count, -1, 0, &status);
+        for (int i = 0; i < started; i++)
+        {
+            if (run[i].threaded)
+                channel_free(run[i].thread.out.channel);
+        }
+        sigprocmask(SIG_SETMASK, &old_mask, NULL);
+        phase_end();
+        free(run);
+        free(pids);
+        return -1;
+    }
+
+    // Threads take signals on the shell's behalf only on the main thread;
+    // a write to a pipe whose reader exited fails with EPIPE instead of
+    // raising SIGPIPE
+    sigset_t thread_mask, main_mask;
+    sigemptyset(&thread_mask);
+    sigaddset(&thread_mask, SIGINT);
+    sigaddset(&thread_mask, SIGPIPE);
+    sigaddset(&thread_mask, SIGCHLD);
+    pthread_sigmask(SIG_BLOCK, &thread_mask, &main_mask);
 
-        if (in_background)
+    for (int i = 0; i < cmd_count; i++)
+    {
+        if (!run[i].threaded)
+            continue;
+
+        stage_thread_t *stage = &run[i].thread;
+        stage->builtin = stages[i].builtin;
+        stage->argv = run[i].argv;
+        stage->result = -1;
+
+        debug_log("Starting thread for command %d: %s", i, run[i].argv[0]);
+        int err = pthread_create(&stage->thread, NULL, run_stage_thread, stage);
+        if (err != 0)
         {
-            strcat(command_str, " &");
+            display_error("ERROR: Failed to start thread for: ", run[i].argv[0]);
+            close_stage_streams(stage);
+            run[i].threaded = -1;
         }
+    }
+    pthread_sigmask(SIG_SETMASK, &main_mask, NULL);
+    phase_end();
 
-        add_bg_process(pids[cmd_count - 1], command_str);
-        debug_log("[Parent] Background process added: %s", command_str);
+    // Wait for completion unless background. Neither kind of stage waits
+    // on the other, so processes (which a timeout can stop) go first and
+    // the threads, fed or cut off by them, are joined after
+    if (!in_background)
+    {
+        if (pids[cmd_count - 1] == -1)
+            status = EXIT_FAILURE; // Last stage never started
+        phase_begin(PHASE_WAIT);
+        int timed_out = wait_for_stages(pids, cmd_count, timeout_ms,
+                                        pipe_size == PIPE_SIZE_ADAPTIVE, &status);
+
+        for (int i = 0; i < cmd_count; i++)
+        {
+            if (run[i].threaded == 1)
+                pthread_join(run[i].thread.thread, NULL);
+        }
+        phase_end();
+        for (int i = 0; i < cmd_count - 1; i++)
+        {
+            if (run[i].threaded)
+                channel_free(run[i].thread.out.channel);
+        }
+        if (run[cmd_count - 1].threaded)
+            status = run[cmd_count - 1].thread.result == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+        if (timed_out)
+            status = PIPE_TIMEOUT_STATUS;   // Whatever the last stage made of it
     }
-    // Clean up - Free the duplicated variable list to prevent memory leaks
-    if (parent_vars != NULL)
+    else
     {
-        debug_log("Freeing duplicated variable environment");
-        free_variable_list(parent_vars);
+        // Background process handling (the job is every stage, shown by
+        // its last)
+        debug_log("[Parent] Setting up background process for pipeline");
+        char *command_str = pipeline_command_str(run, cmd_count);
+        add_bg_job(pids, cmd_count, pgid, command_str != NULL ? command_str : run[0].argv[0]);
+        debug_log("[Parent] Background process added: %s", command_str);
     }
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
 
     debug_log("[Parent] Pipeline execution complete with status %d", status);
+    free(run);
+    free(pids);
     return status;
-}
\ No newline at end of file
+}
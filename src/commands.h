@@ -4,12 +4,24 @@
 #include <unistd.h>
 #include <signal.h>
 
-// Process tracking structure
+#include "builtins.h"
+
+// One process of a background job
+typedef struct job_member {
+    pid_t pid;            // 0 once it has exited
+    int pidfd;            // Watched by the event loop, or -1
+} job_member_t;
+
+// One background job; pid 0 marks a free slot of the job table
 typedef struct bg_process {
-    pid_t pid;
+    pid_t pid;            // Pid shown for the job (its last stage)
+    pid_t pgid;           // Process group of a pipeline job, or 0
     int job_id;
     char *command;
-    struct bg_process *next;
+    job_member_t *members;
+    int member_count;
+    int running;          // Members that have not exited yet
+    int next_free;        // Next free slot while this one is free
 } bg_process_t;
 
 // Message queue for background process completion notifications
@@ -24,19 +36,26 @@ void init_bg_processes();
 // Add a background process
 int add_bg_process(pid_t pid, const char *command);
 
-// Remove a background process
+/* Add a job made of several processes (pids of -1 never started and are
+ * skipped), in process group pgid (0 for none). kill on any member then
+ * signals the whole group, and the job is done once every member is.
+ * Return: the job id, or -1 on failure
+ */
+int add_bg_job(const pid_t *pids, int count, pid_t pgid, const char *command);
+
+// Remove the job a process belongs to
 void remove_bg_process(pid_t pid);
 
 // List all background processes
 void list_bg_processes();
 
-// Find process by pid
+// Find the job any of whose processes is pid
 bg_process_t *find_bg_process_by_pid(pid_t pid);
 
 // Clean up background process tracking
 void free_bg_processes();
 
-// Mark a process as completed
+// Mark a process as completed; its job is done with its last process
 void mark_process_completed(pid_t pid);
 
 // Background message queue functions
@@ -45,17 +64,60 @@ char *get_next_bg_message();
 int has_bg_messages();
 void free_bg_messages();
 
+// Print and drop every queued message
+void print_bg_messages(void);
+
+// One stage of a pipeline, split and resolved before anything is forked
+typedef struct pipeline_stage {
+    char **argv;          // NULL terminated arguments of the stage
+    bn_ptr builtin;       // Builtin to run in the child or a thread, or NULL
+    int flags;            // Registry flags of the builtin (BN_*)
+    char *path;           // Resolved executable when not a builtin
+} pipeline_stage_t;
+
 // Execute a command with pipe support
 int execute_command(char **tokens, int input_fd, int output_fd, int in_background);
 
 // Execute a system command
 int execute_system_command(char **tokens, int input_fd, int output_fd, int in_background);
 
+// Execute an already resolved command (path from resolve_command)
+int spawn_system_command(char **tokens, const char *path, int input_fd, int output_fd, int in_background);
+
+// Translate a wait status into an exit status (128 + signal if killed)
+int exit_status_of(int status);
+
 // Handle a pipeline of commands
 int handle_pipeline(char **tokens);
 
+#define PIPE_TIMEOUT_VAR "PIPETIMEOUT"   // Opt-in foreground pipeline timeout (ms)
+#define PIPE_TIMEOUT_STATUS 124          // Status of a pipeline PIPETIMEOUT stopped
+#define PIPE_SIZE_VAR "PIPESIZE"         // Pipe capacity: bytes (k/m suffix) or auto
+#define PIPE_ADAPT_INTERVAL_MS 50        // How often auto looks for full pipes
+
+/* Pipeline options are NAME=value words in front of the first stage's
+ * command (PIPETIMEOUT=500 cmd | cmd) and apply to that pipeline alone;
+ * the shell variable of the same name is the default.
+ * PIPESIZE=1m gives every pipe of the pipeline that capacity, capped at
+ * /proc/sys/fs/pipe-max-size. PIPESIZE=auto starts with the kernel's
+ * default and, while the shell waits for a foreground pipeline, doubles
+ * any pipe found full (its writer blocked) up to the same cap.
+ * Return: argv past any leading pipeline options
+ */
+char **skip_pipeline_options(char **argv);
+
+/* Run a pipeline whose stages are already split and resolved. In the
+ * foreground it returns as soon as every stage has exited; stages are
+ * only stopped (SIGTERM) once a PIPETIMEOUT runs out, and the pipeline's
+ * status is then PIPE_TIMEOUT_STATUS (as with timeout(1)) whatever its
+ * last stage returned. With a PIPETIMEOUT, builtin stages run as
+ * processes too, so the timeout can stop every stage.
+ */
+int run_pipeline(pipeline_stage_t *stages, int cmd_count, int in_background);
+
 // Command functions
 ssize_t cmd_kill(char **tokens);
 ssize_t cmd_ps(char **tokens);
+ssize_t cmd_parallel(char **tokens);
 
 #endif
\ No newline at end of file
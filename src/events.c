@@ -0,0 +1,344 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/pidfd.h>
+
+#include "events.h"
+#include "commands.h"
+#include "io_helpers.h"
+
+#define DEBUG_MODE 0 // Set to 1 to enable debug logs
+
+void events_debug_log(const char *format, ...)
+{
+    if (!DEBUG_MODE)
+        return;
+
+    va_list args;
+    va_start(args, format);
+
+    fprintf(stderr, "[EVENTS_DEBUG] ");
+    vfprintf(stderr, format, args);
+    fprintf(stderr, "\n");
+
+    va_end(args);
+}
+
+// What an epoll entry is, kept in the low bits of its data; a job's pid
+// is stored above them
+enum
+{
+    EVENT_INPUT,
+    EVENT_SIGNAL,
+    EVENT_JOB
+};
+#define EVENT_KIND_BITS 2
+#define EVENT_KIND_MASK ((1u << EVENT_KIND_BITS) - 1)
+
+static int epoll_fd = -1;
+static int signal_fd = -1;
+static int input_fd = -1;          // Last fd waited on
+static int input_watched = 0;      // Whether input_fd is in the epoll set
+static const char *event_prompt = NULL;
+static sigset_t start_mask;
+static int start_mask_saved = 0;
+
+// One reaped child, as recorded by record_child_exits
+typedef struct child_exit {
+    pid_t pid;
+    int status;
+    struct timespec when;
+} child_exit_t;
+
+/* Single-producer single-consumer ring of reaped children. The producer
+ * (record_child_exits) only advances ring_tail and the consumer
+ * (drain_child_exits) only ring_head; both are free-running counters.
+ */
+static child_exit_t exit_ring[CHILD_EXIT_RING_SIZE];
+static atomic_size_t ring_head = 0;
+static atomic_size_t ring_tail = 0;
+static atomic_int ring_overflowed = 0;  // Zombies were left for the next drain
+
+const sigset_t *child_signal_mask(void)
+{
+    if (!start_mask_saved)
+    {
+        sigprocmask(SIG_BLOCK, NULL, &start_mask);
+        start_mask_saved = 1;
+    }
+    return &start_mask;
+}
+
+int init_events(const char *prompt)
+{
+    child_signal_mask();
+    event_prompt = prompt;
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    if (prompt != NULL)
+        sigaddset(&mask, SIGINT);
+
+    signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ev = {.events = EPOLLIN, .data.u64 = EVENT_SIGNAL};
+    if (signal_fd == -1 || epoll_fd == -1 ||
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &ev) == -1)
+    {
+        events_debug_log("Event loop unavailable: %s", strerror(errno));
+        free_events();
+        return -1;
+    }
+
+    // From here on these signals only arrive through signal_fd
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    return 0;
+}
+
+void free_events(void)
+{
+    if (signal_fd != -1)
+        close(signal_fd);
+    if (epoll_fd != -1)
+        close(epoll_fd);
+    signal_fd = epoll_fd = -1;
+    input_fd = -1;
+    input_watched = 0;
+}
+
+static int ring_full(void)
+{
+    size_t head = atomic_load_explicit(&ring_head, memory_order_acquire);
+    size_t tail = atomic_load_explicit(&ring_tail, memory_order_relaxed);
+    return tail - head == CHILD_EXIT_RING_SIZE;
+}
+
+// Prereq: !ring_full() and the caller is the only producer
+static void push_child_exit(pid_t pid, int status)
+{
+    size_t tail = atomic_load_explicit(&ring_tail, memory_order_relaxed);
+    child_exit_t *record = &exit_ring[tail & (CHILD_EXIT_RING_SIZE - 1)];
+    record->pid = pid;
+    record->status = status;
+    clock_gettime(CLOCK_MONOTONIC, &record->when);
+    atomic_store_explicit(&ring_tail, tail + 1, memory_order_release);
+}
+
+void record_child_exits(void)
+{
+    int saved_errno = errno;
+    for (;;)
+    {
+        // Check for room first, so no reaped status is ever dropped
+        if (ring_full())
+        {
+            atomic_store(&ring_overflowed, 1);
+            break;
+        }
+        int status;
+        pid_t pid = waitpid(-1, &status, WNOHANG);
+        if (pid <= 0)
+            break;
+        push_child_exit(pid, status);
+    }
+    errno = saved_errno;
+}
+
+void drain_child_exits(void)
+{
+    for (;;)
+    {
+        size_t head = atomic_load_explicit(&ring_head, memory_order_relaxed);
+        size_t tail = atomic_load_explicit(&ring_tail, memory_order_acquire);
+        for (; head != tail; head++)
+        {
+            child_exit_t *record = &exit_ring[head & (CHILD_EXIT_RING_SIZE - 1)];
+            if (DEBUG_MODE)
+            {
+                struct timespec now;
+                clock_gettime(CLOCK_MONOTONIC, &now);
+                events_debug_log("Reporting %d, %ld us after it exited", record->pid,
+                                 (now.tv_sec - record->when.tv_sec) * 1000000L +
+                                     (now.tv_nsec - record->when.tv_nsec) / 1000L);
+            }
+            mark_process_completed(record->pid);
+            atomic_store_explicit(&ring_head, head + 1, memory_order_release);
+        }
+
+        if (!atomic_exchange(&ring_overflowed, 0))
+            return;
+
+        // The ring filled up and children were left unreaped: collect
+        // them here, with the handler held off so there is one producer
+        sigset_t mask, old_mask;
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGCHLD);
+        sigprocmask(SIG_BLOCK, &mask, &old_mask);
+        record_child_exits();
+        sigprocmask(SIG_SETMASK, &old_mask, NULL);
+    }
+}
+
+// A job's pidfd became readable: the job has exited
+static void reap_job(pid_t pid)
+{
+    if (ring_full())
+    {
+        // Drained at the end of this dispatch; the pidfd stays readable
+        atomic_store(&ring_overflowed, 1);
+        return;
+    }
+
+    int status = 0;
+    pid_t waited = waitpid(pid, &status, WNOHANG);
+
+    // ECHILD: someone reaped it already, or children are auto-reaped
+    // (SIGCHLD ignored since start-server); either way it is done
+    if (waited == pid || (waited == -1 && errno == ECHILD))
+    {
+        events_debug_log("Job %d finished", pid);
+        push_child_exit(pid, status);
+    }
+}
+
+/* Read the pending signals. Ctrl+C abandons the line being typed: a new
+ * prompt is shown if waiting is set (main() shows it otherwise).
+ */
+static void handle_signals(int waiting)
+{
+    struct signalfd_siginfo info[EVENT_BATCH];
+    int child_exited = 0, interrupted = 0;
+    ssize_t n;
+
+    while ((n = read(signal_fd, info, sizeof(info))) > 0)
+    {
+        for (size_t i = 0; i < (size_t)n / sizeof(info[0]); i++)
+        {
+            if (info[i].ssi_signo == SIGCHLD)
+                child_exited = 1;
+            else if (info[i].ssi_signo == SIGINT)
+                interrupted = 1;
+        }
+    }
+
+    if (child_exited)
+        record_child_exits();
+    if (interrupted)
+    {
+        display_message("\n");
+        if (waiting)
+            display_message(event_prompt);
+        flush_output();
+    }
+}
+
+/* Handle the events epoll reports within timeout_ms (-1 to block).
+ * Return: 1 if the input fd is readable, 0 if not, -1 on error
+ */
+static int dispatch_events(int timeout_ms, int waiting)
+{
+    struct epoll_event events[EVENT_BATCH];
+    int n = epoll_wait(epoll_fd, events, EVENT_BATCH, timeout_ms);
+    if (n == -1)
+        return errno == EINTR ? 0 : -1;
+
+    int input_ready = 0;
+    for (int i = 0; i < n; i++)
+    {
+        uint64_t data = events[i].data.u64;
+        switch (data & EVENT_KIND_MASK)
+        {
+        case EVENT_INPUT:
+            input_ready = 1;
+            break;
+        case EVENT_SIGNAL:
+            handle_signals(waiting);
+            break;
+        case EVENT_JOB:
+            reap_job((pid_t)(data >> EVENT_KIND_BITS));
+            break;
+        }
+    }
+    drain_child_exits();
+    return input_ready;
+}
+
+int wait_for_input(int fd)
+{
+    if (epoll_fd == -1)
+        return 0;
+
+    if (fd != input_fd)
+    {
+        if (input_watched)
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, input_fd, NULL);
+
+        // Regular files (scripts) can't be watched, but never block
+        struct epoll_event ev = {.events = EPOLLIN, .data.u64 = EVENT_INPUT};
+        input_fd = fd;
+        input_watched = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == 0;
+    }
+    if (!input_watched)
+        return 0;
+
+    for (;;)
+    {
+        int ready = dispatch_events(-1, 1);
+        if (ready == -1)
+            return -1;
+
+        // Report finished jobs now rather than after the next command
+        if (event_prompt != NULL && has_bg_messages())
+        {
+            print_bg_messages();
+            display_message(event_prompt);
+            flush_output();
+        }
+        if (ready)
+            return 0;
+    }
+}
+
+void poll_events(void)
+{
+    if (epoll_fd != -1)
+        dispatch_events(0, 0);
+    else
+        drain_child_exits();
+}
+
+int watch_job(pid_t pid)
+{
+    if (epoll_fd == -1)
+        return -1;
+
+    int pidfd = pidfd_open(pid, 0);
+    if (pidfd == -1)
+        return -1;
+
+    struct epoll_event ev = {.events = EPOLLIN,
+                             .data.u64 = ((uint64_t)pid << EVENT_KIND_BITS) | EVENT_JOB};
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, pidfd, &ev) == -1)
+    {
+        close(pidfd);
+        return -1;
+    }
+    return pidfd;
+}
+
+void unwatch_job(int pidfd)
+{
+    // Closing the only reference also drops it from the epoll set
+    if (pidfd != -1)
+        close(pidfd);
+}
@@ -0,0 +1,60 @@
+#ifndef __EVENTS_H__
+#define __EVENTS_H__
+
+#include <signal.h>
+#include <sys/types.h>
+
+
+#define EVENT_BATCH 16         // Events taken from epoll per wakeup
+#define CHILD_EXIT_RING_SIZE 1024  // Exits held between drains (power of 2)
+
+
+/* The shell's event loop: one epoll set watching the command input, a
+ * signalfd for SIGCHLD (and SIGINT when interactive) and a pidfd per
+ * background job. Those signals stay blocked for good, so children are
+ * reaped and jobs reported from ordinary code, never in a handler.
+ * prompt is shown again after a notification printed while waiting for
+ * input; NULL (scripts, -c) leaves SIGINT alone and only reports jobs
+ * between commands.
+ * Return: 0 on success, -1 if the loop can't be set up (the shell then
+ * reaps between commands only)
+ */
+int init_events(const char *prompt);
+void free_events(void);
+
+/* Signal mask the shell started with. Every child gets it back, so the
+ * signals the event loop keeps blocked are normal again in commands.
+ */
+const sigset_t *child_signal_mask(void);
+
+/* Wait until fd has input, reporting finished jobs and handling Ctrl+C
+ * meanwhile. Used as the line reader's wait hook (see set_input_wait).
+ * Return: 0 once fd is readable, -1 on error
+ */
+int wait_for_input(int fd);
+
+/* Handle whatever is already pending without waiting.
+ */
+void poll_events(void);
+
+/* Reap every exited child into a preallocated ring of (pid, status,
+ * time) records. Async-signal-safe: it is all the fallback SIGCHLD
+ * handler does. A full ring leaves the rest as zombies until the next
+ * drain. Only one context records at a time: the handler, or the event
+ * loop, which keeps SIGCHLD blocked.
+ */
+void record_child_exits(void);
+
+/* Update the jobs (queueing their Done messages) for every recorded exit.
+ * Main loop only; poll_events and wait_for_input call it.
+ */
+void drain_child_exits(void);
+
+/* Watch a background job's pid so it is reaped the moment it exits.
+ * Return: the pidfd to pass to unwatch_job, or -1 if it can't be watched
+ * (SIGCHLD still catches it)
+ */
+int watch_job(pid_t pid);
+void unwatch_job(int pidfd);
+
+#endif
@@ -3,8 +3,11 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <errno.h>
+#include <sys/uio.h>
 
 #include "io_helpers.h"
+#include "arena.h"
 
 // Debug flag
 #define DEBUG_MODE 0
@@ -27,13 +30,171 @@ void io_debug_log(const char *format, ...)
 
 // ===== Output helpers =====
 
+/* Stdout of the current command. Builtins append here and the shell
+ * flushes at command boundaries, so a listing of thousands of lines
+ * costs a handful of writev calls instead of two write() per line.
+ * Pipeline stages running on threads each get their own buffer, which
+ * drains into their stage_stream_t instead of STDOUT_FILENO.
+ */
+typedef struct output_state {
+    char *buf;
+    size_t len;
+    stage_stream_t sink;
+} output_state_t;
+
+static char shell_output_buf[OUTPUT_BUF_SIZE];
+static output_state_t shell_output = {shell_output_buf, 0, {STDOUT_FILENO, NULL}};
+static int output_buffered = 1;
+
+// Where the calling thread's output and input go
+static __thread output_state_t *output = &shell_output;
+static __thread stage_stream_t input_stream = {STDIN_FILENO, NULL};
+
+// writev() until every iov is out or a real error occurs
+static void writev_all(int fd, struct iovec *iov, int iovcnt)
+{
+    while (iovcnt > 0)
+    {
+        ssize_t n = writev(fd, iov, iovcnt);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+
+        // Skip whatever was written, possibly ending inside an iov
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len)
+        {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+}
+
+// Send iov to the current output's file descriptor or channel
+static void write_sink(struct iovec *iov, int iovcnt)
+{
+    if (output->sink.channel == NULL)
+    {
+        writev_all(output->sink.fd, iov, iovcnt);
+        return;
+    }
+    for (int i = 0; i < iovcnt; i++)
+    {
+        // A reader that went away drops the rest, like EPIPE would
+        if (channel_write(output->sink.channel, iov[i].iov_base, iov[i].iov_len) == -1)
+            return;
+    }
+}
+
+void flush_output(void)
+{
+    if (output->len == 0)
+        return;
+    io_debug_log("Flushing %zu bytes of output", output->len);
+    struct iovec iov = {output->buf, output->len};
+    write_sink(&iov, 1);
+    output->len = 0;
+}
+
+void set_output_buffered(int enabled)
+{
+    if (!enabled)
+        flush_output();
+    output_buffered = enabled;
+}
+
+void output_write(const char *buf, size_t len)
+{
+    if (len <= OUTPUT_BUF_SIZE - output->len)
+    {
+        memcpy(output->buf + output->len, buf, len);
+        output->len += len;
+    }
+    else
+    {
+        // Buffer full: send what it holds and buf in one call
+        io_debug_log("Output buffer full, writing %zu + %zu bytes", output->len, len);
+        struct iovec iov[2] = {{output->buf, output->len}, {(char *)buf, len}};
+        write_sink(iov, 2);
+        output->len = 0;
+    }
+
+    if (!output_buffered)
+        flush_output();
+}
+
+ssize_t read_input(void *buf, size_t len)
+{
+    if (input_stream.channel != NULL)
+        return channel_read(input_stream.channel, buf, len);
+
+    ssize_t n;
+    do
+    {
+        n = read(input_stream.fd, buf, len);
+    } while (n == -1 && errno == EINTR);
+    return n;
+}
+
+int raw_output_fd(void)
+{
+    if (output->sink.channel != NULL)
+        return -1;
+    flush_output();
+    return output->sink.fd;
+}
+
+int raw_input_fd(void)
+{
+    return input_stream.channel != NULL ? -1 : input_stream.fd;
+}
+
+int bind_stage_streams(stage_stream_t in, stage_stream_t out)
+{
+    output_state_t *state = malloc(sizeof(output_state_t));
+    char *buf = malloc(OUTPUT_BUF_SIZE);
+    if (state == NULL || buf == NULL)
+    {
+        free(state);
+        free(buf);
+        return -1;
+    }
+
+    state->buf = buf;
+    state->len = 0;
+    state->sink = out;
+    output = state;
+    input_stream = in;
+    return 0;
+}
+
+void unbind_stage_streams(void)
+{
+    if (output == &shell_output)
+        return;
+    flush_output();
+    free(output->buf);
+    free(output);
+    output = &shell_output;
+    input_stream.fd = STDIN_FILENO;
+    input_stream.channel = NULL;
+}
+
 /* Prereq: str is a NULL terminated string
  */
 void display_message(const char *str)
 {
     if (str == NULL)
         return;
-    write(STDOUT_FILENO, str, strnlen(str, MAX_STR_LEN));
+    output_write(str, strlen(str));
 }
 
 /* Prereq: pre_str, str are NULL terminated string
@@ -45,180 +206,309 @@ void display_error(const char *pre_str, const char *str)
     if (str == NULL)
         str = "";
 
-    write(STDERR_FILENO, pre_str, strnlen(pre_str, MAX_STR_LEN));
-    write(STDERR_FILENO, str, strnlen(str, MAX_STR_LEN));
-    write(STDERR_FILENO, "\n", 1);
+    // Keep stdout and stderr in the order they were produced
+    flush_output();
+    struct iovec iov[3] = {
+        {(char *)pre_str, strlen(pre_str)},
+        {(char *)str, strlen(str)},
+        {"\n", 1}};
+    writev_all(STDERR_FILENO, iov, 3);
 }
 
 // ===== Input tokenizing =====
 
-/* Prereq: in_ptr points to a character buffer of size > MAX_STR_LEN
- * Return: number of bytes read
+/* Buffered line reader state. Input is pulled from input_fd in
+ * INPUT_BUF_SIZE blocks and handed out one line at a time, so piped
+ * scripts cost one read() per block instead of one per command.
+ * input_data is input_buf, or the command string given with -c.
+ */
+static char input_buf[INPUT_BUF_SIZE];
+static const char *input_data = input_buf;
+static int input_fd = STDIN_FILENO;
+static size_t input_pos = 0;
+static size_t input_end = 0;
+static int input_eof = 0;
+
+// Line assembled for the caller; grows to fit the longest line seen
+static char *line_buf = NULL;
+static size_t line_cap = 0;
+
+/* Make sure line_buf can hold len bytes and a terminator.
+ * Return: 0 on success, -1 on allocation failure
+ */
+static int reserve_line(size_t len)
+{
+    size_t needed = len + 1;
+    if (needed <= line_cap)
+        return 0;
+
+    size_t new_cap = line_cap ? line_cap : MAX_STR_LEN + 1;
+    while (new_cap < needed)
+        new_cap *= 2;
+
+    char *new_buf = realloc(line_buf, new_cap);
+    if (new_buf == NULL)
+        return -1;
+    line_buf = new_buf;
+    line_cap = new_cap;
+    return 0;
+}
+
+void set_input_fd(int fd)
+{
+    input_fd = fd;
+    input_data = input_buf;
+    input_pos = input_end = 0;
+    input_eof = 0;
+}
+
+// The whole string is one block; there is nothing further to read
+void set_input_string(const char *str)
+{
+    input_data = str;
+    input_pos = 0;
+    input_end = strlen(str);
+    input_eof = 1;
+}
+
+// Called before each refill to wait for input while the shell does other
+// work (the event loop); NULL reads straight away
+static input_wait_fn input_wait = NULL;
+
+// Install or remove (NULL) the wait hook
+void set_input_wait(input_wait_fn wait)
+{
+    input_wait = wait;
+}
+
+/* Refill input_buf from input_fd once the unread part is consumed.
+ * Return: number of bytes read, 0 on EOF, -1 on error
  */
-ssize_t get_input(char *in_ptr)
+static ssize_t refill_input(void)
 {
-    int retval = read(STDIN_FILENO, in_ptr, MAX_STR_LEN + 1); // Not a sanitizer issue since in_ptr is allocated as MAX_STR_LEN+1
-    int read_len = retval;
-    if (retval == -1)
+    if (input_wait != NULL && input_wait(input_fd) == -1)
+        return -1;
+
+    ssize_t n;
+    do
     {
-        read_len = 0;
-    }
-    if (read_len > MAX_STR_LEN)
+        n = read(input_fd, input_buf, INPUT_BUF_SIZE);
+    } while (n == -1 && errno == EINTR);
+
+    input_pos = 0;
+    input_end = n > 0 ? (size_t)n : 0;
+    if (n == 0)
+        input_eof = 1;
+    return n;
+}
+
+/* Return: number of bytes consumed (including the newline), 0 on EOF
+ * and -1 on error. *line_ptr points to the NULL terminated line without
+ * its newline and stays valid until the next call.
+ */
+ssize_t get_input(char **line_ptr)
+{
+    size_t line_len = 0;
+    size_t consumed = 0;
+
+    while (1)
     {
-        read_len = 0;
-        retval = -1;
-        write(STDERR_FILENO, "ERROR: input line too long\n", strlen("ERROR: input line too long\n"));
-        int junk = 0;
-        while ((junk = getchar()) != EOF && junk != '\n')
-            ;
+        if (input_pos == input_end)
+        {
+            if (input_eof)
+                break;
+            ssize_t n = refill_input();
+            if (n == -1)
+                return -1;
+            if (n == 0)
+                break;
+        }
+
+        const char *start = input_data + input_pos;
+        size_t avail = input_end - input_pos;
+        const char *newline = memchr(start, '\n', avail);
+        size_t chunk = newline ? (size_t)(newline - start) : avail;
+
+        if (reserve_line(line_len + chunk) == -1)
+        {
+            display_error("ERROR: Out of memory reading input", "");
+            return -1;
+        }
+        memcpy(line_buf + line_len, start, chunk);
+        line_len += chunk;
+        consumed += chunk;
+        input_pos += chunk;
+
+        if (newline)
+        {
+            input_pos++; // Skip the newline
+            consumed++;
+            break;
+        }
     }
-    in_ptr[read_len] = '\0';
 
-    io_debug_log("Read input: '%s'", in_ptr);
-    return retval;
+    if (reserve_line(line_len) == -1)
+        return -1;
+    line_buf[line_len] = '\0';
+    *line_ptr = line_buf;
+
+    io_debug_log("Read input: '%s'", line_buf);
+    return consumed;
+}
+
+/* Release the line buffer held by get_input.
+ */
+void free_input(void)
+{
+    free(line_buf);
+    line_buf = NULL;
+    line_cap = 0;
 }
 
-/* Prereq: in_ptr is a string, tokens is of size >= len(in_ptr)
- * Warning: in_ptr is modified
+// Operator tokens point here rather than into the line, so a quoted or
+// escaped '|' or '&' in the input never compares equal to an operator
+static char pipe_token[] = "|";
+static char bg_token[] = "&";
+
+/* Single pass over in_ptr. Words are unescaped and NULL terminated in
+ * place (the write position never passes the read position), so no
+ * bytes are shifted and no token is copied.
  * Return: number of tokens.
  */
+size_t tokenize_input(char *in_ptr, char **tokens)
+{
+    size_t token_count = 0;
+    size_t r = 0;       // Read position
+    size_t w = 0;       // Write position, always <= r
+    size_t word = 0;    // Start of the word being built
+    int in_word = 0;
+    char quote = '\0';  // Active quote character, if any
 
-size_t tokenize_input(char *in_ptr, char **tokens) {
-    // Check if this is an echo command
-    int is_echo_command = 0;
-    char *echo_cmd = strstr(in_ptr, "echo ");
-    
-    // Only consider it an echo command if it's at the beginning or after a pipe
-    if (echo_cmd == in_ptr || (echo_cmd > in_ptr && *(echo_cmd-1) == ' ' && 
-                              (echo_cmd > in_ptr+1 && *(echo_cmd-2) == '|'))) {
-        is_echo_command = 1;
-    }
+    while (1)
+    {
+        char c = in_ptr[r];
+        char *op = NULL;
 
-    // First, explicitly handle special characters by ensuring they are surrounded by spaces
-    char *temp_ptr = in_ptr;
-    while (*temp_ptr != '\0') {
-        // We're looking for pipe characters (|) and standalone background characters (&)
-        if (*temp_ptr == '|' || (*temp_ptr == '&' && !is_echo_command)) {
-            // Insert spaces around character if needed
-            if (temp_ptr > in_ptr && *(temp_ptr - 1) != ' ') {
-                // Shift everything right to make room for a space before character
-                size_t rest_len = strlen(temp_ptr);
-                memmove(temp_ptr + 1, temp_ptr, rest_len + 1); // +1 for null terminator
-                *temp_ptr = ' ';
-                temp_ptr += 2; // Skip the space and the special character
-            } else {
-                temp_ptr++; // Skip the special character
+        if (c != '\0' && (quote != '\0' || strchr(DELIMITERS, c) == NULL))
+        {
+            if (quote != '\0')
+            {
+                // Quotes are kept in the token; they only protect what is inside
+                if (c == quote)
+                    quote = '\0';
+                else if (c == '\\' && quote == '"' &&
+                         (in_ptr[r + 1] == '"' || in_ptr[r + 1] == '\\'))
+                    r++;
             }
-            
-            if (*temp_ptr != ' ' && *temp_ptr != '\0') {
-                // Shift everything right to make room for a space after character
-                size_t rest_len = strlen(temp_ptr);
-                memmove(temp_ptr + 1, temp_ptr, rest_len + 1); // +1 for null terminator
-                *temp_ptr = ' ';
-                temp_ptr += 1; // Skip the space
+            else if (c == '"' || c == '\'')
+            {
+                quote = c;
+            }
+            else if (c == '\\')
+            {
+                // Escaped character is taken literally and the backslash dropped
+                if (in_ptr[r + 1] != '\0')
+                    r++;
+            }
+            else if (c == '|')
+            {
+                op = pipe_token;
+            }
+            else if (c == '&')
+            {
+                // '&' only means background at the end of the line; elsewhere
+                // it is an ordinary character (e.g. echo a&b)
+                size_t next = r + 1;
+                while (in_ptr[next] != '\0' && strchr(DELIMITERS, in_ptr[next]) != NULL)
+                    next++;
+                if (in_ptr[next] == '\0')
+                    op = bg_token;
             }
-        } else {
-            // Special handling for & character in echo arguments
-            if (is_echo_command && *temp_ptr == '&') {
-                // If we're in an echo command and found an & within the echo arguments,
-                // we should check if it's meant to be a background process marker
-
-                // It's a background process marker if it's at the end of the command
-                // or followed by only whitespace
-                char *check_ptr = temp_ptr + 1;
-                int is_bg_marker = 1;
-
-                // Skip whitespace
-                while (*check_ptr == ' ' || *check_ptr == '\t') {
-                    check_ptr++;
-                }
-
-                // If there's more content, it's not a background process marker
-                if (*check_ptr != '\0') {
-                    is_bg_marker = 0;
-                }
 
-                if (is_bg_marker) {
-                    // This is a background marker, handle it like other special characters
-                    if (temp_ptr > in_ptr && *(temp_ptr - 1) != ' ') {
-                        // Shift everything right to make room for a space before character
-                        size_t rest_len = strlen(temp_ptr);
-                        memmove(temp_ptr + 1, temp_ptr, rest_len + 1); // +1 for null terminator
-                        *temp_ptr = ' ';
-                        temp_ptr += 2; // Skip the space and the special character
-                    } else {
-                        temp_ptr++; // Skip the special character
-                    }
-                    
-                    if (*temp_ptr != ' ' && *temp_ptr != '\0') {
-                        // Shift everything right to make room for a space after character
-                        size_t rest_len = strlen(temp_ptr);
-                        memmove(temp_ptr + 1, temp_ptr, rest_len + 1); // +1 for null terminator
-                        *temp_ptr = ' ';
-                        temp_ptr += 1; // Skip the space
-                    }
-                } else {
-                    // This is a regular & in echo argument, leave it alone
-                    temp_ptr++;
+            if (op == NULL)
+            {
+                if (!in_word)
+                {
+                    word = w;
+                    in_word = 1;
                 }
-            } else {
-                temp_ptr++;
+                in_ptr[w++] = in_ptr[r++];
+                continue;
             }
         }
-    }
 
-    // Split by whitespace
-    size_t token_count = 0;
-    char *curr_ptr = strtok(in_ptr, DELIMITERS);
-    
-    while (curr_ptr != NULL) {
-        tokens[token_count] = curr_ptr;
-        token_count++;
-        curr_ptr = strtok(NULL, DELIMITERS);
+        // Delimiter, operator or end of input: finish the current word
+        if (in_word)
+        {
+            tokens[token_count++] = in_ptr + word;
+            in_ptr[w] = '\0';   // c was already read, safe to overwrite
+            in_word = 0;
+        }
+
+        if (c == '\0')
+            break;
+
+        if (op != NULL)
+            tokens[token_count++] = op;
+        w = ++r;
     }
+
     tokens[token_count] = NULL;
-    
+    io_debug_log("Lexed %zu tokens", token_count);
     return token_count;
 }
+
+/* Return: 1 if tok is the pipe operator produced by the lexer
+ */
+int is_pipe_token(const char *tok)
+{
+    return tok == pipe_token;
+}
+
+/* Return: 1 if tok is the trailing background operator produced by the lexer
+ */
+int is_bg_token(const char *tok)
+{
+    return tok == bg_token;
+}
+
 /* Combines multiple tokens into a single string with spaces in between
  * Prereq: tokens is a NULL-terminated array of strings
- * Returns: A newly allocated string that must be freed by the caller
+ * Returns: A string in the line arena, valid until the prompt comes back
  */
 char *combine_tokens(char **tokens, int start_idx)
 {
     if (tokens == NULL || tokens[start_idx] == NULL)
     {
-        return strdup("");
+        return arena_strdup(&line_arena, "");
     }
 
     // First, calculate the total length needed
     size_t total_len = 0;
     for (int i = start_idx; tokens[i] != NULL; i++)
     {
-        total_len += strlen(tokens[i]);
-        if (tokens[i + 1] != NULL)
-        {
-            total_len++; // For space between tokens
-        }
+        total_len += strlen(tokens[i]) + 1; // Token and the space or terminator after it
     }
 
-    // Allocate the memory
-    char *result = malloc(total_len + 1); // +1 for null terminator
+    char *result = arena_alloc(&line_arena, total_len);
     if (result == NULL)
     {
         return NULL;
     }
 
-    // Combine the tokens
-    result[0] = '\0'; // Start with empty string
+    // Copy each token once; strcat would rescan the result every time
+    size_t pos = 0;
     for (int i = start_idx; tokens[i] != NULL; i++)
     {
-        strcat(result, tokens[i]);
-        if (tokens[i + 1] != NULL)
+        if (pos > 0)
         {
-            strcat(result, " ");
+            result[pos++] = ' ';
         }
+        size_t len = strlen(tokens[i]);
+        memcpy(result + pos, tokens[i], len);
+        pos += len;
     }
+    result[pos] = '\0';
 
     return result;
 }
@@ -3,32 +3,117 @@
 
 #include <sys/types.h>
 
+#include "channel.h"
+
 
 #define MAX_STR_LEN 128
+#define INPUT_BUF_SIZE 65536   // Block size used when reading commands
+#define OUTPUT_BUF_SIZE 65536  // Stdout collected before a writev
 #define DELIMITERS " \t\n"     // Assumption: all input tokens are whitespace delimited
 
 
 /* Prereq: pre_str, str are NULL terminated string
+ * Messages of any length are accepted; display_message goes through the
+ * output buffer, display_error flushes it and writes stderr directly.
  */
 void display_message(const char *str);
 void display_error(const char *pre_str, const char *str);
 
+/* Append len bytes of buf to the stdout buffer. When the buffer is full,
+ * its contents and buf go out together in a single writev.
+ */
+void output_write(const char *buf, size_t len);
+
+/* Write out anything held by output_write. Called before the prompt,
+ * before fork, before stdout is redirected and at exit.
+ */
+void flush_output(void);
+
+/* Turn buffering off for processes that print as they go (e.g. the
+ * server and client receivers) or back on.
+ */
+void set_output_buffered(int enabled);
+
+
+/* One end of a pipeline stage that runs on a thread of the shell: a file
+ * descriptor (a kernel pipe or the shell's own stdin/stdout), or a
+ * channel to a neighbouring stage on another thread.
+ */
+typedef struct stage_stream {
+    int fd;               // Used when channel is NULL
+    channel_t *channel;
+} stage_stream_t;
+
+/* Make the calling thread's builtins read from in and write to out, with
+ * an output buffer of its own. unbind_stage_streams flushes that buffer
+ * and returns the thread to stdin/stdout; it does not close in or out.
+ * Return: 0 on success, -1 if out of memory
+ */
+int bind_stage_streams(stage_stream_t in, stage_stream_t out);
+void unbind_stage_streams(void);
+
+/* Read up to len bytes of the current command's input: stdin, or the
+ * stream bound to the calling thread. Builtins read through this rather
+ * than from STDIN_FILENO.
+ * Return: bytes read, 0 on end of file and -1 on error
+ */
+ssize_t read_input(void *buf, size_t len);
+
+/* File descriptors behind the current command's output and input, for
+ * builtins that move data in the kernel instead of through output_write
+ * and read_input. raw_output_fd flushes the output buffer first, so what
+ * was written before stays ahead of what goes to the descriptor.
+ * Return: the descriptor, or -1 when the stream is a channel
+ */
+int raw_output_fd(void);
+int raw_input_fd(void);
+
+
+/* Select where get_input reads commands from: a file descriptor (stdin
+ * by default, or an opened script) or a fixed string (mysh -c).
+ */
+void set_input_fd(int fd);
+void set_input_string(const char *str);
 
-/* Prereq: in_ptr points to a character buffer of size > MAX_STR_LEN
- * Return: number of bytes read
+/* Hook called before each read of the command input fd, to wait until
+ * it is readable while other work is handled (see wait_for_input in
+ * events.h). Return 0 to go on with the read, -1 on error. NULL, the
+ * default, reads straight away.
  */
-ssize_t get_input(char *in_ptr);
+typedef int (*input_wait_fn)(int fd);
+void set_input_wait(input_wait_fn wait);
 
+/* Reads the next line of input of any length.
+ * Return: number of bytes consumed (including the newline), 0 on EOF
+ * and -1 on error. *line_ptr is set to the NULL terminated line without
+ * its newline; it is owned by the reader and valid until the next call.
+ */
+ssize_t get_input(char **line_ptr);
+
+/* Release memory held by the line reader.
+ */
+void free_input(void);
 
-/* Prereq: in_ptr is a string, tokens is of size >= len(in_ptr)
- * Warning: in_ptr is modified
+
+/* Splits in_ptr on whitespace, '|' and a trailing '&' in a single pass
+ * and fills a NULL terminated array of token strings. Quotes protect
+ * whitespace and operators (and are kept in the token); a backslash
+ * makes the next character literal.
+ * Prereq: in_ptr is a string, tokens is of size >= len(in_ptr) + 1
+ * Warning: in_ptr is modified (tokens are terminated in place)
  * Return: number of tokens.
  */
 size_t tokenize_input(char *in_ptr, char **tokens);
 
+/* Return: 1 if tok is the pipe / background operator from the lexer,
+ * 0 for any other string (including a quoted or escaped "|" or "&")
+ */
+int is_pipe_token(const char *tok);
+int is_bg_token(const char *tok);
+
 /* Combines multiple tokens into a single string with spaces in between
  * Prereq: tokens is a NULL-terminated array of strings
- * Returns: A newly allocated string that must be freed by the caller
+ * Returns: A string in the line arena (see arena.h); do not free it
  */
 char *combine_tokens(char **tokens, int start_idx);
 
@@ -6,12 +6,21 @@
 #include <signal.h>
 #include <sys/wait.h>
 #include <stdarg.h>
+#include <fcntl.h>
 
 #include "builtins.h"
 #include "io_helpers.h"
 #include "variables.h"
 #include "commands.h"
 #include "network.h"
+#include "plan.h"
+#include "arena.h"
+#include "resolve.h"
+#include "events.h"
+#include "timing.h"
+#include "zygote.h"
+
+extern char **environ;
 
 // Debug flag - Set to 1 to enable debug logs
 #define DEBUG_MODE 0
@@ -32,97 +41,19 @@ void mysh_debug_log(const char *format, ...)
     va_end(args);
 }
 
-// Track allocated memory for expanded variables
-static char **expanded_memory = NULL;
-static size_t expanded_count = 0;
-static size_t expanded_capacity = 0;
-
-// Signal handler for SIGCHLD (child process termination)
+// Signal handler for SIGCHLD (child process termination), used only when
+// the event loop can't be set up. It only reaps into the completion ring;
+// jobs are updated when the main loop drains it
 void sigchld_handler(int signum __attribute__((unused)))
 {
-    pid_t pid;
-    int status;
-
-    // Non-blocking wait to collect all terminated children
-    while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
-    {
-        mark_process_completed(pid);
-    }
+    record_child_exits();
 }
 // Signal handler for SIGINT (Ctrl+C)
 void sigint_handler(int signum __attribute__((unused)))
 {
     // Just catch the signal to prevent shell from exiting
-    // Display a new prompt
-    display_message("\nmysh$ ");
-}
-
-// Free all memory tracked for expanded variables
-void free_expanded_memory()
-{
-    if (expanded_memory != NULL)
-    {
-        for (size_t i = 0; i < expanded_count; i++)
-        {
-            if (expanded_memory[i] != NULL)
-            {
-                free(expanded_memory[i]);
-            }
-        }
-        free(expanded_memory);
-        expanded_memory = NULL;
-        expanded_count = 0;
-        expanded_capacity = 0;
-    }
-}
-
-// Track memory allocated for variable expansion
-void track_expanded_memory(char *ptr)
-{
-    if (ptr == NULL)
-    {
-        return;
-    }
-
-    // Initialize or expand the tracking array if needed
-    if (expanded_memory == NULL)
-    {
-        expanded_capacity = 10;
-        expanded_memory = malloc(expanded_capacity * sizeof(char *));
-        if (expanded_memory == NULL)
-        {
-            // If we can't track it, at least free it to avoid leaks
-            free(ptr);
-            return;
-        }
-    }
-    else if (expanded_count >= expanded_capacity)
-    {
-        expanded_capacity *= 2;
-        char **new_memory = realloc(expanded_memory, expanded_capacity * sizeof(char *));
-        if (new_memory == NULL)
-        {
-            // If we can't expand tracking, at least free the current pointer
-            free(ptr);
-            return;
-        }
-        expanded_memory = new_memory;
-    }
-
-    // Add the pointer to our tracking array
-    expanded_memory[expanded_count++] = ptr;
-}
-
-// Function to check if a string is a variable assignment (contains '=' but not as first char)
-int is_variable_assignment(const char *str)
-{
-    if (str == NULL || str[0] == '\0' || str[0] == '=')
-    {
-        return 0;
-    }
-
-    char *equals = strchr(str, '=');
-    return equals != NULL && equals != str;
+    // Display a new prompt, bypassing the output buffer (not signal safe)
+    write(STDOUT_FILENO, "\nmysh$ ", 7);
 }
 
 // This function checks if any token in a pipeline is a variable assignment
@@ -134,7 +65,7 @@ int pipeline_has_variable_assignment(char **tokens)
     for (int i = 0; tokens[i] != NULL; i++)
     {
         // Skip pipe symbols
-        if (strcmp(tokens[i], "|") == 0)
+        if (is_pipe_token(tokens[i]))
             continue;
 
         // Check for variable assignment
@@ -156,169 +87,221 @@ int handle_variable_assignment(const char *str)
     }
 
     // Extract key (everything before first '=')
-    size_t key_len = equals - str;
-    char *key = malloc(key_len + 1);
+    char *key = arena_strndup(&line_arena, str, equals - str);
     if (key == NULL)
     {
         return -1;
     }
-    strncpy(key, str, key_len);
-    key[key_len] = '\0';
 
     // Extract value (everything after first '=')
     const char *value = equals + 1;
 
     // Handle variable expansion in value
-    char *expanded_value = NULL;
     if (strchr(value, '$') != NULL)
     {
-        expanded_value = expand_variables(value);
+        char *expanded_value = expand_variables_in(&line_arena, value);
         if (expanded_value != NULL)
         {
             value = expanded_value;
         }
     }
 
-    // Set the variable
-    int result = set_variable(key, value);
+    // Set the variable; key and expanded value go with the line arena
+    return set_variable(key, value);
+}
 
-    // Clean up
-    free(key);
-    if (expanded_value != NULL)
+// Expand the tokens a plan recorded as referencing variables, using the
+// templates it compiled for them
+void expand_variables_at(char **tokens, const size_t *indices,
+                         expand_template_t **templates, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
     {
-        free(expanded_value);
+        char *expanded = expand_template_in(&line_arena, templates[i]);
+        if (expanded != NULL)
+        {
+            // Replace token with expanded version
+            tokens[indices[i]] = expanded;
+        }
     }
+}
 
-    return result;
+// Exit status of a builtin or shell command that returned err
+static int status_of_builtin(ssize_t err)
+{
+    return err == -1 ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
-void expand_variables_in_tokens(char **tokens)
+/* Run a builtin in the foreground, or forked off as a background job.
+ * Return: the builtin's exit status (0 once a background job is started)
+ */
+int run_builtin(bn_ptr builtin_fn, char **tokens, int in_background)
 {
-    if (tokens == NULL)
-    {
-        return;
-    }
+    mysh_debug_log("Executing builtin command: %s", tokens[0]);
 
-    for (int i = 0; tokens[i] != NULL; i++)
+    if (in_background)
     {
-        // Skip expanding the first token if it's a variable assignment
-        // A variable assignment must have = not as the first character
-        if (i == 0 && is_variable_assignment(tokens[0]))
+        // Execute builtin in background
+        flush_output();
+        phase_begin(PHASE_SPAWN);
+        pid_t pid = zygote_spawn(tokens);
+        if (pid == -1)
         {
-            continue;
+            pid = fork();
         }
-
-        // Check if token contains a '$'
-        if (strchr(tokens[i], '$') != NULL)
+        if (pid != 0)
         {
-            char *expanded = expand_variables(tokens[i]);
-            if (expanded != NULL)
-            {
-                // Track the allocated memory for later cleanup
-                track_expanded_memory(expanded);
-                // Replace token with expanded version
-                tokens[i] = expanded;
-            }
+            phase_end();
         }
-    }
-}
-
-// Check if a command exists in PATH
-int check_command_exists(const char *cmd)
-{
-    mysh_debug_log("Checking if command exists: %s", cmd);
-
-    // Check absolute path
-    if (cmd[0] == '/')
-    {
-        mysh_debug_log("Checking absolute path: %s", cmd);
-        if (access(cmd, X_OK) == 0)
+        if (pid == -1)
         {
-            mysh_debug_log("Command found at absolute path");
-            return 1;
+            display_error("ERROR: Failed to fork", "");
+            return EXIT_FAILURE;
         }
-        return 0;
+        else if (pid == 0)
+        {
+            // Child process - execute the builtin
+            sigprocmask(SIG_SETMASK, child_signal_mask(), NULL);
+            exit(builtin_fn(tokens) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+        else
+        {
+            // Parent process - add to background jobs
+            char *command_str = combine_tokens(tokens, 0);
+            add_bg_process(pid, command_str != NULL ? command_str : tokens[0]);
+        }
+        return EXIT_SUCCESS;
     }
 
-    // Check in common directories
-    char path[MAX_STR_LEN];
-
-    // Check in /bin
-    snprintf(path, MAX_STR_LEN, "/bin/%s", cmd);
-    mysh_debug_log("Checking path: %s", path);
-    if (access(path, X_OK) == 0)
+    // Execute builtin normally
+    ssize_t err = builtin_fn(tokens);
+    if (err == -1)
     {
-        mysh_debug_log("Command found in /bin");
-        return 1;
+        display_error("ERROR: Builtin failed: ", tokens[0]);
     }
+    return status_of_builtin(err);
+}
 
-    // Check in /usr/bin
-    snprintf(path, MAX_STR_LEN, "/usr/bin/%s", cmd);
-    mysh_debug_log("Checking path: %s", path);
-    if (access(path, X_OK) == 0)
+/* If line starts with the `time` keyword, move it past the keyword.
+ * Return: 1 if the line is to be timed
+ */
+static int strip_time_prefix(char **line)
+{
+    char *p = *line;
+    while (*p == ' ' || *p == '\t')
     {
-        mysh_debug_log("Command found in /usr/bin");
-        return 1;
+        p++;
     }
+    if (strncmp(p, "time", 4) != 0 || (p[4] != '\0' && p[4] != ' ' && p[4] != '\t'))
+    {
+        return 0;
+    }
+    *line = p + 4;
+    return 1;
+}
 
-    // Check using PATH environment variable
-    const char *path_env = getenv("PATH");
-    mysh_debug_log("PATH environment variable: %s", path_env ? path_env : "NULL");
+// Status for exit [N]: plain exit always succeeds
+static int exit_status_arg(char **tokens)
+{
+    return tokens[1] != NULL ? atoi(tokens[1]) & 0xff : 0;
+}
 
-    if (path_env)
+// Exit status of a command run through spawn/run_pipeline/handle_pipeline
+static int status_of_command(int err, char **tokens)
+{
+    if (err == -1)
     {
-        char *path_copy = strdup(path_env);
-        if (path_copy == NULL)
+        // Only show error if not already handled by the called functions
+        if (tokens[0] != NULL)
         {
-            mysh_debug_log("Failed to allocate memory for PATH copy");
-            return 0;
+            display_error("ERROR: Command failed: ", tokens[0]);
         }
+        return EXIT_FAILURE;
+    }
+    return err;
+}
 
-        char *dir = strtok(path_copy, ":");
+/* Point the line reader at the script named on the command line.
+ * Usage: mysh [script | -c command]
+ * Return: 0 to read commands from stdin, 1 for a script or -c string,
+ * -1 if the arguments are invalid (an error has been shown)
+ */
+static int select_input(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        return 0;
+    }
 
-        while (dir != NULL)
+    if (strcmp(argv[1], "-c") == 0)
+    {
+        if (argc < 3)
         {
-            snprintf(path, MAX_STR_LEN, "%s/%s", dir, cmd);
-            mysh_debug_log("Checking path: %s", path);
-
-            if (access(path, X_OK) == 0)
-            {
-                mysh_debug_log("Command found in PATH: %s", path);
-                free(path_copy);
-                return 1;
-            }
-
-            dir = strtok(NULL, ":");
+            display_error("ERROR: -c requires a command string", "");
+            return -1;
         }
-
-        free(path_copy);
+        set_input_string(argv[2]);
+        return 1;
     }
 
-    mysh_debug_log("Command not found: %s", cmd);
-    return 0;
+    int fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        display_error("ERROR: Cannot open script: ", argv[1]);
+        return -1;
+    }
+    set_input_fd(fd);
+    return 1;
 }
 
-int main(__attribute__((unused)) int argc,
-         __attribute__((unused)) char *argv[])
+int main(int argc, char *argv[])
 {
     mysh_debug_log("mysh starting up");
 
+    // Started by zygote_spawn as the background builtin helper
+    if (argc == 2 && strcmp(argv[1], ZYGOTE_ARG) == 0)
+    {
+        return zygote_main(ZYGOTE_FD);
+    }
+
     char *prompt = "mysh$ ";
 
-    // Set up signal handlers
-    struct sigaction sa_chld, sa_int;
+    // Scripts and -c strings run without a prompt, and their output is
+    // only flushed when the buffer fills or a child is started
+    int batch_mode = select_input(argc, argv);
+    if (batch_mode == -1)
+    {
+        return 2;
+    }
+    // Children that exit() instead of exec'ing flush their own output
+    atexit(flush_output);
 
-    // Set up SIGCHLD handler for background processes
-    sa_chld.sa_handler = sigchld_handler;
-    sigemptyset(&sa_chld.sa_mask);
-    sa_chld.sa_flags = SA_RESTART;
-    sigaction(SIGCHLD, &sa_chld, NULL);
+    // Children, Ctrl+C and input all go through one event loop; a
+    // script is simply interrupted by Ctrl+C
+    if (init_events(batch_mode ? NULL : prompt) == 0)
+    {
+        set_input_wait(wait_for_input);
+    }
+    else
+    {
+        // Fall back to signal handlers
+        struct sigaction sa_chld, sa_int;
 
-    // Set up SIGINT handler for Ctrl+C
-    sa_int.sa_handler = sigint_handler;
-    sigemptyset(&sa_int.sa_mask);
-    sa_int.sa_flags = SA_RESTART;
-    sigaction(SIGINT, &sa_int, NULL);
+        // Set up SIGCHLD handler for background processes
+        sa_chld.sa_handler = sigchld_handler;
+        sigemptyset(&sa_chld.sa_mask);
+        sa_chld.sa_flags = SA_RESTART;
+        sigaction(SIGCHLD, &sa_chld, NULL);
+
+        // Set up SIGINT handler for Ctrl+C
+        if (!batch_mode)
+        {
+            sa_int.sa_handler = sigint_handler;
+            sigemptyset(&sa_int.sa_mask);
+            sa_int.sa_flags = SA_RESTART;
+            sigaction(SIGINT, &sa_int, NULL);
+        }
+    }
 
     // Initialize background process tracking
     init_bg_processes();
@@ -326,28 +309,39 @@ int main(__attribute__((unused)) int argc,
     // Initialize server info
     init_server_info();
 
-    char input_buf[MAX_STR_LEN + 1];
-    input_buf[MAX_STR_LEN] = '\0';
-    char *token_arr[MAX_STR_LEN] = {NULL};
+    // The inherited environment becomes the exported variables
+    import_environment(environ);
+
+    char *input_buf = NULL;
+    // Sized to the longest line seen; a line of n bytes has at most n tokens
+    char **token_arr = NULL;
+    size_t token_cap = 0;
+
+    // Status of the last command; the shell exits with it at end of input
+    int last_status = 0;
+    int exit_status = -1;
 
     while (1)
     {
-        // Process any background job completion messages
-        char *message;
-        while ((message = get_next_bg_message()) != NULL)
-        {
-            display_message(message);
-            display_message("\n");
-            free(message); // Free the message text
-        }
+        // The line before was run under `time`: report what it cost
+        timing_report();
+
+        // Process any background job completion messages, including
+        // jobs that finished while the last command ran
+        poll_events();
+        print_bg_messages();
 
         // Display prompt and get user input
-        display_message(prompt);
+        if (!batch_mode)
+        {
+            display_message(prompt);
+            flush_output();
+        }
         // Get and tokenize input
-        int ret = get_input(input_buf);
+        ssize_t ret = get_input(&input_buf);
 
-        // Clean up any previous expanded variables
-        free_expanded_memory();
+        // Everything the previous line allocated goes in one step
+        arena_reset(&line_arena);
 
         // Check for EOF (Ctrl+D) or error
         if (ret == 0 || ret == -1)
@@ -356,138 +350,162 @@ int main(__attribute__((unused)) int argc,
             break;
         }
 
-        // Check if input contains a pipe before tokenizing
-        int raw_has_pipe = strchr(input_buf, '|') != NULL;
-        mysh_debug_log("Raw input contains pipe: %s", raw_has_pipe ? "YES" : "NO");
-        size_t token_count = tokenize_input(input_buf, token_arr);
-
-        // Check for empty input or exit command
-        if (token_count == 0)
+        // `time cmd` runs cmd and reports where the time went
+        char *line = input_buf;
+        if (strip_time_prefix(&line))
         {
-            mysh_debug_log("Empty input, continuing");
-            continue; // Empty input, just show prompt again
+            timing_start();
         }
 
-        if (strcmp("exit", token_arr[0]) == 0)
+        // Parsed form of the line, reused when the same line comes again
+        phase_begin(PHASE_PARSE);
+        command_plan_t *plan = plan_for_line(line, strlen(line));
+        phase_end();
+        if (plan == NULL)
         {
-            mysh_debug_log("Exit command detected, breaking loop");
-            break; // Exit command, break the loop
+            display_error("ERROR: Out of memory", "");
+            continue;
         }
 
-        // Check tokens for pipe character - DO THIS FIRST
-        int has_pipe = 0;
-        for (size_t i = 0; i < token_count; i++)
+        // Grow the working token array to fit the plan
+        if (plan->token_count + 1 > token_cap)
         {
-            if (strcmp(token_arr[i], "|") == 0)
+            size_t new_cap = token_cap ? token_cap : MAX_STR_LEN;
+            while (new_cap < plan->token_count + 1)
             {
-                has_pipe = 1;
-                mysh_debug_log("Pipe token detected at position %zu", i);
-                break;
+                new_cap *= 2;
+            }
+            char **new_arr = realloc(token_arr, new_cap * sizeof(char *));
+            if (new_arr == NULL)
+            {
+                display_error("ERROR: Out of memory", "");
+                continue;
             }
+            token_arr = new_arr;
+            token_cap = new_cap;
         }
 
-        // Expand variables in the tokens
-        expand_variables_in_tokens(token_arr);
+        // Work on a copy so the cached tokens stay intact, then substitute
+        // variables only where the plan says they are referenced
+        memcpy(token_arr, plan->tokens, (plan->token_count + 1) * sizeof(char *));
+        phase_begin(PHASE_EXPAND);
+        expand_variables_at(token_arr, plan->var_tokens, plan->var_templates, plan->var_count);
+        phase_end();
 
-        // FIRST, check for pipes (regardless of whether they contain variable assignments)
-        if (has_pipe)
+        if (plan->kind == PLAN_EMPTY)
         {
-            mysh_debug_log("Detected pipeline, calling handle_pipeline");
-            int err = handle_pipeline(token_arr);
-            if (err == -1)
-            {
-                mysh_debug_log("Pipeline handler returned error");
-                if (token_arr[0] != NULL)
-                {
-                    display_error("ERROR: Command failed: ", token_arr[0]);
-                }
-            }
-            continue;
+            mysh_debug_log("Empty input, continuing");
+            continue; // Empty input, just show prompt again
         }
 
-        // THEN check for variable assignment (when no pipes are present)
-        if (is_variable_assignment(token_arr[0]))
+        if (plan->kind == PLAN_EXIT)
+        {
+            mysh_debug_log("Exit command detected, breaking loop");
+            exit_status = exit_status_arg(token_arr);
+            timing_report();    // `time exit` still reports before leaving
+            break; // Exit command, break the loop
+        }
+
+        if (plan->kind == PLAN_ASSIGNMENT)
         {
             mysh_debug_log("Variable assignment detected: %s", token_arr[0]);
+            last_status = EXIT_SUCCESS;
             if (handle_variable_assignment(token_arr[0]) == -1)
             {
                 display_error("ERROR: Failed to set variable: ", token_arr[0]);
+                last_status = EXIT_FAILURE;
             }
-            continue; // Make sure we're properly continuing
+            continue;
         }
 
-        // Handle network commands
-        if (strcmp(token_arr[0], "start-server") == 0)
+        if (plan->kind == PLAN_BUILTIN)
         {
-            mysh_debug_log("Handling start-server command");
-            ssize_t err = cmd_start_server(token_arr);
-            if (err == -1)
-            {
-                display_error("ERROR: Builtin failed: ", token_arr[0]);
-            }
+            last_status = run_builtin(plan->stages[0].builtin, token_arr, plan->in_background);
             continue;
         }
-        else if (strcmp(token_arr[0], "close-server") == 0)
+
+        if (plan->kind == PLAN_EXTERNAL || plan->kind == PLAN_PIPELINE)
         {
-            mysh_debug_log("Handling close-server command");
-            ssize_t err = cmd_close_server(token_arr);
-            if (err == -1)
+            int err;
+            if (plan->kind == PLAN_EXTERNAL)
             {
-                display_error("ERROR: Builtin failed: ", token_arr[0]);
+                mysh_debug_log("Executing cached command: %s", plan->stages[0].path);
+                err = spawn_system_command(token_arr, plan->stages[0].path,
+                                           STDIN_FILENO, STDOUT_FILENO, plan->in_background);
             }
-            continue;
-        }
-        else if (strcmp(token_arr[0], "send") == 0)
-        {
-            mysh_debug_log("Handling send command");
-            ssize_t err = cmd_send(token_arr);
-            if (err == -1)
+            else
             {
-                display_error("ERROR: Builtin failed: ", token_arr[0]);
+                mysh_debug_log("Executing cached pipeline of %zu commands", plan->stage_count);
+                // A generated line can have thousands of stages: not on the stack
+                pipeline_stage_t *stages = arena_alloc(&line_arena,
+                                                       plan->stage_count * sizeof(pipeline_stage_t));
+                if (stages == NULL)
+                {
+                    display_error("ERROR: Out of memory", "");
+                    err = -1;
+                }
+                else
+                {
+                    for (size_t i = 0; i < plan->stage_count; i++)
+                    {
+                        stages[i].argv = &token_arr[plan->stages[i].first];
+                        stages[i].builtin = plan->stages[i].builtin;
+                        stages[i].flags = plan->stages[i].flags;
+                        stages[i].path = plan->stages[i].path;
+                    }
+                    err = run_pipeline(stages, plan->stage_count, plan->in_background);
+                }
             }
+            last_status = status_of_command(err, token_arr);
             continue;
         }
-        else if (strcmp(token_arr[0], "start-client") == 0)
+
+        // Anything else takes the full dispatch path below
+        size_t token_count = plan->token_count;
+
+        // Check tokens for pipe character - DO THIS FIRST
+        int has_pipe = 0;
+        for (size_t i = 0; i < token_count; i++)
         {
-            mysh_debug_log("Handling start-client command");
-            ssize_t err = cmd_start_client(token_arr);
-            if (err == -1)
+            if (is_pipe_token(token_arr[i]))
             {
-                display_error("ERROR: Builtin failed: ", token_arr[0]);
+                has_pipe = 1;
+                mysh_debug_log("Pipe token detected at position %zu", i);
+                break;
             }
-            continue;
         }
 
-        // Check for kill command
-        if (strcmp(token_arr[0], "kill") == 0)
+
+        // FIRST, check for pipes (regardless of whether they contain variable assignments)
+        if (has_pipe)
         {
-            mysh_debug_log("Handling kill command");
-            ssize_t err = cmd_kill(token_arr);
-            if (err == -1)
-            {
-                display_error("ERROR: Builtin failed: ", token_arr[0]);
-            }
+            mysh_debug_log("Detected pipeline, calling handle_pipeline");
+            last_status = status_of_command(handle_pipeline(token_arr), token_arr);
             continue;
         }
 
-        // Check for ps command
-        if (strcmp(token_arr[0], "ps") == 0)
+        // THEN check for variable assignment (when no pipes are present)
+        if (is_variable_assignment(token_arr[0]))
         {
-            mysh_debug_log("Handling ps command");
-            ssize_t err = cmd_ps(token_arr);
-            if (err == -1)
+            mysh_debug_log("Variable assignment detected: %s", token_arr[0]);
+            last_status = EXIT_SUCCESS;
+            if (handle_variable_assignment(token_arr[0]) == -1)
             {
-                display_error("ERROR: Builtin failed: ", token_arr[0]);
+                display_error("ERROR: Failed to set variable: ", token_arr[0]);
+                last_status = EXIT_FAILURE;
             }
-            continue;
+            continue; // Make sure we're properly continuing
         }
 
-        // Check if it's a builtin command
-        bn_ptr builtin_fn = check_builtin(token_arr[0]);
-        if (builtin_fn != NULL)
+        // Commands the shell runs itself, found in one registry lookup
+        const builtin_entry_t *entry = find_builtin(token_arr[0]);
+        if (entry != NULL && (entry->flags & BN_EXIT))
+        {
+            exit_status = exit_status_arg(token_arr);
+            break;
+        }
+        if (entry != NULL)
         {
-            mysh_debug_log("Executing builtin command: %s", token_arr[0]);
-
             // Check for background execution
             int in_background = 0;
             int last_token = 0;
@@ -497,82 +515,48 @@ int main(__attribute__((unused)) int argc,
                 last_token++;
             }
 
-            // Check if the last token is &
-            if (token_arr[last_token] != NULL && strcmp(token_arr[last_token], "&") == 0)
+            // Check if the last token is &; commands that act on the shell
+            // itself run in the foreground regardless
+            if (token_arr[last_token] != NULL && is_bg_token(token_arr[last_token]))
             {
                 mysh_debug_log("Background builtin command detected");
-                in_background = 1;
+                in_background = (entry->flags & BN_BACKGROUND) != 0;
                 token_arr[last_token] = NULL; // Remove the & token
             }
 
-            if (in_background)
-            {
-                // Execute builtin in background
-                pid_t pid = fork();
-                if (pid == -1)
-                {
-                    display_error("ERROR: Failed to fork", "");
-                }
-                else if (pid == 0)
-                {
-                    // Child process - execute the builtin
-                    exit(builtin_fn(token_arr) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
-                }
-                else
-                {
-                    // Parent process - add to background jobs
-                    char command_str[MAX_STR_LEN] = "";
-                    for (int i = 0; token_arr[i] != NULL; i++)
-                    {
-                        if (i > 0)
-                        {
-                            strcat(command_str, " ");
-                        }
-                        strcat(command_str, token_arr[i]);
-                    }
-                    add_bg_process(pid, command_str);
-                }
-            }
-            else
-            {
-                // Execute builtin normally
-                ssize_t err = builtin_fn(token_arr);
-                if (err == -1)
-                {
-                    display_error("ERROR: Builtin failed: ", token_arr[0]);
-                }
-            }
+            last_status = run_builtin(entry->fn, token_arr, in_background);
             continue;
         }
         // Check if command exists before attempting to run it
-        if (!check_command_exists(token_arr[0]))
+        phase_begin(PHASE_RESOLVE);
+        int exists = command_exists(token_arr[0]);
+        phase_end();
+        if (!exists)
         {
             mysh_debug_log("Unknown command: %s", token_arr[0]);
             display_error("ERROR: Unknown command: ", token_arr[0]);
+            last_status = 127;
             continue;
         }
 
         // Handle pipeline or command execution
         mysh_debug_log("Executing system command: %s", token_arr[0]);
-        int err = handle_pipeline(token_arr);
-        if (err == -1)
-        {
-            // Only show error if not already handled by the called functions
-            // This is to prevent duplicate errors
-            if (token_arr[0] != NULL)
-            {
-                display_error("ERROR: Command failed: ", token_arr[0]);
-            }
-        }
+        last_status = status_of_command(handle_pipeline(token_arr), token_arr);
     }
 
     // Clean up before exiting
     mysh_debug_log("Cleaning up and exiting");
-    free_expanded_memory();
+    arena_free(&line_arena);
+    free(token_arr);
+    free_plan_cache();
+    free_command_cache();
+    free_input();
     free_variables();    // Clean up all variables
     free_bg_processes(); // Clean up background process tracking
     free_bg_messages();  // Clean up any pending messages
+    free_zygote();
+    free_events();
     cleanup_server();    // Clean up server resources
 
-    return 0;
+    return exit_status != -1 ? exit_status : last_status;
 }
\ No newline at end of file
@@ -495,6 +495,7 @@ ssize_t cmd_start_server(char **tokens)
     signal(SIGCHLD, SIG_IGN);
 
     // Fork a child process to run the server
+    flush_output();
     pid_t pid = fork();
 
     if (pid < 0)
@@ -507,6 +508,9 @@ ssize_t cmd_start_server(char **tokens)
         // Child process - detach from parent
         setsid();
 
+        // Long-running; its messages must not wait for a flush point
+        set_output_buffered(0);
+
         // Run the server
         run_server(port);
 
@@ -834,9 +838,12 @@ ssize_t cmd_send(char **tokens)
     char message[BUFFER_SIZE] = "";
     for (int i = 3; tokens[i] != NULL; i++)
     {
-        if (i > 3)
+        // Lines are no longer length limited, so stop once the buffer is full
+        size_t room = sizeof(message) - strlen(message) - 1;
+        if (i > 3 && room > 0)
         {
             strcat(message, " "); // Add space between tokens
+            room--;
         }
 
         // Check if token has quotes at beginning and end
@@ -844,11 +851,11 @@ ssize_t cmd_send(char **tokens)
         if (len >= 2 && tokens[i][0] == '"' && tokens[i][len - 1] == '"')
         {
             // Copy without the quotes
-            strncat(message, tokens[i] + 1, len - 2);
+            strncat(message, tokens[i] + 1, len - 2 < room ? len - 2 : room);
         }
         else
         {
-            strcat(message, tokens[i]);
+            strncat(message, tokens[i], room);
         }
     }
 
@@ -1036,6 +1043,7 @@ ssize_t cmd_start_client(char **tokens)
     display_message("Connected to server. Type messages to send. Use CTRL+D to exit.\n");
 
     // Fork a child process to handle receiving messages
+    flush_output();
     pid_t pid = fork();
 
     if (pid < 0)
@@ -1047,6 +1055,7 @@ ssize_t cmd_start_client(char **tokens)
     else if (pid == 0)
     {
         // Child process - handle receiving
+        set_output_buffered(0);
         client_receive(sockfd);
         exit(EXIT_SUCCESS); // Should never reach here
     }
@@ -0,0 +1,319 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdarg.h>
+
+#include "plan.h"
+#include "builtins.h"
+#include "commands.h"
+#include "io_helpers.h"
+#include "variables.h"
+#include "resolve.h"
+#include "timing.h"
+
+#define DEBUG_MODE 0 // Set to 1 to enable debug logs
+
+void plan_debug_log(const char *format, ...)
+{
+    if (!DEBUG_MODE)
+        return;
+
+    va_list args;
+    va_start(args, format);
+
+    fprintf(stderr, "[PLAN_DEBUG] ");
+    vfprintf(stderr, format, args);
+    fprintf(stderr, "\n");
+
+    va_end(args);
+}
+
+// Direct-mapped cache of parsed lines, indexed by hash of the raw text
+static command_plan_t *plan_cache[PLAN_CACHE_SIZE];
+static size_t plan_hits = 0;
+static size_t plan_misses = 0;
+
+// FNV-1a over the raw line
+static unsigned long hash_line(const char *line, size_t len)
+{
+    unsigned long hash = 14695981039346656037UL;
+    for (size_t i = 0; i < len; i++)
+    {
+        hash ^= (unsigned char)line[i];
+        hash *= 1099511628211UL;
+    }
+    return hash;
+}
+
+static void free_plan(command_plan_t *plan)
+{
+    if (plan == NULL)
+        return;
+
+    for (size_t i = 0; i < plan->stage_count; i++)
+    {
+        free(plan->stages[i].path);
+    }
+    free(plan->stages);
+    for (size_t i = 0; i < plan->var_count; i++)
+    {
+        free_expansion(plan->var_templates[i]);
+    }
+    free(plan->var_templates);
+    free(plan->var_tokens);
+    free(plan->tokens);
+    free(plan->text);
+    free(plan->key);
+    free(plan);
+}
+
+/* Fill in a stage from its command name. Shell commands that can't be
+ * pipeline stages are only taken as builtins when they stand alone;
+ * inside a pipeline their name is looked up on PATH like bash would.
+ * Return: 0 if the stage can run from the cache, -1 if it must take the
+ * generic path (unknown command or name depends on a variable)
+ */
+static int resolve_stage(plan_stage_t *stage, const char *name, int in_pipeline)
+{
+    if (strchr(name, '$') != NULL || is_bg_token(name))
+        return -1;
+
+    if (is_variable_assignment(name))
+        return 0;
+
+    const builtin_entry_t *entry = find_builtin(name);
+    if (entry != NULL && (!in_pipeline || (entry->flags & BN_PIPELINE)))
+    {
+        stage->builtin = entry->fn;
+        stage->flags = entry->flags;
+        return 0;
+    }
+
+    stage->path = find_command_path(name);
+    return stage->path != NULL ? 0 : -1;
+}
+
+// Strip a trailing '&' from the stage that ends at tokens[end]
+static int strip_background(command_plan_t *plan, size_t end)
+{
+    if (end > 0 && plan->tokens[end - 1] != NULL && is_bg_token(plan->tokens[end - 1]))
+    {
+        plan->tokens[end - 1] = NULL;
+        return 1;
+    }
+    return 0;
+}
+
+// Work out how the lexed tokens of plan should be run
+static void classify_plan(command_plan_t *plan)
+{
+    char **tokens = plan->tokens;
+    size_t count = plan->token_count;
+
+    plan->kind = PLAN_GENERIC;
+    if (count == 0)
+    {
+        plan->kind = PLAN_EMPTY;
+        return;
+    }
+    const builtin_entry_t *entry = find_builtin(tokens[0]);
+    if (entry != NULL && (entry->flags & BN_EXIT))
+    {
+        plan->kind = PLAN_EXIT;
+        return;
+    }
+
+    size_t stage_count = 1;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (is_pipe_token(tokens[i]))
+            stage_count++;
+    }
+
+    if (stage_count == 1 && is_variable_assignment(tokens[0]))
+    {
+        plan->kind = PLAN_ASSIGNMENT;
+        return;
+    }
+    plan->stages = calloc(stage_count, sizeof(plan_stage_t));
+    if (plan->stages == NULL)
+        return;
+    plan->stage_count = stage_count;
+
+    // Resolve every stage before touching the tokens, so a generic plan
+    // keeps its '|' tokens for the full dispatch path
+    size_t stage = 0;
+    for (size_t i = 0; i <= count && stage < stage_count; i++)
+    {
+        if (i == count || is_pipe_token(tokens[i]))
+        {
+            size_t first = plan->stages[stage].first;
+            char *name = tokens[first];
+            if (stage == 0 && stage_count > 1)
+                name = *skip_pipeline_options(&tokens[first]);
+            int resolved = 0;
+            if (first != i && name != NULL && !is_pipe_token(name))
+            {
+                phase_begin(PHASE_RESOLVE);
+                resolved = resolve_stage(&plan->stages[stage], name, stage_count > 1) == 0;
+                phase_end();
+            }
+            if (!resolved)
+            {
+                plan_debug_log("Stage %zu of '%s' needs the generic path", stage, plan->key);
+                return;
+            }
+            if (++stage < stage_count)
+                plan->stages[stage].first = i + 1;
+        }
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        if (is_pipe_token(tokens[i]))
+            tokens[i] = NULL;
+    }
+    plan->in_background = strip_background(plan, count);
+
+    if (stage_count > 1)
+        plan->kind = PLAN_PIPELINE;
+    else if (plan->stages[0].builtin != NULL)
+    {
+        plan->kind = PLAN_BUILTIN;
+        // Shell commands act on the shell itself; '&' is ignored for them
+        if (!(plan->stages[0].flags & BN_BACKGROUND))
+            plan->in_background = 0;
+    }
+    else
+        plan->kind = PLAN_EXTERNAL;
+}
+
+// Lex and classify a line into a new plan
+static command_plan_t *build_plan(const char *line, size_t len, unsigned long hash)
+{
+    command_plan_t *plan = calloc(1, sizeof(command_plan_t));
+    if (plan == NULL)
+        return NULL;
+
+    plan->hash = hash;
+    plan->key_len = len;
+    plan->key = malloc(len + 1);
+    plan->text = malloc(len + 1);
+    plan->tokens = malloc((len + 1) * sizeof(char *));
+    if (plan->key == NULL || plan->text == NULL || plan->tokens == NULL)
+    {
+        free_plan(plan);
+        return NULL;
+    }
+    memcpy(plan->key, line, len);
+    plan->key[len] = '\0';
+    memcpy(plan->text, line, len + 1);
+
+    plan->token_count = tokenize_input(plan->text, plan->tokens);
+
+    // Remember where variables are referenced so a hit only substitutes
+    for (size_t i = 0; i < plan->token_count; i++)
+    {
+        // The value of an assignment is expanded when it is assigned
+        if (i == 0 && is_variable_assignment(plan->tokens[0]))
+            continue;
+        if (strchr(plan->tokens[i], '$') == NULL)
+            continue;
+
+        if (plan->var_tokens == NULL)
+        {
+            plan->var_tokens = malloc(plan->token_count * sizeof(size_t));
+            plan->var_templates = calloc(plan->token_count, sizeof(expand_template_t *));
+            if (plan->var_tokens == NULL || plan->var_templates == NULL)
+            {
+                free_plan(plan);
+                return NULL;
+            }
+        }
+        // Compile the token once; every hit just fills in the values
+        plan->var_templates[plan->var_count] = compile_expansion(plan->tokens[i]);
+        if (plan->var_templates[plan->var_count] == NULL)
+        {
+            free_plan(plan);
+            return NULL;
+        }
+        plan->var_tokens[plan->var_count++] = i;
+    }
+
+    plan->resolve_generation = resolver_generation();
+    classify_plan(plan);
+    plan_debug_log("Built plan for '%s': kind %d, %zu stages", plan->key, plan->kind, plan->stage_count);
+    return plan;
+}
+
+// Paths resolved for the plan are stale once the resolver drops them
+static int plan_still_valid(command_plan_t *plan)
+{
+    phase_begin(PHASE_RESOLVE);
+    int valid = plan->resolve_generation == resolver_generation();
+    phase_end();
+    return valid;
+}
+
+/* Return: the plan for line (len bytes, without newline), built and
+ * cached on a miss, or NULL if out of memory.
+ */
+command_plan_t *plan_for_line(const char *line, size_t len)
+{
+    unsigned long hash = hash_line(line, len);
+    size_t slot = hash & (PLAN_CACHE_SIZE - 1);
+    command_plan_t *plan = plan_cache[slot];
+
+    if (plan != NULL && plan->hash == hash && plan->key_len == len &&
+        memcmp(plan->key, line, len) == 0 && plan_still_valid(plan))
+    {
+        plan_hits++;
+        plan_debug_log("Plan cache hit for '%s'", plan->key);
+        return plan;
+    }
+
+    plan_misses++;
+    free_plan(plan);
+    plan_cache[slot] = build_plan(line, len, hash);
+    return plan_cache[slot];
+}
+
+void plan_cache_stats(size_t *hits, size_t *misses, size_t *entries)
+{
+    if (hits != NULL)
+        *hits = plan_hits;
+    if (misses != NULL)
+        *misses = plan_misses;
+    if (entries != NULL)
+    {
+        *entries = 0;
+        for (size_t i = 0; i < PLAN_CACHE_SIZE; i++)
+        {
+            if (plan_cache[i] != NULL)
+                (*entries)++;
+        }
+    }
+}
+
+void free_plan_cache(void)
+{
+    for (size_t i = 0; i < PLAN_CACHE_SIZE; i++)
+    {
+        free_plan(plan_cache[i]);
+        plan_cache[i] = NULL;
+    }
+}
+
+// Handle the cache-stats command
+ssize_t cmd_cache_stats(char **tokens __attribute__((unused)))
+{
+    size_t hits, misses, entries;
+    plan_cache_stats(&hits, &misses, &entries);
+
+    char buffer[MAX_STR_LEN];
+    snprintf(buffer, MAX_STR_LEN, "plan cache: %zu hits, %zu misses, %zu entries\n",
+             hits, misses, entries);
+    display_message(buffer);
+    return 0;
+}
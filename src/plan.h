@@ -0,0 +1,75 @@
+#ifndef __PLAN_H__
+#define __PLAN_H__
+
+#include <unistd.h>
+
+#include "builtins.h"
+#include "variables.h"
+
+
+#define PLAN_CACHE_SIZE 256    // Number of cached command lines (power of 2)
+
+
+/* How main() should run a parsed line. PLAN_GENERIC lines take the full
+ * dispatch path (unknown commands and lines whose command name comes
+ * from a variable).
+ */
+typedef enum {
+    PLAN_GENERIC,
+    PLAN_EMPTY,
+    PLAN_EXIT,
+    PLAN_ASSIGNMENT,
+    PLAN_BUILTIN,
+    PLAN_EXTERNAL,
+    PLAN_PIPELINE
+} plan_kind_t;
+
+// One stage of a cached pipeline
+typedef struct plan_stage {
+    size_t first;         // Index of the stage's first token in tokens
+    bn_ptr builtin;       // Builtin for the stage, or NULL
+    int flags;            // Registry flags of the builtin
+    char *path;           // Resolved executable, or NULL
+} plan_stage_t;
+
+/* Parsed form of one command line. tokens point into text; for builtins,
+ * externals and pipelines the trailing '&' is already removed and every
+ * '|' replaced by NULL, so each stage's arguments are NULL terminated.
+ */
+typedef struct command_plan {
+    char *key;            // Raw line the plan was built from
+    size_t key_len;
+    unsigned long hash;
+    char *text;           // Lexed copy of the line
+    char **tokens;        // token_count entries plus a final NULL
+    size_t token_count;
+    size_t *var_tokens;   // Indices of tokens that need variable expansion
+    expand_template_t **var_templates; // Compiled form of each of those tokens
+    size_t var_count;
+    plan_kind_t kind;
+    int in_background;
+    plan_stage_t *stages; // stage_count entries (1 for builtins/externals)
+    size_t stage_count;
+    unsigned long resolve_generation; // Resolver state the paths came from
+} command_plan_t;
+
+
+/* Return: the plan for line (len bytes, without newline), built and
+ * cached on a miss, or NULL if out of memory. The plan stays valid until
+ * the next call; callers must copy tokens before modifying the array.
+ */
+command_plan_t *plan_for_line(const char *line, size_t len);
+
+/* Report cache counters through any non-NULL pointer.
+ */
+void plan_cache_stats(size_t *hits, size_t *misses, size_t *entries);
+
+/* Free every cached plan.
+ */
+void free_plan_cache(void);
+
+/* Shell command: print plan cache counters.
+ */
+ssize_t cmd_cache_stats(char **tokens);
+
+#endif
@@ -0,0 +1,337 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "resolve.h"
+#include "io_helpers.h"
+#include "variables.h"
+
+#define DEBUG_MODE 0 // Set to 1 to enable debug logs
+
+void resolve_debug_log(const char *format, ...)
+{
+    if (!DEBUG_MODE)
+        return;
+
+    va_list args;
+    va_start(args, format);
+
+    fprintf(stderr, "[RESOLVE_DEBUG] ");
+    vfprintf(stderr, format, args);
+    fprintf(stderr, "\n");
+
+    va_end(args);
+}
+
+#define CMD_CACHE_INITIAL 64   // Slots on first use (power of 2)
+
+// One cached resolution; path NULL records that the name was not found
+typedef struct resolved_command {
+    unsigned long hash;        // 0 marks an empty slot
+    char *name;
+    char *path;
+} resolved_command_t;
+
+// Open-addressed cache of name -> path, kept at most half full
+static resolved_command_t *cmd_cache = NULL;
+static size_t cmd_cache_capacity = 0;
+static size_t cmd_cache_count = 0;
+static unsigned long cache_generation = 1;
+
+// Directories searched, in order, with the mtime each had when the
+// cache started relying on it. dir_text holds the split copy of PATH.
+static char *cached_path_env = NULL;
+static char *dir_text = NULL;
+static const char **search_dirs = NULL;
+static struct timespec *dir_mtimes = NULL;
+static size_t search_dir_count = 0;
+static struct timespec last_check;
+
+// FNV-1a over the name, never 0 so 0 can mark empty slots
+static unsigned long hash_name(const char *name)
+{
+    unsigned long hash = 14695981039346656037UL;
+    for (size_t i = 0; name[i] != '\0'; i++)
+    {
+        hash ^= (unsigned char)name[i];
+        hash *= 1099511628211UL;
+    }
+    return hash != 0 ? hash : 1;
+}
+
+static long ms_since(const struct timespec *then, const struct timespec *now)
+{
+    return (now->tv_sec - then->tv_sec) * 1000L + (now->tv_nsec - then->tv_nsec) / 1000000L;
+}
+
+// Directory mtime, or zero if it can't be stat'ed (e.g. doesn't exist)
+static struct timespec dir_mtime(const char *dir)
+{
+    struct stat st;
+    struct timespec none = {0, 0};
+    return stat(dir, &st) == 0 ? st.st_mtim : none;
+}
+
+void clear_command_cache(void)
+{
+    for (size_t i = 0; i < cmd_cache_capacity; i++)
+    {
+        free(cmd_cache[i].name);
+        free(cmd_cache[i].path);
+    }
+    if (cmd_cache != NULL)
+        memset(cmd_cache, 0, cmd_cache_capacity * sizeof(resolved_command_t));
+    cmd_cache_count = 0;
+    cache_generation++;
+}
+
+static void free_search_dirs(void)
+{
+    free(cached_path_env);
+    free(dir_text);
+    free(search_dirs);
+    free(dir_mtimes);
+    cached_path_env = dir_text = NULL;
+    search_dirs = NULL;
+    dir_mtimes = NULL;
+    search_dir_count = 0;
+}
+
+/* Split path_env into the list of directories to search, once per PATH
+ * value rather than once per lookup.
+ * Return: 0 on success, -1 if out of memory
+ */
+static int load_search_dirs(const char *path_env)
+{
+    free_search_dirs();
+
+    size_t max_dirs = 3;    // /bin, /usr/bin and at least one PATH entry
+    for (const char *c = path_env; *c != '\0'; c++)
+    {
+        if (*c == ':')
+            max_dirs++;
+    }
+
+    cached_path_env = strdup(path_env);
+    dir_text = strdup(path_env);
+    search_dirs = malloc(max_dirs * sizeof(char *));
+    dir_mtimes = malloc(max_dirs * sizeof(struct timespec));
+    if (cached_path_env == NULL || dir_text == NULL || search_dirs == NULL || dir_mtimes == NULL)
+    {
+        free_search_dirs();
+        return -1;
+    }
+
+    search_dirs[search_dir_count++] = "/bin";
+    search_dirs[search_dir_count++] = "/usr/bin";
+    for (char *dir = strtok(dir_text, ":"); dir != NULL; dir = strtok(NULL, ":"))
+    {
+        search_dirs[search_dir_count++] = dir;
+    }
+
+    for (size_t i = 0; i < search_dir_count; i++)
+    {
+        dir_mtimes[i] = dir_mtime(search_dirs[i]);
+    }
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &last_check);
+    return 0;
+}
+
+/* Drop the cache if PATH changed, or if a search directory was modified
+ * since it was last checked (at most every RESOLVE_RECHECK_MS).
+ */
+static void validate_cache(void)
+{
+    const char *path_env = get_variable("PATH");
+    if (path_env == NULL)
+        path_env = "";
+
+    if (cached_path_env == NULL || strcmp(cached_path_env, path_env) != 0)
+    {
+        resolve_debug_log("PATH changed, clearing command cache");
+        clear_command_cache();
+        load_search_dirs(path_env);
+        return;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    if (ms_since(&last_check, &now) < RESOLVE_RECHECK_MS)
+        return;
+    last_check = now;
+
+    int changed = 0;
+    for (size_t i = 0; i < search_dir_count; i++)
+    {
+        struct timespec mtime = dir_mtime(search_dirs[i]);
+        if (mtime.tv_sec != dir_mtimes[i].tv_sec || mtime.tv_nsec != dir_mtimes[i].tv_nsec)
+        {
+            resolve_debug_log("%s was modified", search_dirs[i]);
+            dir_mtimes[i] = mtime;
+            changed = 1;
+        }
+    }
+    if (changed)
+        clear_command_cache();
+}
+
+// Slot holding name, or the empty slot where it would go
+static resolved_command_t *find_entry(const char *name, unsigned long hash)
+{
+    size_t mask = cmd_cache_capacity - 1;
+    size_t i = hash & mask;
+    while (cmd_cache[i].hash != 0)
+    {
+        if (cmd_cache[i].hash == hash && strcmp(cmd_cache[i].name, name) == 0)
+            return &cmd_cache[i];
+        i = (i + 1) & mask;
+    }
+    return &cmd_cache[i];
+}
+
+/* Make room for one more entry.
+ * Return: 0 on success, -1 if out of memory
+ */
+static int reserve_entry(void)
+{
+    if ((cmd_cache_count + 1) * 2 <= cmd_cache_capacity)
+        return 0;
+
+    size_t new_capacity = cmd_cache_capacity ? cmd_cache_capacity * 2 : CMD_CACHE_INITIAL;
+    resolved_command_t *new_cache = calloc(new_capacity, sizeof(resolved_command_t));
+    if (new_cache == NULL)
+        return -1;
+
+    resolved_command_t *old_cache = cmd_cache;
+    size_t old_capacity = cmd_cache_capacity;
+    cmd_cache = new_cache;
+    cmd_cache_capacity = new_capacity;
+    for (size_t i = 0; i < old_capacity; i++)
+    {
+        if (old_cache[i].hash != 0)
+            *find_entry(old_cache[i].name, old_cache[i].hash) = old_cache[i];
+    }
+    free(old_cache);
+    return 0;
+}
+
+// Probe the search directories for cmd; returns a new string or NULL
+static char *search_command(const char *cmd)
+{
+    char path[PATH_MAX];
+    for (size_t i = 0; i < search_dir_count; i++)
+    {
+        snprintf(path, PATH_MAX, "%s/%s", search_dirs[i], cmd);
+        if (access(path, X_OK) == 0)
+        {
+            resolve_debug_log("Found %s at %s", cmd, path);
+            return strdup(path);
+        }
+    }
+    resolve_debug_log("Command not found: %s", cmd);
+    return NULL;
+}
+
+const char *resolve_command(const char *cmd)
+{
+    // Check for null command
+    if (cmd == NULL || cmd[0] == '\0')
+        return NULL;
+
+    // A path is used as it is
+    if (strchr(cmd, '/') != NULL)
+        return access(cmd, X_OK) == 0 ? cmd : NULL;
+
+    validate_cache();
+
+    unsigned long hash = hash_name(cmd);
+    if (cmd_cache != NULL)
+    {
+        resolved_command_t *entry = find_entry(cmd, hash);
+        if (entry->hash != 0)
+            return entry->path;
+    }
+
+    char *path = search_command(cmd);
+    char *name = strdup(cmd);
+    if (name == NULL || reserve_entry() == -1)
+    {
+        free(name);
+        free(path);
+        return NULL;
+    }
+
+    resolved_command_t *entry = find_entry(cmd, hash);
+    entry->hash = hash;
+    entry->name = name;
+    entry->path = path;
+    cmd_cache_count++;
+    return path;
+}
+
+char *find_command_path(const char *cmd)
+{
+    const char *path = resolve_command(cmd);
+    return path != NULL ? strdup(path) : NULL;
+}
+
+int command_exists(const char *cmd)
+{
+    return resolve_command(cmd) != NULL;
+}
+
+unsigned long resolver_generation(void)
+{
+    validate_cache();
+    return cache_generation;
+}
+
+void free_command_cache(void)
+{
+    clear_command_cache();
+    free(cmd_cache);
+    cmd_cache = NULL;
+    cmd_cache_capacity = 0;
+    free_search_dirs();
+}
+
+// Handle the hash command
+ssize_t cmd_hash(char **tokens)
+{
+    int i = 1;
+    if (tokens[1] != NULL && strcmp(tokens[1], "-r") == 0)
+    {
+        clear_command_cache();
+        i++;
+    }
+
+    if (tokens[1] == NULL)
+    {
+        // List what the cache found, in slot order
+        for (size_t j = 0; j < cmd_cache_capacity; j++)
+        {
+            if (cmd_cache[j].hash != 0 && cmd_cache[j].path != NULL)
+            {
+                display_message(cmd_cache[j].path);
+                display_message("\n");
+            }
+        }
+        return 0;
+    }
+
+    ssize_t result = 0;
+    for (; tokens[i] != NULL; i++)
+    {
+        if (resolve_command(tokens[i]) == NULL)
+        {
+            display_error("ERROR: Unknown command: ", tokens[i]);
+            result = -1;
+        }
+    }
+    return result;
+}
@@ -0,0 +1,42 @@
+#ifndef __RESOLVE_H__
+#define __RESOLVE_H__
+
+#include <unistd.h>
+
+
+#define RESOLVE_RECHECK_MS 1000   // How often PATH directories are re-stat'ed
+
+
+/* Resolve a command name to the executable that would run. Names with a
+ * '/' are used as they are; anything else is looked up in /bin, /usr/bin
+ * and then $PATH. Results, including "not found", are cached until PATH
+ * changes, one of its directories is modified or `hash -r` is run.
+ * Return: the path (owned by the cache, valid until it is cleared, or
+ * cmd itself for names with a '/'), or NULL if the command doesn't exist
+ */
+const char *resolve_command(const char *cmd);
+
+/* Same as resolve_command, but returns a newly allocated copy
+ */
+char *find_command_path(const char *cmd);
+
+/* Return: 1 if cmd resolves to an executable, 0 otherwise
+ */
+int command_exists(const char *cmd);
+
+/* Return: a number that changes whenever cached resolutions are dropped,
+ * so callers holding resolved paths know to look them up again
+ */
+unsigned long resolver_generation(void);
+
+/* Forget every cached resolution, or free the cache at exit.
+ */
+void clear_command_cache(void);
+void free_command_cache(void);
+
+/* Shell command: hash [-r] [name...]
+ * Lists the cached commands, -r forgets them, names are resolved now.
+ */
+ssize_t cmd_hash(char **tokens);
+
+#endif
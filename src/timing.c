@@ -0,0 +1,126 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "timing.h"
+#include "io_helpers.h"
+
+static const char *const phase_names[PHASE_COUNT] = {
+    "parse", "expand", "resolve", "spawn", "wait"};
+
+static int active = 0;
+static struct timespec started;
+static struct rusage self_start;
+static struct timeval child_user, child_sys;
+static long child_maxrss = 0;
+static long long phase_ns[PHASE_COUNT];
+
+// Phases currently open, innermost last, and when the innermost was
+// last credited
+static phase_t phase_stack[TIMING_MAX_DEPTH];
+static int phase_depth = 0;
+static long long phase_mark = 0;
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static long long timeval_ns(const struct timeval *tv)
+{
+    return tv->tv_sec * 1000000000LL + tv->tv_usec * 1000LL;
+}
+
+static void timeval_add(struct timeval *sum, const struct timeval *tv)
+{
+    sum->tv_sec += tv->tv_sec;
+    sum->tv_usec += tv->tv_usec;
+    if (sum->tv_usec >= 1000000)
+    {
+        sum->tv_sec++;
+        sum->tv_usec -= 1000000;
+    }
+}
+
+void timing_start(void)
+{
+    memset(phase_ns, 0, sizeof(phase_ns));
+    memset(&child_user, 0, sizeof(child_user));
+    memset(&child_sys, 0, sizeof(child_sys));
+    child_maxrss = 0;
+    phase_depth = 0;
+    getrusage(RUSAGE_SELF, &self_start);
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    active = 1;
+}
+
+int timing_active(void)
+{
+    return active;
+}
+
+void phase_begin(phase_t phase)
+{
+    if (!active || phase_depth == TIMING_MAX_DEPTH)
+        return;
+
+    long long now = now_ns();
+    if (phase_depth > 0)
+        phase_ns[phase_stack[phase_depth - 1]] += now - phase_mark;
+    phase_stack[phase_depth++] = phase;
+    phase_mark = now;
+}
+
+void phase_end(void)
+{
+    if (!active || phase_depth == 0)
+        return;
+
+    long long now = now_ns();
+    phase_ns[phase_stack[--phase_depth]] += now - phase_mark;
+    phase_mark = now;
+}
+
+void timing_add_child(const struct rusage *usage)
+{
+    if (!active)
+        return;
+
+    timeval_add(&child_user, &usage->ru_utime);
+    timeval_add(&child_sys, &usage->ru_stime);
+    if (usage->ru_maxrss > child_maxrss)
+        child_maxrss = usage->ru_maxrss;
+}
+
+void timing_report(void)
+{
+    if (!active)
+        return;
+    active = 0;
+
+    struct timespec ended;
+    struct rusage self_end;
+    clock_gettime(CLOCK_MONOTONIC, &ended);
+    getrusage(RUSAGE_SELF, &self_end);
+
+    long long real = (ended.tv_sec - started.tv_sec) * 1000000000LL +
+                     (ended.tv_nsec - started.tv_nsec);
+    long long user = timeval_ns(&self_end.ru_utime) - timeval_ns(&self_start.ru_utime) +
+                     timeval_ns(&child_user);
+    long long sys = timeval_ns(&self_end.ru_stime) - timeval_ns(&self_start.ru_stime) +
+                    timeval_ns(&child_sys);
+    long maxrss = self_end.ru_maxrss > child_maxrss ? self_end.ru_maxrss : child_maxrss;
+
+    char line[256];
+    snprintf(line, sizeof(line), "%-7s %lld ns\n%-7s %lld ns\n%-7s %lld ns\n%-7s %ld KiB",
+             "real", real, "user", user, "sys", sys, "maxrss", maxrss);
+    display_error(line, "");
+    for (int i = 0; i < PHASE_COUNT; i++)
+    {
+        snprintf(line, sizeof(line), "%-7s %lld ns", phase_names[i], phase_ns[i]);
+        display_error(line, "");
+    }
+}
@@ -0,0 +1,46 @@
+#ifndef __TIMING_H__
+#define __TIMING_H__
+
+#include <sys/resource.h>
+
+
+#define TIMING_MAX_DEPTH 8     // Phases that can be nested inside each other
+
+
+/* Where the shell spends its own time while running a command. Phases
+ * nest: a phase started inside another pauses it, so each nanosecond is
+ * counted in exactly one phase.
+ */
+typedef enum {
+    PHASE_PARSE,
+    PHASE_EXPAND,
+    PHASE_RESOLVE,
+    PHASE_SPAWN,
+    PHASE_WAIT,
+    PHASE_COUNT
+} phase_t;
+
+
+/* Start measuring a command run under the `time` prefix, or print what
+ * was measured to stderr and stop. Wall, user and sys time, max RSS and
+ * every phase are reported; user, sys and max RSS include the shell
+ * itself (builtins run in it) and every child reaped meanwhile.
+ */
+void timing_start(void);
+void timing_report(void);
+
+/* Return: 1 while a timed command runs
+ */
+int timing_active(void);
+
+/* Mark the start and end of a phase on the main thread. Both do nothing
+ * unless a timed command is running.
+ */
+void phase_begin(phase_t phase);
+void phase_end(void);
+
+/* Account for a foreground child reaped with wait4.
+ */
+void timing_add_child(const struct rusage *usage);
+
+#endif
@@ -1,19 +1,220 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "variables.h"
 #include "io_helpers.h"
 
-// Define a structure to hold variable key-value pairs
-typedef struct variable {
-    char *key;
+#define VAR_INITIAL_SLOTS 16   // Table size on first use (power of 2)
+#define VAR_INLINE_KEY 24      // Keys shorter than this are stored in the slot
+
+// One slot of the open-addressed variable table; hash 0 marks it empty
+typedef struct var_slot {
+    unsigned long hash;
+    size_t key_len;
+    union {
+        char inline_key[VAR_INLINE_KEY];
+        char *heap_key;          // When key_len >= VAR_INLINE_KEY
+    } key;
     char *value;
-    struct variable *next;
+    size_t value_len;
+    char *env_entry;             // "KEY=VALUE" in var_envp, or NULL if not exported
+    size_t env_index;            // Position of env_entry in var_envp
+} var_slot_t;
+
+// A variable environment: linear probing, at most half full
+typedef struct variable {
+    var_slot_t *slots;
+    size_t capacity;             // Power of 2
+    size_t count;
 } variable_t;
 
-// Head of the linked list to store variables
-static variable_t *var_list = NULL;
+// The shell's current variables
+static variable_t *var_table = NULL;
+
+// Exported variables as "KEY=VALUE" strings, NULL terminated, kept up to
+// date on every set and unset so exec never has to build an environment
+static char **var_envp = NULL;
+static size_t envp_count = 0;
+static size_t envp_capacity = 0;
+
+// Bumped whenever slots may have moved or a new key appeared, so slots
+// cached by expansion templates are known to be stale
+static unsigned long var_generation = 1;
+
+// FNV-1a over the key, never 0 so 0 can mark empty slots
+static unsigned long hash_key(const char *key, size_t len) {
+    unsigned long hash = 14695981039346656037UL;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)key[i];
+        hash *= 1099511628211UL;
+    }
+    return hash != 0 ? hash : 1;
+}
+
+static const char* slot_key(const var_slot_t *slot) {
+    return slot->key_len < VAR_INLINE_KEY ? slot->key.inline_key : slot->key.heap_key;
+}
+
+/*
+ * Return the slot holding KEY (len bytes), or the empty slot where it
+ * would go. The table must have at least one empty slot.
+ */
+static var_slot_t* find_slot(const variable_t *table, const char *key,
+                             size_t len, unsigned long hash) {
+    size_t mask = table->capacity - 1;
+    size_t i = hash & mask;
+    while (table->slots[i].hash != 0) {
+        var_slot_t *slot = &table->slots[i];
+        if (slot->hash == hash && slot->key_len == len &&
+            memcmp(slot_key(slot), key, len) == 0) {
+            return slot;
+        }
+        i = (i + 1) & mask;
+    }
+    return &table->slots[i];
+}
+
+/*
+ * Value of the key made of the first len bytes of KEY, or NULL.
+ */
+static const char* lookup(const char *key, size_t len) {
+    if (var_table == NULL || var_table->count == 0) {
+        return NULL;
+    }
+    var_slot_t *slot = find_slot(var_table, key, len, hash_key(key, len));
+    return slot->hash != 0 ? slot->value : NULL;
+}
+
+static variable_t* new_table(size_t capacity) {
+    variable_t *table = malloc(sizeof(variable_t));
+    if (table == NULL) {
+        return NULL;
+    }
+    table->slots = calloc(capacity, sizeof(var_slot_t));
+    if (table->slots == NULL) {
+        free(table);
+        return NULL;
+    }
+    table->capacity = capacity;
+    table->count = 0;
+    return table;
+}
+
+/*
+ * Double the table. Slots are moved as they are, keys and values
+ * included, using their cached hashes.
+ * Return 0 on success, or -1 if out of memory.
+ */
+static int grow_table(variable_t *table) {
+    size_t new_capacity = table->capacity * 2;
+    var_slot_t *new_slots = calloc(new_capacity, sizeof(var_slot_t));
+    if (new_slots == NULL) {
+        return -1;
+    }
+
+    size_t mask = new_capacity - 1;
+    for (size_t i = 0; i < table->capacity; i++) {
+        var_slot_t *slot = &table->slots[i];
+        if (slot->hash == 0) {
+            continue;
+        }
+        size_t j = slot->hash & mask;
+        while (new_slots[j].hash != 0) {
+            j = (j + 1) & mask;
+        }
+        new_slots[j] = *slot;
+    }
+
+    free(table->slots);
+    table->slots = new_slots;
+    table->capacity = new_capacity;
+    var_generation++;
+    return 0;
+}
+
+/*
+ * Free a table and everything it holds.
+ */
+static void free_table(variable_t *table) {
+    if (table == NULL) {
+        return;
+    }
+    
+    for (size_t i = 0; i < table->capacity; i++) {
+        var_slot_t *slot = &table->slots[i];
+        if (slot->hash == 0) {
+            continue;
+        }
+        if (slot->key_len >= VAR_INLINE_KEY) {
+            free(slot->key.heap_key);
+        }
+        free(slot->value);
+        free(slot->env_entry);
+    }
+    free(table->slots);
+    free(table);
+}
+
+/*
+ * Point the slot's entry in var_envp at its current value, adding the
+ * entry if the slot isn't exported yet.
+ * Return 0 on success, or -1 if out of memory.
+ */
+static int update_env_entry(var_slot_t *slot) {
+    char *entry = malloc(slot->key_len + slot->value_len + 2);
+    if (entry == NULL) {
+        return -1;
+    }
+    memcpy(entry, slot_key(slot), slot->key_len);
+    entry[slot->key_len] = '=';
+    memcpy(entry + slot->key_len + 1, slot->value, slot->value_len + 1);
+
+    if (slot->env_entry != NULL) {
+        // Already exported: replace the entry where it is
+        free(slot->env_entry);
+        slot->env_entry = entry;
+        var_envp[slot->env_index] = entry;
+        return 0;
+    }
+
+    if (envp_count + 1 >= envp_capacity) {
+        size_t new_capacity = envp_capacity ? envp_capacity * 2 : VAR_INITIAL_SLOTS;
+        char **new_envp = realloc(var_envp, new_capacity * sizeof(char *));
+        if (new_envp == NULL) {
+            free(entry);
+            return -1;
+        }
+        var_envp = new_envp;
+        envp_capacity = new_capacity;
+    }
+    slot->env_entry = entry;
+    slot->env_index = envp_count;
+    var_envp[envp_count++] = entry;
+    var_envp[envp_count] = NULL;
+    return 0;
+}
+
+/*
+ * Take the slot's entry out of var_envp. The last entry moves into the
+ * hole, so its slot is found by name to record the new position.
+ */
+static void remove_env_entry(var_slot_t *slot) {
+    size_t last = envp_count - 1;
+    if (slot->env_index != last) {
+        char *moved = var_envp[last];
+        size_t len = strchr(moved, '=') - moved;
+        var_slot_t *moved_slot = find_slot(var_table, moved, len, hash_key(moved, len));
+        moved_slot->env_index = slot->env_index;
+        var_envp[slot->env_index] = moved;
+    }
+    var_envp[last] = NULL;
+    envp_count--;
+
+    free(slot->env_entry);
+    slot->env_entry = NULL;
+}
 
 /*
  * Set or overwrite a variable KEY to VALUE.
@@ -33,47 +234,53 @@ int set_variable(const char *key, const char *value) {
         }
     }
 
-    // Look for existing variable to update
-    variable_t *current = var_list;
-    while (current != NULL) {
-        if (strcmp(current->key, key) == 0) {
-            // Found existing key, update value
-            char *new_value = strdup(value);
-            if (new_value == NULL) {
-                return -1;  // Memory allocation error
-            }
-            
-            // Free old value and update
-            free(current->value);
-            current->value = new_value;
-            return 0;
+    if (var_table == NULL) {
+        var_table = new_table(VAR_INITIAL_SLOTS);
+        if (var_table == NULL) {
+            return -1;  // Memory allocation error
         }
-        current = current->next;
     }
 
-    // No existing key found, create new variable
-    variable_t *new_var = malloc(sizeof(variable_t));
-    if (new_var == NULL) {
+    char *new_value = strdup(value);
+    if (new_value == NULL) {
         return -1;  // Memory allocation error
     }
 
-    // Allocate and copy key and value
-    new_var->key = strdup(key);
-    if (new_var->key == NULL) {
-        free(new_var);
-        return -1;
+    size_t len = strlen(key);
+    unsigned long hash = hash_key(key, len);
+    var_slot_t *slot = find_slot(var_table, key, len, hash);
+    if (slot->hash != 0) {
+        // Found existing key, update value
+        free(slot->value);
+        slot->value = new_value;
+        slot->value_len = strlen(new_value);
+        return slot->env_entry != NULL ? update_env_entry(slot) : 0;
     }
 
-    new_var->value = strdup(value);
-    if (new_var->value == NULL) {
-        free(new_var->key);
-        free(new_var);
-        return -1;
+    // New key: keep the table at most half full so probes stay short
+    if ((var_table->count + 1) * 2 > var_table->capacity) {
+        if (grow_table(var_table) == -1) {
+            free(new_value);
+            return -1;
+        }
+        slot = find_slot(var_table, key, len, hash);
     }
 
-    // Add to beginning of linked list
-    new_var->next = var_list;
-    var_list = new_var;
+    if (len < VAR_INLINE_KEY) {
+        memcpy(slot->key.inline_key, key, len + 1);
+    } else {
+        slot->key.heap_key = strdup(key);
+        if (slot->key.heap_key == NULL) {
+            free(new_value);
+            return -1;
+        }
+    }
+    slot->hash = hash;
+    slot->key_len = len;
+    slot->value = new_value;
+    slot->value_len = strlen(new_value);
+    var_table->count++;
+    var_generation++;
 
     return 0;
 }
@@ -86,224 +293,366 @@ const char* get_variable(const char *key) {
     if (key == NULL) {
         return NULL;
     }
+    return lookup(key, strlen(key));
+}
 
-    // Search for the key in our variable list
-    variable_t *current = var_list;
-    while (current != NULL) {
-        if (strcmp(current->key, key) == 0) {
-            return current->value;
+/*
+ * Mark KEY as exported (an undefined KEY is set to "").
+ * Return 0 on success, or -1 on error.
+ */
+int export_variable(const char *key) {
+    if (key == NULL) {
+        return -1;
+    }
+    if (get_variable(key) == NULL && set_variable(key, "") == -1) {
+        return -1;
+    }
+
+    size_t len = strlen(key);
+    var_slot_t *slot = find_slot(var_table, key, len, hash_key(key, len));
+    return slot->env_entry != NULL ? 0 : update_env_entry(slot);
+}
+
+/*
+ * Remove KEY from the variables and the environment.
+ * Return 0 whether or not KEY was defined.
+ */
+int unset_variable(const char *key) {
+    if (key == NULL || var_table == NULL || var_table->count == 0) {
+        return 0;
+    }
+    size_t len = strlen(key);
+    var_slot_t *slot = find_slot(var_table, key, len, hash_key(key, len));
+    if (slot->hash == 0) {
+        return 0;
+    }
+
+    if (slot->env_entry != NULL) {
+        remove_env_entry(slot);
+    }
+    if (slot->key_len >= VAR_INLINE_KEY) {
+        free(slot->key.heap_key);
+    }
+    free(slot->value);
+
+    // Shift later slots of the probe run back so no lookup stops early
+    size_t mask = var_table->capacity - 1;
+    size_t hole = slot - var_table->slots;
+    size_t i = hole;
+    while (1) {
+        i = (i + 1) & mask;
+        var_slot_t *next = &var_table->slots[i];
+        if (next->hash == 0) {
+            break;
+        }
+        size_t home = next->hash & mask;
+        // next may fill the hole unless its home lies in (hole, i]
+        int stays = hole <= i ? (hole < home && home <= i) : (hole < home || home <= i);
+        if (!stays) {
+            var_table->slots[hole] = *next;
+            hole = i;
         }
-        current = current->next;
     }
+    memset(&var_table->slots[hole], 0, sizeof(var_slot_t));
+    var_table->count--;
+    var_generation++;
+    return 0;
+}
 
-    // Key not found
-    return NULL;
+/*
+ * Return the NULL terminated "KEY=VALUE" array of exported variables,
+ * ready to pass to execve. It stays valid until the next set or unset.
+ */
+char** variable_envp(void) {
+    static char *empty_envp[] = {NULL};
+    return var_envp != NULL ? var_envp : empty_envp;
 }
 
 /*
- * Expand variables in a string.
- * Returns a newly allocated string with variables expanded.
- * The caller must free the returned string when done.
+ * Import ENVP (e.g. environ) as exported variables.
  */
-char* expand_variables(const char *str) {
+void import_environment(char **envp) {
+    for (size_t i = 0; envp != NULL && envp[i] != NULL; i++) {
+        const char *equals = strchr(envp[i], '=');
+        if (equals == NULL || equals == envp[i]) {
+            continue;
+        }
+        char *key = strndup(envp[i], equals - envp[i]);
+        if (key == NULL) {
+            return;
+        }
+        if (set_variable(key, equals + 1) == 0) {
+            export_variable(key);
+        }
+        free(key);
+    }
+}
 
-    if (str == NULL) {
-        return NULL;
+// Function to check if a string is a variable assignment (contains '=' but not as first char)
+int is_variable_assignment(const char *str) {
+    if (str == NULL || str[0] == '\0' || str[0] == '=') {
+        return 0;
     }
-    
-    // If no variable references, just return a copy
-    if (strchr(str, '$') == NULL) {
-        return strdup(str);
+
+    char *equals = strchr(str, '=');
+    return equals != NULL && equals != str;
+}
+
+// Handle the export command: export [NAME[=VALUE]]...
+ssize_t cmd_export(char **tokens) {
+    if (tokens[1] == NULL) {
+        // List the environment children get
+        for (size_t i = 0; i < envp_count; i++) {
+            display_message(var_envp[i]);
+            display_message("\n");
+        }
+        return 0;
     }
-    
-    // Buffer for the result
-    char *result = malloc(MAX_STR_LEN + 1);
-    if (result == NULL) {
-        return NULL;
+
+    ssize_t result = 0;
+    for (int i = 1; tokens[i] != NULL; i++) {
+        char *key = tokens[i];
+        const char *value = NULL;
+        if (is_variable_assignment(tokens[i])) {
+            // NAME=VALUE sets the variable before exporting it
+            const char *equals = strchr(tokens[i], '=');
+            key = arena_strndup(&line_arena, tokens[i], equals - tokens[i]);
+            value = equals + 1;
+        }
+        if (key == NULL || (value != NULL && set_variable(key, value) == -1) ||
+            export_variable(key) == -1) {
+            display_error("ERROR: Cannot export ", tokens[i]);
+            result = -1;
+        }
     }
-    result[0] = '\0';
-    
-    size_t result_len = 0;
+    return result;
+}
+
+// Handle the unset command: unset NAME...
+ssize_t cmd_unset(char **tokens) {
+    for (int i = 1; tokens[i] != NULL; i++) {
+        unset_variable(tokens[i]);
+    }
+    return 0;
+}
+
+// One piece of a compiled expansion: literal text or a variable name
+typedef struct expand_segment {
+    const char *text;            // Points into the template's copy of the source
+    size_t len;
+    unsigned long hash;          // Hash of the variable name, 0 for literals
+    var_slot_t *slot;            // Slot found for the name, or NULL if undefined
+    unsigned long generation;    // var_generation the slot was found in
+} expand_segment_t;
+
+struct expand_template {
+    size_t count;
+    expand_segment_t segments[];  // Followed by the copy of the source
+};
+
+/*
+ * Split str into literal and variable segments. A name runs from '$' to
+ * the next whitespace or '$'; a '$' with no name is literal text.
+ * When segments is NULL only counts them.
+ * Returns the number of segments.
+ */
+static size_t split_segments(const char *str, expand_segment_t *segments) {
+    size_t count = 0;
     size_t i = 0;
-    
-    while (str[i] != '\0' && result_len < MAX_STR_LEN) {
-        if (str[i] == '$') {
-            // Found a variable reference
-            i++;  // Skip the '$'
-            
-            // Extract variable name
-            char var_name[MAX_STR_LEN] = {0};
-            size_t var_name_len = 0;
-            
-            while (str[i] != '\0' && str[i] != ' ' && str[i] != '\t' && 
-                   str[i] != '\n' && str[i] != '$' && var_name_len < MAX_STR_LEN - 1) {
-                var_name[var_name_len++] = str[i++];
-            }
-            var_name[var_name_len] = '\0';
-            
-            if (var_name_len > 0) {
-                // Look up variable value
-                const char *value = get_variable(var_name);
-                
-                // Append value (or empty string if not found)
-                if (value != NULL) {
-                    size_t value_len = strlen(value);
-                    
-                    // Make sure we don't exceed MAX_STR_LEN
-                    if (result_len + value_len > MAX_STR_LEN) {
-                        value_len = MAX_STR_LEN - result_len;
-                    }
-                    
-                    strncpy(result + result_len, value, value_len);
-                    result_len += value_len;
-                    result[result_len] = '\0';
-                }
-                // Empty string for undefined variables - do nothing here
-            } else {
-                // Just a lone $
-                if (result_len < MAX_STR_LEN) {
-                    result[result_len++] = '$';
-                    result[result_len] = '\0';
-                }
+
+    while (str[i] != '\0') {
+        size_t start = i;
+        unsigned long hash = 0;
+
+        if (str[i] == '$' && strchr(" \t\n$", str[i + 1]) == NULL) {
+            // Variable reference: the name follows the '$'
+            start = ++i;
+            while (str[i] != '\0' && str[i] != ' ' && str[i] != '\t' &&
+                   str[i] != '\n' && str[i] != '$') {
+                i++;
             }
+            hash = hash_key(str + start, i - start);
         } else {
-            // Regular character
-            if (result_len < MAX_STR_LEN) {
-                result[result_len++] = str[i++];
-                result[result_len] = '\0';
-            } else {
-                break;
+            // Literal text up to the next reference (a lone '$' included)
+            i++;
+            while (str[i] != '\0' &&
+                   (str[i] != '$' || strchr(" \t\n$", str[i + 1]) != NULL)) {
+                i++;
             }
         }
+
+        if (segments != NULL) {
+            segments[count].text = str + start;
+            segments[count].len = i - start;
+            segments[count].hash = hash;
+            segments[count].slot = NULL;
+            segments[count].generation = 0;
+        }
+        count++;
     }
+    return count;
+}
 
-    
-    return result;
+/*
+ * Bytes needed for the template of str (sized by split_segments).
+ */
+static size_t template_size(const char *str, size_t *count) {
+    *count = split_segments(str, NULL);
+    return sizeof(expand_template_t) + *count * sizeof(expand_segment_t) + strlen(str) + 1;
 }
 
 /*
- * Create a copy of the variable environment for a child process.
- * This is useful when forking for pipes, where variables in one process
- * shouldn't affect the other.
- * Returns a new variable list or NULL on error.
+ * Build the template for str in memory of template_size bytes.
  */
-variable_t* duplicate_variables(void) {
-    variable_t *new_list = NULL;
-    variable_t *current = var_list;
-    
-    while (current != NULL) {
-        // Create a new variable
-        variable_t *new_var = malloc(sizeof(variable_t));
-        if (new_var == NULL) {
-            // Clean up on error
-            variable_t *temp;
-            while (new_list != NULL) {
-                temp = new_list;
-                new_list = new_list->next;
-                free(temp->key);
-                free(temp->value);
-                free(temp);
-            }
-            return NULL;
+static expand_template_t* fill_template(void *mem, const char *str, size_t count) {
+    expand_template_t *tmpl = mem;
+    char *source = (char *)&tmpl->segments[count];
+    strcpy(source, str);
+    tmpl->count = split_segments(source, tmpl->segments);
+    return tmpl;
+}
+
+/*
+ * Value of a variable segment. The slot is looked up again only when
+ * the table has changed shape since it was last found.
+ */
+static var_slot_t* resolve_segment(expand_segment_t *seg) {
+    if (seg->generation != var_generation) {
+        seg->slot = NULL;
+        if (var_table != NULL && var_table->count > 0) {
+            var_slot_t *slot = find_slot(var_table, seg->text, seg->len, seg->hash);
+            seg->slot = slot->hash != 0 ? slot : NULL;
         }
-        
-        // Copy key and value
-        new_var->key = strdup(current->key);
-        if (new_var->key == NULL) {
-            free(new_var);
-            // Clean up on error
-            variable_t *temp;
-            while (new_list != NULL) {
-                temp = new_list;
-                new_list = new_list->next;
-                free(temp->key);
-                free(temp->value);
-                free(temp);
-            }
-            return NULL;
+        seg->generation = var_generation;
+    }
+    return seg->slot;
+}
+
+/*
+ * Resolve every variable of tmpl.
+ * Returns the length of the expansion.
+ */
+static size_t expanded_length(expand_template_t *tmpl) {
+    size_t len = 0;
+    for (size_t i = 0; i < tmpl->count; i++) {
+        expand_segment_t *seg = &tmpl->segments[i];
+        if (seg->hash == 0) {
+            len += seg->len;
+        } else if (resolve_segment(seg) != NULL) {
+            len += seg->slot->value_len;
         }
-        
-        new_var->value = strdup(current->value);
-        if (new_var->value == NULL) {
-            free(new_var->key);
-            free(new_var);
-            // Clean up on error
-            variable_t *temp;
-            while (new_list != NULL) {
-                temp = new_list;
-                new_list = new_list->next;
-                free(temp->key);
-                free(temp->value);
-                free(temp);
-            }
-            return NULL;
+    }
+    return len;
+}
+
+/*
+ * Write the expansion of tmpl (resolved by expanded_length) to result.
+ */
+static void render_template(const expand_template_t *tmpl, char *result) {
+    size_t pos = 0;
+    for (size_t i = 0; i < tmpl->count; i++) {
+        const expand_segment_t *seg = &tmpl->segments[i];
+        if (seg->hash == 0) {
+            memcpy(result + pos, seg->text, seg->len);
+            pos += seg->len;
+        } else if (seg->slot != NULL) {
+            memcpy(result + pos, seg->slot->value, seg->slot->value_len);
+            pos += seg->slot->value_len;
         }
-        
-        // Add to new list
-        new_var->next = new_list;
-        new_list = new_var;
-        
-        current = current->next;
+        // Undefined variables expand to nothing
     }
-    
-    return new_list;
+    result[pos] = '\0';
 }
 
 /*
- * Set the variable list to a new list (for use in child processes)
+ * Compile STR for repeated expansion.
+ * Returns a template to free with free_expansion, or NULL on error.
  */
-void set_variable_list(variable_t *new_list) {
-    // Free the old list
-    free_variables();
-    
-    // Set the new list
-    var_list = new_list;
+expand_template_t* compile_expansion(const char *str) {
+    if (str == NULL) {
+        return NULL;
+    }
+    size_t count;
+    void *mem = malloc(template_size(str, &count));
+    if (mem == NULL) {
+        return NULL;
+    }
+    return fill_template(mem, str, count);
+}
+
+void free_expansion(expand_template_t *tmpl) {
+    free(tmpl);
 }
 
 /*
- * Free all memory used by the variables system.
+ * Expand TMPL into ARENA with the current values of its variables.
  */
-void free_variables(void) {
-    variable_t *current = var_list;
-    variable_t *next;
-    
-    while (current != NULL) {
-        next = current->next;
-        
-        // Ensure key and value are properly freed
-        if (current->key != NULL) {
-            free(current->key);
-            current->key = NULL;
-        }
-        
-        if (current->value != NULL) {
-            free(current->value);
-            current->value = NULL;
-        }
-        
-        free(current);
-        current = next;
+char* expand_template_in(arena_t *arena, expand_template_t *tmpl) {
+    char *result = arena_alloc(arena, expanded_length(tmpl) + 1);
+    if (result != NULL) {
+        render_template(tmpl, result);
     }
-    
-    var_list = NULL;
+    return result;
 }
+
 /*
- * Free a specific variable list.
- * This is useful for freeing duplicated variable lists.
+ * Expand variables in a string.
+ * Returns a newly allocated string with variables expanded.
+ * The caller must free the returned string when done.
  */
-void free_variable_list(variable_t *var_list_to_free) {
-    if (var_list_to_free == NULL) {
-        return;
+char* expand_variables(const char *str) {
+
+    if (str == NULL) {
+        return NULL;
     }
     
-    variable_t *current = var_list_to_free;
-    variable_t *next;
+    // If no variable references, just return a copy
+    if (strchr(str, '$') == NULL) {
+        return strdup(str);
+    }
     
-    while (current != NULL) {
-        next = current->next;
-        free(current->key);
-        free(current->value);
-        free(current);
-        current = next;
-    }
-}
\ No newline at end of file
+    expand_template_t *tmpl = compile_expansion(str);
+    if (tmpl == NULL) {
+        return NULL;
+    }
+    char *result = malloc(expanded_length(tmpl) + 1);
+    if (result != NULL) {
+        render_template(tmpl, result);
+    }
+    free_expansion(tmpl);
+    return result;
+}
+
+/*
+ * Expand variables in a string into ARENA. The template is built in the
+ * arena as well, so nothing is malloc'd.
+ */
+char* expand_variables_in(arena_t *arena, const char *str) {
+    if (str == NULL) {
+        return NULL;
+    }
+
+    if (strchr(str, '$') == NULL) {
+        return arena_strdup(arena, str);
+    }
+
+    size_t count;
+    void *mem = arena_alloc(arena, template_size(str, &count));
+    if (mem == NULL) {
+        return NULL;
+    }
+    return expand_template_in(arena, fill_template(mem, str, count));
+}
+
+/*
+ * Free all memory used by the variables system.
+ */
+void free_variables(void) {
+    free_table(var_table);
+    var_table = NULL;
+    var_generation++;
+
+    free(var_envp);
+    var_envp = NULL;
+    envp_count = envp_capacity = 0;
+}
@@ -1,7 +1,11 @@
 #ifndef __VARIABLES_H__
 #define __VARIABLES_H__
 
-// Forward declaration for the variable structure
+#include <unistd.h>
+
+#include "arena.h"
+
+// Forward declaration for a variable environment (hash table)
 typedef struct variable variable_t;
 
 /*
@@ -17,15 +21,29 @@ int set_variable(const char *key, const char *value);
 const char* get_variable(const char *key);
 
 /*
- * Create a copy of the variable environment for a child process.
- * Returns a new variable list or NULL on error.
+ * Export KEY to the environment of commands the shell runs, or remove it
+ * from both the variables and the environment.
+ * Return 0 on success, or -1 on error (e.g. out of memory).
+ */
+int export_variable(const char *key);
+int unset_variable(const char *key);
+
+/*
+ * Return the NULL terminated "KEY=VALUE" array of exported variables for
+ * execve. It is updated in place by set, export and unset, so it is
+ * never rebuilt per command. Valid until the next change.
  */
-variable_t* duplicate_variables(void);
+char** variable_envp(void);
 
 /*
- * Set the variable list to a new list (for use in child processes)
+ * Import a "KEY=VALUE" array (the shell's own environ) as exported
+ * variables.
  */
-void set_variable_list(variable_t *new_list);
+void import_environment(char **envp);
+
+// Shell commands: export [NAME[=VALUE]]... and unset NAME...
+ssize_t cmd_export(char **tokens);
+ssize_t cmd_unset(char **tokens);
 
 /*
  * Free all memory used by the variables system.
@@ -35,10 +53,30 @@ void free_variables(void);
 char* expand_variables(const char *str);
 
 /*
- * Free a specific variable list.
- * This is useful for freeing duplicated variable lists.
+ * Same as expand_variables, but the result is allocated from ARENA and
+ * must not be freed.
+ */
+char* expand_variables_in(arena_t *arena, const char *str);
+
+/*
+ * A string split once into literal text and variable references, for
+ * strings that are expanded again and again (e.g. cached command lines).
+ * Expanding it is one sized copy with no rescanning of the string.
+ */
+typedef struct expand_template expand_template_t;
+
+/*
+ * Compile STR. Returns a template to free with free_expansion, or NULL
+ * if out of memory.
+ */
+expand_template_t* compile_expansion(const char *str);
+void free_expansion(expand_template_t *tmpl);
+
+/*
+ * Expand TMPL into ARENA with the current values of its variables.
+ * Returns NULL if out of memory.
  */
-void free_variable_list(variable_t *var_list_to_free);
+char* expand_template_in(arena_t *arena, expand_template_t *tmpl);
 
 // Function to check if a string is a variable assignment
 int is_variable_assignment(const char *str);
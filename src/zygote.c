@@ -0,0 +1,278 @@
+#define _GNU_SOURCE // CLONE_PARENT
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include "zygote.h"
+#include "builtins.h"
+#include "io_helpers.h"
+#include "variables.h"
+#include "events.h"
+
+#define DEBUG_MODE 0 // Set to 1 to enable debug logs
+
+// Descriptors sent with each job: stdin, stdout, stderr, working directory
+#define ZYGOTE_JOB_FDS 4
+
+extern char **environ;
+
+void zygote_debug_log(const char *format, ...)
+{
+    if (!DEBUG_MODE)
+        return;
+
+    va_list args;
+    va_start(args, format);
+
+    fprintf(stderr, "[ZYGOTE_DEBUG] ");
+    vfprintf(stderr, format, args);
+    fprintf(stderr, "\n");
+
+    va_end(args);
+}
+
+static int zygote_fd = -1;       // Shell's end of the socketpair
+static int zygote_broken = 0;    // It failed once; fork from then on
+
+static char message[ZYGOTE_MSG_MAX];
+static char *message_argv[ZYGOTE_MSG_MAX / 2 + 1];   // Helper: words of message
+
+/* Start the helper: this executable again, with its end of a fresh
+ * socketpair as ZYGOTE_FD.
+ * Return: 0 on success, -1 on failure
+ */
+static int start_zygote(void)
+{
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1)
+        return -1;
+
+    // dup2 onto itself would leave close-on-exec set
+    if (sv[1] == ZYGOTE_FD)
+    {
+        int moved = fcntl(sv[1], F_DUPFD_CLOEXEC, ZYGOTE_FD + 1);
+        close(sv[1]);
+        sv[1] = moved;
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawnattr_init(&attr);
+    int err = sv[1] == -1 ? EBADF : 0;
+    err = err ? err : posix_spawn_file_actions_adddup2(&actions, sv[1], ZYGOTE_FD);
+    // Only its jobs get the shell's streams: a reader of the shell's
+    // output must still see EOF when the shell exits
+    err = err ? err : posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null",
+                                                       O_RDONLY, 0);
+    err = err ? err : posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null",
+                                                       O_WRONLY, 0);
+    err = err ? err : posix_spawn_file_actions_adddup2(&actions, STDOUT_FILENO, STDERR_FILENO);
+    err = err ? err : posix_spawnattr_setsigmask(&attr, child_signal_mask());
+    err = err ? err : posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+
+    pid_t pid;
+    char *args[] = {"mysh", ZYGOTE_ARG, NULL};
+    if (err == 0)
+        err = posix_spawn(&pid, "/proc/self/exe", &actions, &attr, args, environ);
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    if (sv[1] != -1)
+        close(sv[1]);
+
+    if (err != 0)
+    {
+        zygote_debug_log("Could not start the helper: %s", strerror(err));
+        close(sv[0]);
+        return -1;
+    }
+    zygote_debug_log("Helper started as %d", pid);
+    zygote_fd = sv[0];
+    return 0;
+}
+
+// Give up on the helper after it failed to answer
+static void drop_zygote(void)
+{
+    free_zygote();
+    zygote_broken = 1;
+}
+
+pid_t zygote_spawn(char **argv)
+{
+    const builtin_entry_t *entry = find_builtin(argv[0]);
+    if (entry == NULL || !(entry->flags & BN_THREAD) || zygote_broken)
+        return -1;
+    const char *enabled = get_variable(ZYGOTE_VAR);
+    if (enabled != NULL && strcmp(enabled, "0") == 0)
+        return -1;
+
+    // The words, one after the other with their terminators
+    size_t len = 0;
+    for (int i = 0; argv[i] != NULL; i++)
+    {
+        size_t word = strlen(argv[i]) + 1;
+        if (word > ZYGOTE_MSG_MAX - len)
+            return -1;
+        memcpy(message + len, argv[i], word);
+        len += word;
+    }
+
+    if (zygote_fd == -1 && start_zygote() == -1)
+    {
+        zygote_broken = 1;
+        return -1;
+    }
+
+    int cwd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (cwd == -1)
+        return -1;
+
+    int fds[ZYGOTE_JOB_FDS] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO, cwd};
+    union {
+        char buf[CMSG_SPACE(sizeof(fds))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct iovec iov = {.iov_base = message, .iov_len = len};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1,
+                         .msg_control = control.buf, .msg_controllen = sizeof(control.buf)};
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    pid_t pid = -1;
+    ssize_t sent, got = -1;
+    do
+    {
+        sent = sendmsg(zygote_fd, &msg, MSG_NOSIGNAL);
+    } while (sent == -1 && errno == EINTR);
+    if (sent == (ssize_t)len)
+    {
+        do
+        {
+            got = recv(zygote_fd, &pid, sizeof(pid), 0);
+        } while (got == -1 && errno == EINTR);
+    }
+    close(cwd);
+
+    if (got != sizeof(pid))
+    {
+        zygote_debug_log("Helper stopped answering");
+        drop_zygote();
+        return -1;
+    }
+    zygote_debug_log("Helper started %s as %d", argv[0], pid);
+    return pid;
+}
+
+void free_zygote(void)
+{
+    if (zygote_fd != -1)
+        close(zygote_fd);
+    zygote_fd = -1;
+}
+
+/* Start one job in a process of its own whose parent is the shell:
+ * clone with CLONE_PARENT is a fork of this small process, and the shell
+ * gets SIGCHLD and reaps the job like one it forked.
+ * Return: pid of the job, or -1
+ */
+static pid_t start_job(int fd, char **argv, const int *fds)
+{
+    pid_t pid = syscall(SYS_clone, CLONE_PARENT | SIGCHLD, NULL, NULL, NULL, NULL);
+    if (pid != 0)
+        return pid;
+
+    // The job: it takes the shell's streams and directory
+    close(fd);
+    for (int i = 0; i < 3; i++)
+    {
+        if (dup2(fds[i], i) == -1)
+            _exit(EXIT_FAILURE);
+    }
+    if (fchdir(fds[3]) == -1)
+        _exit(EXIT_FAILURE);
+    signal(SIGINT, SIG_DFL);
+
+    const builtin_entry_t *entry = find_builtin(argv[0]);
+    ssize_t result = entry != NULL && entry->fn != NULL ? entry->fn(argv) : -1;
+    flush_output();
+    _exit(result == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+int zygote_main(int fd)
+{
+    // Ctrl+C is meant for the shell's jobs, not for the helper
+    signal(SIGINT, SIG_IGN);
+
+    // The helper outlives whatever the shell held open without
+    // close-on-exec when it started it (a server's listening socket
+    // would stay bound): keep only stdio and the control socket
+    if (close_range(fd + 1, ~0U, 0) == -1)
+    {
+        long max_fd = sysconf(_SC_OPEN_MAX);
+        for (long i = fd + 1; i < max_fd; i++)
+        {
+            close(i);
+        }
+    }
+
+    char **argv = message_argv;
+    for (;;)
+    {
+        union {
+            char buf[CMSG_SPACE(ZYGOTE_JOB_FDS * sizeof(int))];
+            struct cmsghdr align;
+        } control;
+        struct iovec iov = {.iov_base = message, .iov_len = sizeof(message)};
+        struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1,
+                             .msg_control = control.buf, .msg_controllen = sizeof(control.buf)};
+        ssize_t len = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+        if (len == -1 && errno == EINTR)
+            continue;
+        if (len <= 0)
+            return 0;   // The shell is gone
+
+        int fds[ZYGOTE_JOB_FDS];
+        int fd_count = 0;
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        {
+            fd_count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg), fd_count * sizeof(int));
+        }
+
+        pid_t pid = -1;
+        if (fd_count == ZYGOTE_JOB_FDS && !(msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) &&
+            message[len - 1] == '\0')
+        {
+            int argc = 0;
+            for (ssize_t i = 0; i < len; i += strlen(message + i) + 1)
+            {
+                argv[argc++] = message + i;
+            }
+            argv[argc] = NULL;
+            pid = start_job(fd, argv, fds);
+        }
+        for (int i = 0; i < fd_count; i++)
+        {
+            close(fds[i]);
+        }
+
+        if (send(fd, &pid, sizeof(pid), MSG_NOSIGNAL) != sizeof(pid))
+            return 1;
+    }
+}
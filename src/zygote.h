@@ -0,0 +1,33 @@
+#ifndef __ZYGOTE_H__
+#define __ZYGOTE_H__
+
+#include <sys/types.h>
+
+
+#define ZYGOTE_ARG "--zygote"   // argv[1] that makes mysh the helper
+#define ZYGOTE_FD 3             // The helper's end of the socketpair
+#define ZYGOTE_MSG_MAX 65536    // Longest command line sent to the helper
+#define ZYGOTE_VAR "ZYGOTE"     // ZYGOTE=0 forks the shell as before
+
+
+/* Background builtins are started by a small helper process instead of
+ * a fork of the shell. The helper is mysh exec'ed afresh (so it holds
+ * none of the shell's state) when the first such job starts. Each job is
+ * sent as its argv plus the shell's stdin, stdout, stderr and working
+ * directory over a socketpair; the helper clones itself with the shell
+ * as the parent, so the job is reaped and tracked like any child.
+ * Only builtins that just touch their streams (BN_THREAD) go this way.
+ * Return: pid of the job, or -1 if the caller has to fork it itself
+ */
+pid_t zygote_spawn(char **argv);
+
+/* Stop the helper (it exits once its socket is closed).
+ */
+void free_zygote(void);
+
+/* Body of the helper process: serve requests on fd until it is closed.
+ * Return: exit status of the helper
+ */
+int zygote_main(int fd);
+
+#endif
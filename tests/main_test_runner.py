@@ -20,7 +20,7 @@ import tests_variables
 # Milestone 3 tests
 import tests_cat, tests_wc, tests_ls_cd
 # Milestone 4 tests
-import tests_builtins_pipes, tests_bash, tests_bg, tests_signals
+import tests_builtins_pipes, tests_bash, tests_bg, tests_signals, tests_parallel
 # Milestone 5 tests 
 import tests_short_client, tests_long_client
 
@@ -55,6 +55,7 @@ def run_milestone4_tests(comment_file_path, student_dir):
   tests_builtins_pipes.test_builtin_pipes_suite(comment_file_path, student_dir)
   tests_bash.test_bash_suite(comment_file_path, student_dir)
   tests_bg.test_bg_suite(comment_file_path, student_dir)
+  tests_parallel.test_parallel_suite(comment_file_path, student_dir)
   tests_signals.test_signals_suite(comment_file_path, student_dir)
 
 def run_milestone5_tests(comment_file_path, student_dir):
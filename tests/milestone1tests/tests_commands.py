@@ -50,13 +50,13 @@ def _test_short_line(comment_file_path, student_dir, timeout=TESTS_TIMEOUT_M1):
     finish_process(comment_file_path, "NOT OK", p)
 
 def _test_long_line(comment_file_path, student_dir, timeout=TESTS_TIMEOUT_M1):
-  start_test(comment_file_path, "Long command input is invalid")
+  start_test(comment_file_path, "Long command input is accepted")
   try:
     p = Popen(['./mysh'], stdout=PIPE, stderr=PIPE, stdin=PIPE)
     s = "echo " + "o" * 135
-    stderr = p.communicate(input=s.encode(), timeout=timeout)[1]
+    stdout, stderr = p.communicate(input=s.encode(), timeout=timeout)
     decoded = stderr.decode()
-    if "ERROR: input line too long" in decoded and "Unrecognized command" not in decoded:
+    if "o" * 135 in stdout.decode() and "ERROR: " not in decoded:
       finish_process(comment_file_path, "OK", p)
     else:
       finish_process(comment_file_path, "NOT OK", p)
@@ -64,13 +64,13 @@ def _test_long_line(comment_file_path, student_dir, timeout=TESTS_TIMEOUT_M1):
     finish_process(comment_file_path, "NOT OK", p)
 
 def _test_long_priority(comment_file_path, student_dir, timeout=TESTS_TIMEOUT_M1):
-  start_test(comment_file_path, "Long command message takes priority")
+  start_test(comment_file_path, "Long unknown command is reported as unknown")
   try:
     p = Popen(['./mysh'], stdout=PIPE, stderr=PIPE, stdin=PIPE)
     s = "a" * 140
     stderr = p.communicate(input=s.encode(), timeout=timeout)[1]
     decoded = stderr.decode()
-    if "ERROR: input line too long" in decoded and "Unrecognized command" not in decoded:
+    if "ERROR: Unknown command: " in decoded and "input line too long" not in decoded:
       finish_process(comment_file_path, "OK", p)
     else:
       finish_process(comment_file_path, "NOT OK", p)
@@ -78,6 +78,196 @@ def _test_long_priority(comment_file_path, student_dir, timeout=TESTS_TIMEOUT_M1
     finish_process(comment_file_path, "NOT OK", p)
 
 
+def _test_whitespace_runs(comment_file_path, student_dir, timeout=TESTS_TIMEOUT_M1):
+  start_test(comment_file_path, "Runs of spaces and tabs separate words like a single space")
+  try:
+    p = Popen(['./mysh', '-c', '   echo   a \t\t b\t   c   '], stdout=PIPE, stderr=PIPE)
+    stdout, stderr = p.communicate(timeout=timeout)
+    if stdout == b"a b c\n" and not stderr:
+      finish_process(comment_file_path, "OK", p)
+    else:
+      finish_process(comment_file_path, "NOT OK", p)
+  except Exception:
+    finish_process(comment_file_path, "NOT OK", p)
+
+def _test_adjacent_pipe(comment_file_path, student_dir, timeout=TESTS_TIMEOUT_M1):
+  start_test(comment_file_path, "A pipe needs no spaces around it; an escaped one is a character")
+  try:
+    p = Popen(['./mysh', '-c', 'echo a|wc\necho x\\|y'], stdout=PIPE, stderr=PIPE)
+    stdout, stderr = p.communicate(timeout=timeout)
+    expected = b"word count 1\ncharacter count 2\nnewline count 1\nx|y\n"
+    if stdout == expected and not stderr:
+      finish_process(comment_file_path, "OK", p)
+    else:
+      finish_process(comment_file_path, "NOT OK", p)
+  except Exception:
+    finish_process(comment_file_path, "NOT OK", p)
+
+def _test_adjacent_background(comment_file_path, student_dir, timeout=TESTS_TIMEOUT_M1):
+  start_test(comment_file_path, "A trailing & needs no space; an & inside a word is a character")
+  try:
+    p = Popen(['./mysh', '-c', 'echo a&b\necho bg&'], stdout=PIPE, stderr=PIPE)
+    stdout, stderr = p.communicate(timeout=timeout)
+    # The job's output and the [1] line may come in either order
+    lines = stdout.decode().split("\n")
+    started = any(line.startswith("[1] ") for line in lines)
+    if lines[0] == "a&b" and started and "bg" in lines and not stderr:
+      finish_process(comment_file_path, "OK", p)
+    else:
+      finish_process(comment_file_path, "NOT OK", p)
+  except Exception:
+    finish_process(comment_file_path, "NOT OK", p)
+
+def _test_hash_lists(comment_file_path, student_dir, timeout=TESTS_TIMEOUT_M1):
+  start_test(comment_file_path, "hash lists the path a command was resolved to")
+  try:
+    p = Popen(['./mysh', '-c', 'sleep 0\nhash'], stdout=PIPE, stderr=PIPE)
+    stdout, stderr = p.communicate(timeout=timeout)
+    lines = stdout.decode().split()
+    if any(line.endswith("/sleep") for line in lines) and not stderr:
+      finish_process(comment_file_path, "OK", p)
+    else:
+      finish_process(comment_file_path, "NOT OK", p)
+  except Exception:
+    finish_process(comment_file_path, "NOT OK", p)
+
+def _test_hash_clear(comment_file_path, student_dir, timeout=TESTS_TIMEOUT_M1):
+  start_test(comment_file_path, "hash -r forgets resolved commands")
+  try:
+    p = Popen(['./mysh', '-c', 'sleep 0\nhash -r\nhash'], stdout=PIPE, stderr=PIPE)
+    stdout, stderr = p.communicate(timeout=timeout)
+    if stdout == b"" and not stderr:
+      finish_process(comment_file_path, "OK", p)
+    else:
+      finish_process(comment_file_path, "NOT OK", p)
+  except Exception:
+    finish_process(comment_file_path, "NOT OK", p)
+
+def _test_hash_new_command(comment_file_path, student_dir, command_wait=0.05):
+  start_test(comment_file_path, "A command created after it was unknown is found after hash -r")
+  bin_dir = os.path.join(student_dir, "mysh_hash_bin")
+  remove_folder(bin_dir)
+  os.mkdir(bin_dir)
+  try:
+    env = dict(os.environ, PATH=bin_dir + ":" + os.environ["PATH"])
+    p = Popen(['./mysh'], stdout=PIPE, stderr=PIPE, stdin=PIPE, env=env)
+    write(p, "mysh_hash_tool")
+    if "ERROR: Unknown command: mysh_hash_tool" not in read_stderr(p):
+      finish_process(comment_file_path, "NOT OK", p)
+      return
+
+    tool = os.path.join(bin_dir, "mysh_hash_tool")
+    with open(tool, "w") as f:
+      f.write("#!/bin/sh\necho found\n")
+    os.chmod(tool, 0o755)
+    write(p, "hash -r")
+    write(p, "mysh_hash_tool")
+    sleep(command_wait)
+    if "found" in read_stdout(p):
+      finish_process(comment_file_path, "OK", p)
+    else:
+      finish_process(comment_file_path, "NOT OK", p)
+  except Exception:
+    finish_process(comment_file_path, "NOT OK", p)
+  finally:
+    remove_folder(bin_dir)
+
+def _test_relative_path(comment_file_path, student_dir, timeout=TESTS_TIMEOUT_M1):
+  start_test(comment_file_path, "A command name with a '/' runs the file it names")
+  script = "mysh_relative_script.sh"
+  try:
+    with open(script, "w") as f:
+      f.write("#!/bin/sh\necho relative\n")
+    os.chmod(script, 0o755)
+    p = Popen(['./mysh', '-c', './' + script], stdout=PIPE, stderr=PIPE)
+    stdout, stderr = p.communicate(timeout=timeout)
+    if stdout == b"relative\n" and not stderr:
+      finish_process(comment_file_path, "OK", p)
+    else:
+      finish_process(comment_file_path, "NOT OK", p)
+  except Exception:
+    finish_process(comment_file_path, "NOT OK", p)
+  finally:
+    remove_file(script)
+
+def _test_plan_cache_hits(comment_file_path, student_dir, timeout=TESTS_TIMEOUT_M1):
+  start_test(comment_file_path, "A repeated line is a plan cache hit; cache-stats counts them")
+  try:
+    p = Popen(['./mysh', '-c', 'echo a\necho a\necho a\ncache-stats\ncache-stats'],
+              stdout=PIPE, stderr=PIPE)
+    stdout, stderr = p.communicate(timeout=timeout)
+    # The first cache-stats is itself a miss, the second a hit
+    expected = b"a\na\na\nplan cache: 2 hits, 2 misses, 2 entries\n" \
+               b"plan cache: 3 hits, 2 misses, 2 entries\n"
+    if stdout == expected and not stderr:
+      finish_process(comment_file_path, "OK", p)
+    else:
+      finish_process(comment_file_path, "NOT OK", p)
+  except Exception:
+    finish_process(comment_file_path, "NOT OK", p)
+
+def make_which_dirs(student_dir):
+  """Create two directories holding a mysh_which that prints one or two.
+  Return: their paths"""
+  dirs = []
+  for name in ["one", "two"]:
+    path = os.path.join(student_dir, "mysh_which_" + name)
+    remove_folder(path)
+    os.mkdir(path)
+    with open(os.path.join(path, "mysh_which"), "w") as f:
+      f.write("#!/bin/sh\necho {}\n".format(name))
+    os.chmod(os.path.join(path, "mysh_which"), 0o755)
+    dirs.append(path)
+  return dirs
+
+def _test_plan_cache_path(comment_file_path, student_dir, timeout=TESTS_TIMEOUT_M1):
+  start_test(comment_file_path, "A cached line runs the new command once PATH changes")
+  dirs = make_which_dirs(student_dir)
+  try:
+    commands = "PATH={}:/bin:/usr/bin\nmysh_which\nmysh_which\n" \
+               "PATH={}:/bin:/usr/bin\nmysh_which".format(dirs[0], dirs[1])
+    p = Popen(['./mysh', '-c', commands], stdout=PIPE, stderr=PIPE)
+    stdout, stderr = p.communicate(timeout=timeout)
+    if stdout == b"one\none\ntwo\n" and not stderr:
+      finish_process(comment_file_path, "OK", p)
+    else:
+      finish_process(comment_file_path, "NOT OK", p)
+  except Exception:
+    finish_process(comment_file_path, "NOT OK", p)
+  finally:
+    for path in dirs:
+      remove_folder(path)
+
+def _test_plan_cache_hash(comment_file_path, student_dir, command_wait=0.05):
+  start_test(comment_file_path, "A cached line runs the new command after hash -r")
+  dirs = make_which_dirs(student_dir)
+  try:
+    # Only the second directory has the command at first
+    os.remove(os.path.join(dirs[0], "mysh_which"))
+    env = dict(os.environ, PATH="{}:{}:{}".format(dirs[0], dirs[1], os.environ["PATH"]))
+    p = Popen(['./mysh'], stdout=PIPE, stderr=PIPE, stdin=PIPE, env=env)
+    write(p, "mysh_which")
+    sleep(command_wait)
+    first = read_stdout(p)
+
+    with open(os.path.join(dirs[0], "mysh_which"), "w") as f:
+      f.write("#!/bin/sh\necho one\n")
+    os.chmod(os.path.join(dirs[0], "mysh_which"), 0o755)
+    write(p, "hash -r")
+    write(p, "mysh_which")
+    sleep(command_wait)
+    second = read_stdout(p)
+    if first.endswith("two") and second.endswith("one"):
+      finish_process(comment_file_path, "OK", p)
+    else:
+      finish_process(comment_file_path, "NOT OK", p)
+  except Exception:
+    finish_process(comment_file_path, "NOT OK", p)
+  finally:
+    for path in dirs:
+      remove_folder(path)
+
+
 def test_commands_suite(comment_file_path, student_dir):
   start_suite(comment_file_path, "Unknown Command Message")
   start_with_timeout(_test_1unknown_command, comment_file_path)
@@ -90,3 +280,21 @@ def test_commands_suite(comment_file_path, student_dir):
   start_with_timeout(_test_long_priority, comment_file_path)
   end_suite(comment_file_path)
 
+  start_suite(comment_file_path, "Command Splitting")
+  start_with_timeout(_test_whitespace_runs, comment_file_path)
+  start_with_timeout(_test_adjacent_pipe, comment_file_path)
+  start_with_timeout(_test_adjacent_background, comment_file_path)
+  end_suite(comment_file_path)
+
+  start_suite(comment_file_path, "Command Lookup")
+  start_with_timeout(_test_hash_lists, comment_file_path)
+  start_with_timeout(_test_hash_clear, comment_file_path)
+  start_with_timeout(_test_hash_new_command, comment_file_path, student_dir)
+  start_with_timeout(_test_relative_path, comment_file_path)
+  end_suite(comment_file_path)
+
+  start_suite(comment_file_path, "Plan Cache")
+  start_with_timeout(_test_plan_cache_hits, comment_file_path)
+  start_with_timeout(_test_plan_cache_path, comment_file_path, student_dir)
+  start_with_timeout(_test_plan_cache_hash, comment_file_path, student_dir)
+  end_suite(comment_file_path)
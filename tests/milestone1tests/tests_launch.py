@@ -26,8 +26,79 @@ def _test_shell_message(comment_file_path, student_dir, timeout=TESTS_TIMEOUT_M1
     finish_process(comment_file_path, "NOT OK", p)
 
 
+def _test_command_string(comment_file_path, student_dir, timeout=TESTS_TIMEOUT_M1):
+  start_test(comment_file_path, "-c runs commands without a prompt and returns the last status")
+  try:
+    p = Popen(['./mysh', '-c', 'echo one\necho two\nnot_a_real_command'], stdout=PIPE, stderr=PIPE)
+    stdout, stderr = p.communicate(timeout=timeout)
+    if stdout == b"one\ntwo\n" and b"ERROR: Unknown command" in stderr and p.returncode == 127:
+      finish_process(comment_file_path, "OK", p)
+    else:
+      finish_process(comment_file_path, "NOT OK", p)
+  except Exception:
+    finish_process(comment_file_path, "NOT OK", p)
+
+
+def _test_script_file(comment_file_path, student_dir, timeout=TESTS_TIMEOUT_M1):
+  start_test(comment_file_path, "Script file runs without a prompt, exit N sets the status")
+  script = "mysh_launch_script.sh"
+  try:
+    with open(script, "w") as f:
+      f.write("x=script\necho $x | cat\nexit 3\necho unreachable\n")
+    p = Popen(['./mysh', script], stdout=PIPE, stderr=PIPE)
+    stdout, stderr = p.communicate(timeout=timeout)
+    if stdout == b"script\n" and not stderr and p.returncode == 3:
+      finish_process(comment_file_path, "OK", p)
+    else:
+      finish_process(comment_file_path, "NOT OK", p)
+  except Exception:
+    finish_process(comment_file_path, "NOT OK", p)
+  finally:
+    remove_file(script)
+
+TIME_FIELDS = ["real", "user", "sys", "maxrss", "parse", "expand", "resolve", "spawn", "wait"]
+
+def time_report_ok(stderr):
+  """Return: True if stderr is exactly one report of the `time` prefix"""
+  lines = stderr.decode().split("\n")[:-1]
+  if [line.split()[0] for line in lines if line.split()] != TIME_FIELDS:
+    return False
+  return all(len(line.split()) == 3 and line.split()[1].isdigit() for line in lines)
+
+
+def _test_time_prefix(comment_file_path, student_dir, timeout=TESTS_TIMEOUT_M1):
+  start_test(comment_file_path, "time reports wall/user/sys, max RSS and phases on stderr")
+  try:
+    p = Popen(['./mysh', '-c', 'time echo x'], stdout=PIPE, stderr=PIPE)
+    stdout, stderr = p.communicate(timeout=timeout)
+    if stdout == b"x\n" and time_report_ok(stderr) and p.returncode == 0:
+      finish_process(comment_file_path, "OK", p)
+    else:
+      finish_process(comment_file_path, "NOT OK", p)
+  except Exception:
+    finish_process(comment_file_path, "NOT OK", p)
+
+
+def _test_time_exit(comment_file_path, student_dir, timeout=TESTS_TIMEOUT_M1):
+  start_test(comment_file_path, "time exit N reports before the shell exits with N")
+  try:
+    p = Popen(['./mysh', '-c', 'time exit 3'], stdout=PIPE, stderr=PIPE)
+    stdout, stderr = p.communicate(timeout=timeout)
+    if stdout == b"" and time_report_ok(stderr) and p.returncode == 3:
+      finish_process(comment_file_path, "OK", p)
+    else:
+      finish_process(comment_file_path, "NOT OK", p)
+  except Exception:
+    finish_process(comment_file_path, "NOT OK", p)
+
+
 def test_launch_suite(comment_file_path, student_dir):
   start_suite(comment_file_path, "Launch Suite")
   start_with_timeout(_test_exit, comment_file_path)
   start_with_timeout(_test_shell_message, comment_file_path)
+  start_with_timeout(_test_command_string, comment_file_path)
+  start_with_timeout(_test_script_file, comment_file_path)
+  start_with_timeout(_test_time_prefix, comment_file_path)
+  start_with_timeout(_test_time_exit, comment_file_path)
   end_suite(comment_file_path)
+
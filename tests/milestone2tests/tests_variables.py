@@ -1,4 +1,4 @@
-from subprocess import CalledProcessError, STDOUT, check_output, TimeoutExpired, PIPE 
+from subprocess import CalledProcessError, STDOUT, check_output, TimeoutExpired, Popen, PIPE 
 import os
 import shutil
 import pty
@@ -299,6 +299,62 @@ def _test_variable_expansion_complex(comment_file_path, student_dir, command_wai
 
 
 
+def run_with_env(commands, env, timeout=TESTS_TIMEOUT_M2):
+  """Run commands with mysh -c in the environment env.
+  Return: (stdout lines, stderr)"""
+  p = Popen(['./mysh', '-c', commands], stdout=PIPE, stderr=PIPE, env=env)
+  stdout, stderr = p.communicate(timeout=timeout)
+  return stdout.decode().split("\n"), stderr
+
+def _test_export_env(comment_file_path, student_dir):
+  start_test(comment_file_path, "An exported variable is in the environment of commands")
+  try:
+    lines, stderr = run_with_env("export MYSH_EXPORTED=1\nenv", {"PATH": os.environ["PATH"]})
+    if "MYSH_EXPORTED=1" in lines and not stderr:
+      finish(comment_file_path, "OK")
+    else:
+      finish(comment_file_path, "NOT OK")
+  except Exception as e:
+    finish(comment_file_path, "NOT OK")
+
+def _test_export_list(comment_file_path, student_dir):
+  start_test(comment_file_path, "export without arguments lists exported variables")
+  try:
+    lines, stderr = run_with_env("MYSH_EXPORTED=2\nexport MYSH_EXPORTED\nexport",
+                                 {"PATH": os.environ["PATH"]})
+    if "MYSH_EXPORTED=2" in lines and not stderr:
+      finish(comment_file_path, "OK")
+    else:
+      finish(comment_file_path, "NOT OK")
+  except Exception as e:
+    finish(comment_file_path, "NOT OK")
+
+def _test_unset(comment_file_path, student_dir):
+  start_test(comment_file_path, "unset removes a variable from the shell and the environment")
+  try:
+    lines, stderr = run_with_env("export MYSH_EXPORTED=3\nunset MYSH_EXPORTED\nenv\necho x$MYSH_EXPORTED",
+                                 {"PATH": os.environ["PATH"]})
+    exported = [line for line in lines if line.startswith("MYSH_EXPORTED=")]
+    if not exported and "x" in lines and not stderr:
+      finish(comment_file_path, "OK")
+    else:
+      finish(comment_file_path, "NOT OK")
+  except Exception as e:
+    finish(comment_file_path, "NOT OK")
+
+def _test_inherited(comment_file_path, student_dir):
+  start_test(comment_file_path, "Variables of the shell's environment can be expanded")
+  try:
+    lines, stderr = run_with_env("echo $MYSH_INHERITED",
+                                 {"PATH": os.environ["PATH"], "MYSH_INHERITED": "from-env"})
+    if lines[0] == "from-env" and not stderr:
+      finish(comment_file_path, "OK")
+    else:
+      finish(comment_file_path, "NOT OK")
+  except Exception as e:
+    finish(comment_file_path, "NOT OK")
+
+
 def test_variables_suite(comment_file_path, student_dir):
   start_suite(comment_file_path, "Simple variables accesses")
   start_with_timeout(_test_access, comment_file_path, timeout=TESTS_TIMEOUT_M2)
@@ -335,3 +391,10 @@ def test_variables_suite(comment_file_path, student_dir):
   start_suite(comment_file_path, "Advanced tests")
   start_with_timeout(_test_access_100, comment_file_path, timeout=10)   # bigger timeout due to more commands
   end_suite(comment_file_path) 
+
+  start_suite(comment_file_path, "Exported variables")
+  start_with_timeout(_test_export_env, comment_file_path, timeout=TESTS_TIMEOUT_M2)
+  start_with_timeout(_test_export_list, comment_file_path, timeout=TESTS_TIMEOUT_M2)
+  start_with_timeout(_test_unset, comment_file_path, timeout=TESTS_TIMEOUT_M2)
+  start_with_timeout(_test_inherited, comment_file_path, timeout=TESTS_TIMEOUT_M2)
+  end_suite(comment_file_path)
@@ -94,6 +94,100 @@ def _test_multiline(comment_file_path, student_dir):
   remove_file(student_dir + "/testfile.txt")
 
 
+def write_cat_files(student_dir):
+  """Create a short file a and a file b larger than any pipe or buffer.
+  Return: (contents of a, contents of b)"""
+  a = b"first file\n"
+  b = b"".join(b"line %d of the second file\n" % i for i in range(20000))
+  with open(student_dir + "/cat_a.txt", "wb") as f:
+    f.write(a)
+  with open(student_dir + "/cat_b.txt", "wb") as f:
+    f.write(b)
+  return a, b
+
+def remove_cat_files(student_dir):
+  remove_file(student_dir + "/cat_a.txt")
+  remove_file(student_dir + "/cat_b.txt")
+
+def run_cat(commands, stdout=PIPE):
+  p = Popen(['./mysh', '-c', commands], stdout=stdout, stderr=PIPE)
+  out, err = p.communicate(timeout=3)
+  return out, err.decode(), p.returncode
+
+def _test_several_files(comment_file_path, student_dir):
+  start_test(comment_file_path, "cat prints several files in order")
+  a, b = write_cat_files(student_dir)
+  try:
+    out, err, status = run_cat("cat cat_a.txt cat_b.txt cat_a.txt")
+    if out == a + b + a and not err and status == 0:
+      finish(comment_file_path, "OK")
+    else:
+      finish(comment_file_path, "NOT OK")
+  except Exception as e:
+    finish(comment_file_path, "NOT OK")
+  remove_cat_files(student_dir)
+
+def _test_missing_file(comment_file_path, student_dir):
+  start_test(comment_file_path, "cat reports a missing file and still prints the others")
+  a, b = write_cat_files(student_dir)
+  try:
+    out, err, status = run_cat("cat cat_a.txt cat_missing.txt cat_b.txt")
+    if out == a + b and "ERROR: Cannot open file" in err and status != 0:
+      finish(comment_file_path, "OK")
+    else:
+      finish(comment_file_path, "NOT OK")
+  except Exception as e:
+    finish(comment_file_path, "NOT OK")
+  remove_cat_files(student_dir)
+
+def _test_cat_to_pipe(comment_file_path, student_dir):
+  start_test(comment_file_path, "cat into a pipe, to a process and to a builtin")
+  a, b = write_cat_files(student_dir)
+  try:
+    # The shell's stdout, then an external stage's stdin, are kernel pipes
+    out, err, status = run_cat("cat cat_b.txt\ncat cat_b.txt | /bin/cat")
+    wc_out, wc_err, wc_status = run_cat("cat cat_b.txt | wc")
+    expected_wc = "word count {}\ncharacter count {}\nnewline count {}\n".format(
+        len(b.split()), len(b), b.count(b"\n"))
+    if out == b + b and wc_out.decode() == expected_wc and not err + wc_err:
+      finish(comment_file_path, "OK")
+    else:
+      finish(comment_file_path, "NOT OK")
+  except Exception as e:
+    finish(comment_file_path, "NOT OK")
+  remove_cat_files(student_dir)
+
+def _test_cat_to_file(comment_file_path, student_dir):
+  start_test(comment_file_path, "cat into a file")
+  a, b = write_cat_files(student_dir)
+  out_path = student_dir + "/cat_out.txt"
+  try:
+    with open(out_path, "wb") as f:
+      out, err, status = run_cat("cat cat_b.txt cat_a.txt", stdout=f)
+    with open(out_path, "rb") as f:
+      written = f.read()
+    if written == b + a and not err and status == 0:
+      finish(comment_file_path, "OK")
+    else:
+      finish(comment_file_path, "NOT OK")
+  except Exception as e:
+    finish(comment_file_path, "NOT OK")
+  remove_file(out_path)
+  remove_cat_files(student_dir)
+
+def _test_output_order(comment_file_path, student_dir):
+  start_test(comment_file_path, "Output buffered before cat stays ahead of it")
+  a, b = write_cat_files(student_dir)
+  try:
+    out, err, status = run_cat("echo before\ncat cat_a.txt\necho after")
+    if out == b"before\n" + a + b"after\n" and not err and status == 0:
+      finish(comment_file_path, "OK")
+    else:
+      finish(comment_file_path, "NOT OK")
+  except Exception as e:
+    finish(comment_file_path, "NOT OK")
+  remove_cat_files(student_dir)
+
 
 def test_cat_suite(comment_file_path, student_dir):
   start_suite(comment_file_path, "correct cat argument setup")
@@ -106,3 +200,11 @@ def test_cat_suite(comment_file_path, student_dir):
   start_with_timeout(_test_multiline, comment_file_path, student_dir)
   end_suite(comment_file_path)
   
+
+  start_suite(comment_file_path, "cat with several files and outputs")
+  start_with_timeout(_test_several_files, comment_file_path, student_dir)
+  start_with_timeout(_test_missing_file, comment_file_path, student_dir)
+  start_with_timeout(_test_cat_to_pipe, comment_file_path, student_dir)
+  start_with_timeout(_test_cat_to_file, comment_file_path, student_dir)
+  start_with_timeout(_test_output_order, comment_file_path, student_dir)
+  end_suite(comment_file_path)
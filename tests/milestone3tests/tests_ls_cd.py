@@ -299,6 +299,27 @@ def _test_ls_invalid(comment_file_path, student_dir):
 
 
 
+def _test_ls_many_entries(comment_file_path, student_dir):
+  start_test(comment_file_path, "ls lists every entry of a large directory, long names included")
+  names = ["file{}".format(i) for i in range(300)] + ["n" * 200]
+  reset_folder(student_dir + "/testfolder")
+  for name in names:
+    open(student_dir + "/testfolder/" + name, "w").close()
+
+  try:
+    p = Popen(['./mysh', '-c', 'ls testfolder'], stdout=PIPE, stderr=PIPE)
+    stdout, stderr = p.communicate(timeout=TESTS_TIMEOUT_M1)
+    listed = set(stdout.decode().splitlines())
+    if listed == set(names + ['.', '..']) and not stderr:
+      finish(comment_file_path, "OK")
+    else:
+      finish(comment_file_path, "NOT OK")
+  except Exception as e:
+    finish(comment_file_path, "NOT OK")
+
+  remove_folder(student_dir + "/testfolder")
+
+
 def _test_ls_search(comment_file_path, student_dir):
   start_test(comment_file_path, "ls correctly filters files")
   setup_folder_structure(student_dir + "/testfolder", ["subfile1", "randomfile", "randomfile2", "subfile2"])  
@@ -560,6 +581,7 @@ def test_ls_cd_suite(comment_file_path, student_dir):
   start_suite(comment_file_path, "ls handles edge cases correctly")
   start_with_timeout(_test_variable_filename, comment_file_path, student_dir)
   start_with_timeout(_test_empty_folder, comment_file_path, student_dir)
+  start_with_timeout(_test_ls_many_entries, comment_file_path, student_dir)
   end_suite(comment_file_path)
 
   start_suite(comment_file_path, "ls filters files correctly")
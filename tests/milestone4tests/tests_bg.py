@@ -196,21 +196,249 @@ def _test_count_reset(comment_file_path, student_dir, command_wait=0.05):
     finish(comment_file_path, "NOT OK")
 
 def _test_exceed_limits(comment_file_path, student_dir, command_wait=0.05):
-  start_test(comment_file_path, "Background process line cannot exceed character limits")
+  start_test(comment_file_path, "Background process line is not limited in length")
 
   try:
     p = start('./mysh')
     message = "a" * 150
     write(p, "echo {} &".format(message))
+    sleep(command_wait)
 
-    output = read_stderr(p)
-    if "ERROR: input line too long" in output:
+    output = read_stdout(p) + read_stdout(p)
+    if "[1]" in output and message in output:
       finish(comment_file_path, "OK")
     else:
       finish(comment_file_path, "NOT OK")
   except Exception as e:
     finish(comment_file_path, "NOT OK")
 
+def _test_long_done(comment_file_path, student_dir, command_wait=0.05):
+  start_test(comment_file_path, "Done message holds the whole of a long background command")
+
+  try:
+    p = start('./mysh')
+    message = "b" * 300
+    write(p, "echo {} &".format(message))
+    sleep(command_wait)
+    read_stdout(p)   # Background process creation message
+    read_stdout(p)   # Output of echo
+    sleep(0.5)   # Wait while background job completes
+    write(p, "x=1")
+    output = read_stdout(p)
+    if "[1]+  Done echo {}".format(message) in output:
+      finish(comment_file_path, "OK")
+    else:
+      finish(comment_file_path, "NOT OK")
+  except Exception as e:
+    finish(comment_file_path, "NOT OK")
+
+def background_echo(comment_file_path, setup, command_wait=0.05):
+  """Run echo x & after the setup line (if any) and check its output and
+  its Done message."""
+  try:
+    p = start('./mysh')
+    if setup:
+      write(p, setup)
+    write(p, "echo x &")
+    sleep(0.5)   # Wait while background job completes
+    write(p, "y=1")
+    # Creation message, x (after a prompt) and the Done message, in any order
+    lines = [read_stdout(p) for i in range(3)]
+    started = any("[1] " in line for line in lines)
+    printed = any(line.endswith("x") and "Done" not in line for line in lines)
+    done = any("[1]+  Done echo x" in line for line in lines)
+    if started and printed and done:
+      finish(comment_file_path, "OK")
+    else:
+      finish(comment_file_path, "NOT OK")
+  except Exception as e:
+    finish(comment_file_path, "NOT OK")
+
+def _test_bg_builtin(comment_file_path, student_dir, command_wait=0.05):
+  start_test(comment_file_path, "Background builtin started by the helper prints and completes")
+  background_echo(comment_file_path, None, command_wait)
+
+def _test_bg_builtin_forked(comment_file_path, student_dir, command_wait=0.05):
+  start_test(comment_file_path, "Background builtin with ZYGOTE=0 prints and completes")
+  background_echo(comment_file_path, "ZYGOTE=0", command_wait)
+
+def read_available(p, wait=0.3):
+  """Return: everything the shell printed within wait seconds
+  Prereq: p was started with start_not_blocking"""
+  sleep(wait)
+  output = b""
+  data = p.stdout.read()
+  while data:
+    output += data
+    sleep(0.05)
+    data = p.stdout.read()
+  return output.decode()
+
+def started_jobs(output):
+  """Return: {job id: pid} of the [n] pid lines in output"""
+  jobs = {}
+  for line in output.replace("mysh$ ", "").split("\n"):
+    parts = line.split()
+    if len(parts) == 2 and parts[0].startswith("[") and parts[0].endswith("]") and parts[1].isdigit():
+      jobs[int(parts[0][1:-1])] = int(parts[1])
+  return jobs
+
+def kill_pids(pids):
+  for pid in pids:
+    try:
+      os.kill(pid, 9)
+    except OSError:
+      pass
+
+def _test_job_ids_reused(comment_file_path, student_dir, command_wait=0.05):
+  start_test(comment_file_path, "Job ids start from 1 again once every job is done")
+
+  try:
+    p = start_not_blocking('./mysh')
+    for i in range(3):
+      write(p, "sleep 0.2 &")
+    output = read_available(p)
+    first = started_jobs(output)
+    sleep(0.5)   # Wait while background jobs complete
+    write(p, "x=1")
+    done = output + read_available(p)
+    for i in range(3):
+      write(p, "sleep 0.2 &")
+    second = started_jobs(read_available(p))
+    if sorted(first) == sorted(second) == [1, 2, 3] and done.count("Done sleep 0.2") == 3:
+      finish(comment_file_path, "OK")
+    else:
+      finish(comment_file_path, "NOT OK")
+  except Exception as e:
+    finish(comment_file_path, "NOT OK")
+
+def _test_many_jobs(comment_file_path, student_dir, command_wait=0.05):
+  start_test(comment_file_path, "Many concurrent background jobs are all tracked and reported Done")
+
+  count = 40
+  try:
+    p = start_not_blocking('./mysh')
+    for i in range(count):
+      write(p, "sleep 1 &")
+    output = read_available(p)
+    jobs = started_jobs(output)
+    write(p, "ps")
+    listing = read_available(p)
+    listed = listing.count("sleep 1 ")
+    sleep(1)   # Wait while background jobs complete
+    write(p, "x=1")
+    done = output + listing + read_available(p)
+    finished = [n for n in range(1, count + 1) if "[{}]+  Done sleep 1".format(n) in done]
+    if sorted(jobs) == list(range(1, count + 1)) and listed == count and len(finished) == count:
+      finish(comment_file_path, "OK")
+    else:
+      finish(comment_file_path, "NOT OK")
+  except Exception as e:
+    finish(comment_file_path, "NOT OK")
+
+def _test_ps_reused_slot(comment_file_path, student_dir, command_wait=0.05):
+  start_test(comment_file_path, "ps lists jobs correctly after a freed job id is reused")
+
+  pids = []
+  try:
+    p = start_not_blocking('./mysh')
+    write(p, "sleep 3 &")
+    write(p, "sleep 0.2 &")
+    write(p, "sleep 4 &")
+    jobs = started_jobs(read_available(p))
+    pids = list(jobs.values())
+    sleep(0.5)   # Job 2 completes
+    write(p, "x=1")
+    read_available(p)
+    write(p, "sleep 5 &")
+    reused = started_jobs(read_available(p))
+    pids += list(reused.values())
+    write(p, "ps")
+    listing = read_available(p).replace("mysh$ ", "").split("\n")
+    expected = ["sleep 3 {}".format(jobs[1]), "sleep 5 {}".format(reused.get(2)),
+                "sleep 4 {}".format(jobs[3])]
+    if list(reused) == [2] and all(line in listing for line in expected) and \
+       "sleep 0.2 {}".format(jobs[2]) not in listing:
+      finish(comment_file_path, "OK")
+    else:
+      finish(comment_file_path, "NOT OK")
+  except Exception as e:
+    finish(comment_file_path, "NOT OK")
+  kill_pids(pids)
+
+def children_of(ppid, name):
+  """Return: {pid: process group} of the children of ppid called name"""
+  children = {}
+  for entry in os.listdir("/proc"):
+    if not entry.isdigit():
+      continue
+    try:
+      with open("/proc/{}/stat".format(entry)) as f:
+        stat = f.read()
+    except OSError:
+      continue
+    # pid (comm) state ppid pgrp ...
+    comm = stat[stat.index("(") + 1:stat.rindex(")")]
+    fields = stat[stat.rindex(")") + 2:].split()
+    if comm == name and int(fields[1]) == ppid:
+      children[int(entry)] = int(fields[2])
+  return children
+
+def alive(pid):
+  """Return: True unless pid is gone (reaped) or a zombie"""
+  try:
+    with open("/proc/{}/stat".format(pid)) as f:
+      return f.read().split(")")[-1].split()[0] != "Z"
+  except OSError:
+    return False
+
+def _test_pipeline_group(comment_file_path, student_dir, command_wait=0.05):
+  start_test(comment_file_path, "A background pipeline is one process group, Done after its last stage")
+
+  try:
+    p = start_not_blocking('./mysh')
+    write(p, "sleep 1 | sleep 2.5 &")
+    sleep(0.2)
+    groups = children_of(p.pid, "sleep")
+    sleep(1)   # The first stage has exited, the second still runs
+    write(p, "x=1")
+    output = read_available(p)
+    early = "Done" in output
+    sleep(1.5)   # The second stage exits
+    write(p, "x=1")
+    output += read_available(p)
+    # Both in the group led by the first stage, not in the shell's
+    pgids = set(groups.values())
+    own_group = len(groups) == 2 and len(pgids) == 1 and next(iter(pgids)) in groups and \
+                os.getpgid(p.pid) not in pgids
+    if own_group and not early and "[1]+  Done sleep 1 | sleep 2.5" in output:
+      finish(comment_file_path, "OK")
+    else:
+      finish(comment_file_path, "NOT OK")
+  except Exception as e:
+    finish(comment_file_path, "NOT OK")
+
+def _test_pipeline_kill(comment_file_path, student_dir, command_wait=0.05):
+  start_test(comment_file_path, "kill on a background pipeline stops every stage")
+
+  groups = {}
+  try:
+    p = start_not_blocking('./mysh')
+    write(p, "sleep 40 | sleep 41 &")
+    jobs = started_jobs(read_available(p))
+    groups = children_of(p.pid, "sleep")
+    write(p, "kill {}".format(jobs[1]))
+    output = read_available(p, 0.5)
+    write(p, "x=1")
+    output += read_available(p)
+    if len(groups) == 2 and not any(alive(pid) for pid in groups) and "[1]+  Done" in output:
+      finish(comment_file_path, "OK")
+    else:
+      finish(comment_file_path, "NOT OK")
+  except Exception as e:
+    finish(comment_file_path, "NOT OK")
+  kill_pids(groups)
+
 # BG integration tests
 
 def _test_bg_pipes(comment_file_path, student_dir, command_wait=0.05, length_cutoff=35):
@@ -246,13 +474,24 @@ def test_bg_suite(comment_file_path, student_dir):
   start_suite(comment_file_path, "Background jobs finish correctly")
   start_with_timeout(_test_bg_completes, comment_file_path, student_dir, timeout=6)
   start_with_timeout(_test_bg_terminates, comment_file_path, student_dir, timeout=6)
+  start_with_timeout(_test_bg_builtin, comment_file_path, student_dir, timeout=6)
+  start_with_timeout(_test_bg_builtin_forked, comment_file_path, student_dir, timeout=6)
   end_suite(comment_file_path)
   
   start_suite(comment_file_path, "bg edge cases")
   start_with_timeout(_test_count_reset, comment_file_path, student_dir, timeout=6)
   start_with_timeout(_test_exceed_limits, comment_file_path, student_dir, timeout=6)
+  start_with_timeout(_test_long_done, comment_file_path, student_dir, timeout=6)
+  end_suite(comment_file_path)
+
+  start_suite(comment_file_path, "bg job table")
+  start_with_timeout(_test_job_ids_reused, comment_file_path, student_dir, timeout=6)
+  start_with_timeout(_test_many_jobs, comment_file_path, student_dir, timeout=8)
+  start_with_timeout(_test_ps_reused_slot, comment_file_path, student_dir, timeout=6)
   end_suite(comment_file_path)
 
   start_suite(comment_file_path, "bg integrations tests")
   start_with_timeout(_test_bg_pipes, comment_file_path, student_dir, timeout=6)
+  start_with_timeout(_test_pipeline_group, comment_file_path, student_dir, timeout=6)
+  start_with_timeout(_test_pipeline_kill, comment_file_path, student_dir, timeout=6)
   end_suite(comment_file_path)
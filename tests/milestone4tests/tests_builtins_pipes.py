@@ -229,13 +229,13 @@ def _test_redefine_echo(comment_file_path, student_dir, command_wait=0.05):
 
 # Pipe Error Handling 
 def _test_long_line(comment_file_path, student_dir, command_wait=0.05):
-    start_test(comment_file_path, "Pipe line cannot exceed the character limit")
+    start_test(comment_file_path, "Pipe line is not limited in length")
 
     try:
         p = start('./mysh')
         write(p,"echo bigword1bigword1bigword1 | echo bigword2bigword2bigword2 | echo bigword3bigword3bigword3 | echo bigword4bigword4bigword4 | echo bigword5bigword5bigword5")
-        output = read_stderr(p)
-        if "ERROR: input line too long" not in output:
+        output = read_stdout(p)
+        if "bigword5bigword5bigword5" not in output or not stderr_empty(p):
             finish(comment_file_path, "NOT OK") 
             return 
         
@@ -356,6 +356,168 @@ def _test_echo_cat_wc(comment_file_path, student_dir, command_wait=0.05):
 
 
 
+# Pipeline options
+
+def _test_pipe_timeout(comment_file_path, student_dir, command_wait=0.05):
+    start_test(comment_file_path, "PIPETIMEOUT stops a slow pipeline and sets status 124")
+    try:
+        started = datetime.datetime.now()
+        p = Popen(['./mysh', '-c', 'PIPETIMEOUT=200 sleep 5 | cat'], stdout=PIPE, stderr=PIPE)
+        stdout, stderr = p.communicate(timeout=4)
+        elapsed = (datetime.datetime.now() - started).total_seconds()
+        if elapsed < 2 and "ERROR: Pipeline timed out" in stderr.decode() and p.returncode == 124:
+            finish(comment_file_path, "OK")
+        else:
+            finish(comment_file_path, "NOT OK")
+    except Exception as e:
+        finish(comment_file_path, "NOT OK")
+
+def _test_pipe_timeout_builtin(comment_file_path, student_dir, command_wait=0.05):
+    start_test(comment_file_path, "PIPETIMEOUT stops a builtin stage blocked on its input")
+    fifo = student_dir + "/mysh_timeout_fifo"
+    writer = -1
+    try:
+        remove_folder(fifo)
+        os.mkfifo(fifo)
+        writer = os.open(fifo, os.O_RDWR)   # A writer that never writes
+        started = datetime.datetime.now()
+        p = Popen(['./mysh', '-c', 'PIPETIMEOUT=300 echo hi | cat mysh_timeout_fifo | wc'],
+                  stdout=PIPE, stderr=PIPE)
+        stdout, stderr = p.communicate(timeout=4)
+        elapsed = (datetime.datetime.now() - started).total_seconds()
+        if elapsed < 2 and "ERROR: Pipeline timed out" in stderr.decode() and p.returncode == 124:
+            finish(comment_file_path, "OK")
+        else:
+            finish(comment_file_path, "NOT OK")
+    except Exception as e:
+        finish(comment_file_path, "NOT OK")
+    finally:
+        if writer != -1:
+            os.close(writer)
+        remove_folder(fifo)
+
+def _test_no_pipe_timeout(comment_file_path, student_dir, command_wait=0.05):
+    start_test(comment_file_path, "Without PIPETIMEOUT a slow stage runs to completion")
+    try:
+        started = datetime.datetime.now()
+        p = Popen(['./mysh', '-c', 'sleep 1 | echo done'], stdout=PIPE, stderr=PIPE)
+        stdout, stderr = p.communicate(timeout=4)
+        elapsed = (datetime.datetime.now() - started).total_seconds()
+        if elapsed >= 1 and stdout == b"done\n" and not stderr and p.returncode == 0:
+            finish(comment_file_path, "OK")
+        else:
+            finish(comment_file_path, "NOT OK")
+    except Exception as e:
+        finish(comment_file_path, "NOT OK")
+
+PIPE_READER = "mysh_pipe_reader.py"
+PIPE_BYTES = 8000000
+
+def pipe_size_run(option):
+    """Run head -c PIPE_BYTES /dev/zero | reader with the PIPESIZE option.
+    The reader waits (so the pipe fills up), then prints the capacity of
+    its stdin pipe and the number of bytes it read.
+    Return: (capacity, bytes) or None"""
+    with open(PIPE_READER, "w") as f:
+        f.write("#!/usr/bin/env python3\n"
+                "import fcntl, sys, time\n"
+                "time.sleep(0.5)\n"
+                "size = fcntl.fcntl(0, 1032)   # F_GETPIPE_SZ\n"
+                "count = 0\n"
+                "data = sys.stdin.buffer.read1(1 << 20)\n"
+                "while data:\n"
+                "    count += len(data)\n"
+                "    data = sys.stdin.buffer.read1(1 << 20)\n"
+                "print(size, count)\n")
+    os.chmod(PIPE_READER, 0o755)
+    try:
+        command = "{}head -c {} /dev/zero | ./{}".format(option, PIPE_BYTES, PIPE_READER)
+        p = Popen(['./mysh', '-c', command], stdout=PIPE, stderr=PIPE)
+        stdout, stderr = p.communicate(timeout=3)
+        if stderr or p.returncode != 0:
+            return None
+        return tuple(int(n) for n in stdout.split())
+    finally:
+        remove_file(PIPE_READER)
+
+def _test_pipe_size_fixed(comment_file_path, student_dir, command_wait=0.05):
+    start_test(comment_file_path, "PIPESIZE=1m gives the pipeline's pipes 1 MiB")
+    try:
+        if pipe_size_run("PIPESIZE=1m ") == (1024 * 1024, PIPE_BYTES):
+            finish(comment_file_path, "OK")
+        else:
+            finish(comment_file_path, "NOT OK")
+    except Exception as e:
+        finish(comment_file_path, "NOT OK")
+
+def _test_pipe_size_auto(comment_file_path, student_dir, command_wait=0.05):
+    start_test(comment_file_path, "PIPESIZE=auto grows a full pipe")
+    try:
+        result = pipe_size_run("PIPESIZE=auto ")
+        if result is not None and result[0] > 65536 and result[1] == PIPE_BYTES:
+            finish(comment_file_path, "OK")
+        else:
+            finish(comment_file_path, "NOT OK")
+    except Exception as e:
+        finish(comment_file_path, "NOT OK")
+
+def _test_pipe_size_invalid(comment_file_path, student_dir, command_wait=0.05):
+    start_test(comment_file_path, "An invalid PIPESIZE keeps the default pipe size")
+    try:
+        if pipe_size_run("PIPESIZE=bogus ") == pipe_size_run("") == (65536, PIPE_BYTES):
+            finish(comment_file_path, "OK")
+        else:
+            finish(comment_file_path, "NOT OK")
+    except Exception as e:
+        finish(comment_file_path, "NOT OK")
+
+# Long pipelines
+
+LONG_PIPELINE_STAGES = 400
+
+def _long_pipeline(comment_file_path, stage):
+    """Run echo hi through LONG_PIPELINE_STAGES copies of stage."""
+    try:
+        command = "echo hi" + " | {}".format(stage) * LONG_PIPELINE_STAGES
+        p = Popen(['./mysh', '-c', command], stdout=PIPE, stderr=PIPE)
+        stdout, stderr = p.communicate(timeout=3)
+        if stdout == b"hi\n" and not stderr and p.returncode == 0:
+            finish(comment_file_path, "OK")
+        else:
+            finish(comment_file_path, "NOT OK")
+    except Exception as e:
+        finish(comment_file_path, "NOT OK")
+
+def _test_long_pipeline_external(comment_file_path, student_dir, command_wait=0.05):
+    start_test(comment_file_path, "A pipeline of {} /bin/cat stages".format(LONG_PIPELINE_STAGES))
+    _long_pipeline(comment_file_path, "/bin/cat")
+
+def _test_long_pipeline_builtin(comment_file_path, student_dir, command_wait=0.05):
+    start_test(comment_file_path, "A pipeline of {} builtin cat stages".format(LONG_PIPELINE_STAGES))
+    _long_pipeline(comment_file_path, "cat")
+
+def _test_no_stray_fds(comment_file_path, student_dir, command_wait=0.05):
+    start_test(comment_file_path, "An external stage inherits no other stage's pipe ends")
+    try:
+        # ls holds one fd of its own on /proc/self/fd; no fd past 2 may be a pipe
+        command = "echo x" + " | cat | /bin/cat" * 10 + " | /bin/ls -l /proc/self/fd | /bin/cat"
+        p = Popen(['./mysh', '-c', command], stdout=PIPE, stderr=PIPE)
+        stdout, stderr = p.communicate(timeout=3)
+        fds = {}
+        for line in stdout.decode().splitlines():
+            if " -> " in line:
+                name, target = line.split(" -> ", 1)
+                fds[int(name.split()[-1])] = target
+        extra = [fd for fd in fds if fd > 2]
+        if (not stderr and fds[0].startswith("pipe:") and fds[1].startswith("pipe:")
+                and len(extra) <= 1 and not any(fds[fd].startswith("pipe:") for fd in extra)):
+            finish(comment_file_path, "OK")
+        else:
+            finish(comment_file_path, "NOT OK")
+    except Exception as e:
+        finish(comment_file_path, "NOT OK")
+
+
 def test_builtin_pipes_suite(comment_file_path, student_dir):
     start_suite(comment_file_path, "Sample echo pipes")
     start_with_timeout(_test_echo_pipe, comment_file_path,  student_dir)
@@ -400,6 +562,21 @@ def test_builtin_pipes_suite(comment_file_path, student_dir):
     start_with_timeout(_test_echo_cat_wc, comment_file_path, student_dir)
     end_suite(comment_file_path)
 
+    start_suite(comment_file_path, "Long pipelines")
+    start_with_timeout(_test_long_pipeline_external, comment_file_path, student_dir)
+    start_with_timeout(_test_long_pipeline_builtin, comment_file_path, student_dir)
+    start_with_timeout(_test_no_stray_fds, comment_file_path, student_dir)
+    end_suite(comment_file_path)
+
     
     remove_folder(student_dir + "/testfolder")
     
+
+    start_suite(comment_file_path, "Pipeline options")
+    start_with_timeout(_test_pipe_timeout, comment_file_path, student_dir)
+    start_with_timeout(_test_pipe_timeout_builtin, comment_file_path, student_dir)
+    start_with_timeout(_test_no_pipe_timeout, comment_file_path, student_dir)
+    start_with_timeout(_test_pipe_size_fixed, comment_file_path, student_dir)
+    start_with_timeout(_test_pipe_size_auto, comment_file_path, student_dir)
+    start_with_timeout(_test_pipe_size_invalid, comment_file_path, student_dir)
+    end_suite(comment_file_path)
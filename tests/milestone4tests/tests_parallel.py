@@ -0,0 +1,115 @@
+from subprocess import CalledProcessError, STDOUT, check_output, TimeoutExpired, Popen, PIPE 
+import os
+import sys
+sys.path.append("..")
+from tests_helpers import *
+
+
+PARALLEL_JOB = "mysh_parallel_job.sh"
+
+def run_command_string(commands, timeout=3):
+  """Run commands with mysh -c. Return: (stdout, stderr, exit status)"""
+  p = Popen(['./mysh', '-c', commands], stdout=PIPE, stderr=PIPE)
+  stdout, stderr = p.communicate(timeout=timeout)
+  return stdout, stderr, p.returncode
+
+def write_parallel_job(body):
+  """Write PARALLEL_JOB, a sh script that sleeps $1 seconds around body."""
+  with open(PARALLEL_JOB, "w") as f:
+    f.write("#!/bin/sh\n" + body)
+  os.chmod(PARALLEL_JOB, 0o755)
+
+
+def _test_parallel_jobs(comment_file_path, student_dir):
+  start_test(comment_file_path, "parallel -j 2 runs the command once per ::: argument")
+  try:
+    stdout, stderr, status = run_command_string("parallel -j 2 echo ::: a b c")
+    if sorted(stdout.decode().split("\n")[:-1]) == ["a", "b", "c"] and not stderr and status == 0:
+      finish(comment_file_path, "OK")
+    else:
+      finish(comment_file_path, "NOT OK")
+  except Exception:
+    finish(comment_file_path, "NOT OK")
+
+
+def _test_parallel_overlap(comment_file_path, student_dir):
+  start_test(comment_file_path, "parallel -j 3 prints jobs as they finish, shortest first")
+  try:
+    write_parallel_job("sleep $1\necho $1\n")
+    # One at a time, the jobs would finish in argument order
+    stdout, stderr, status = run_command_string("parallel -j 3 ./{} ::: 0.9 0.1 0.5".format(PARALLEL_JOB))
+    if stdout == b"0.1\n0.5\n0.9\n" and not stderr and status == 0:
+      finish(comment_file_path, "OK")
+    else:
+      finish(comment_file_path, "NOT OK")
+  except Exception:
+    finish(comment_file_path, "NOT OK")
+  finally:
+    remove_file(PARALLEL_JOB)
+
+
+def _test_parallel_keep_order(comment_file_path, student_dir):
+  start_test(comment_file_path, "parallel -k prints in argument order when jobs overlap")
+  try:
+    write_parallel_job("start=$(date +%s.%N)\nsleep $1\necho $1 $start $(date +%s.%N)\n")
+    stdout, stderr, status = run_command_string("parallel -k -j 3 ./{} ::: 0.6 0.2 0.4".format(PARALLEL_JOB))
+    jobs = [line.split() for line in stdout.decode().split("\n")[:-1]]
+    # Every job starts before any job ends
+    overlap = max(float(job[1]) for job in jobs) < min(float(job[2]) for job in jobs)
+    if [job[0] for job in jobs] == ["0.6", "0.2", "0.4"] and overlap and not stderr and status == 0:
+      finish(comment_file_path, "OK")
+    else:
+      finish(comment_file_path, "NOT OK")
+  except Exception:
+    finish(comment_file_path, "NOT OK")
+  finally:
+    remove_file(PARALLEL_JOB)
+
+
+def _test_parallel_substitution(comment_file_path, student_dir):
+  start_test(comment_file_path, "parallel replaces {} with the argument, or appends it without {}")
+  try:
+    stdout, stderr, status = run_command_string("parallel -k echo pre-{}-post ::: a b\n"
+                                                "parallel -k echo x ::: a b")
+    if stdout == b"pre-a-post\npre-b-post\nx a\nx b\n" and not stderr and status == 0:
+      finish(comment_file_path, "OK")
+    else:
+      finish(comment_file_path, "NOT OK")
+  except Exception:
+    finish(comment_file_path, "NOT OK")
+
+
+def _test_parallel_stdin(comment_file_path, student_dir):
+  start_test(comment_file_path, "parallel without ::: takes its arguments from input lines")
+  try:
+    stdout, stderr, status = run_command_string("echo a | parallel echo got")
+    if stdout == b"got a\n" and not stderr and status == 0:
+      finish(comment_file_path, "OK")
+    else:
+      finish(comment_file_path, "NOT OK")
+  except Exception:
+    finish(comment_file_path, "NOT OK")
+
+
+def _test_parallel_bad_jobs(comment_file_path, student_dir):
+  start_test(comment_file_path, "parallel rejects -j 0 and -j x")
+  try:
+    ok = True
+    for jobs in ["0", "x"]:
+      stdout, stderr, status = run_command_string("parallel -j {} echo ::: a".format(jobs))
+      if stdout or "ERROR: Invalid job count" not in stderr.decode() or status == 0:
+        ok = False
+    finish(comment_file_path, "OK" if ok else "NOT OK")
+  except Exception:
+    finish(comment_file_path, "NOT OK")
+
+
+def test_parallel_suite(comment_file_path, student_dir):
+  start_suite(comment_file_path, "parallel")
+  start_with_timeout(_test_parallel_jobs, comment_file_path)
+  start_with_timeout(_test_parallel_overlap, comment_file_path)
+  start_with_timeout(_test_parallel_keep_order, comment_file_path)
+  start_with_timeout(_test_parallel_substitution, comment_file_path)
+  start_with_timeout(_test_parallel_stdin, comment_file_path)
+  start_with_timeout(_test_parallel_bad_jobs, comment_file_path)
+  end_suite(comment_file_path)